@@ -0,0 +1,85 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CAPABILITY_CACHE_H__
+#define __CAPABILITY_CACHE_H__
+
+#include <gio/gio.h>
+#include <stdbool.h>
+
+#include "device_io.h"
+
+/*
+ * An on-disk cache of the capabilities of every device seen so far, keyed
+ * by its BlueZ object path (adapter and address).
+ *
+ * The cache is a single compact file that is memory mapped read-only.
+ * Changes take effect in memory right away, and the file is replaced
+ * atomically from a background thread. Entries are decoded on lookup, so a
+ * damaged or outdated file only ever costs a cache miss.
+ */
+
+/*
+ * The immutable part of what a device reports during initialization.
+ *
+ * `model` holds both the model name and the supported functions. The EQ
+ * and key function members are only used if the device supports them.
+ */
+typedef struct
+{
+    device_value_t model;
+    device_value_t eq_capabilities;
+    device_value_t available_button_presets;
+}
+capability_cache_entry_t;
+
+void capability_cache_init(void);
+
+/*
+ * Waits for any pending write of the cache file.
+ */
+void capability_cache_deinit(void);
+
+/*
+ * Fills `entry` with a copy of the cached capabilities for `key`.
+ *
+ * Returns false if there are none.
+ */
+bool capability_cache_lookup(const gchar* key,
+                             capability_cache_entry_t* entry);
+
+/*
+ * Stores `entry` for `key`, replacing any previous entry.
+ *
+ * Returns false if the cache already held exactly this entry.
+ */
+bool capability_cache_store(const gchar* key,
+                            const capability_cache_entry_t* entry);
+
+/*
+ * Drops the entry for `key`, if any.
+ */
+void capability_cache_remove(const gchar* key);
+
+void capability_cache_entry_clear(capability_cache_entry_t*);
+
+#endif /* __CAPABILITY_CACHE_H__ */
@@ -0,0 +1,66 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CHANNEL_H__
+#define __CHANNEL_H__
+
+#include <gio/gio.h>
+#include <stdbool.h>
+
+/*
+ * A one-way message channel between two threads, each running its own
+ * GMainContext.
+ *
+ * Messages are fixed size and copied through a bounded SPSC queue. The
+ * consumer is woken through an eventfd and runs `handler` for every message
+ * in its context. If the queue is full the producer keeps the message in a
+ * local backlog and retries from its own context, so channel_send never
+ * blocks and never drops a message.
+ *
+ * `drained`, if not NULL, is run once after each batch of messages has been
+ * handled.
+ */
+typedef struct channel channel_t;
+
+typedef void (*channel_handler_cb)(void* message, void* user_data);
+
+typedef void (*channel_drained_cb)(void* user_data);
+
+channel_t* channel_new(size_t capacity,
+                       size_t message_size,
+                       GMainContext* producer_context,
+                       GMainContext* consumer_context,
+                       channel_handler_cb handler,
+                       channel_drained_cb drained,
+                       void* user_data);
+
+/*
+ * Must only be called once neither thread uses the channel anymore.
+ */
+void channel_free(channel_t*);
+
+/*
+ * Must only be called from the producer thread.
+ */
+void channel_send(channel_t*, const void* message);
+
+#endif /* __CHANNEL_H__ */
@@ -32,7 +32,42 @@ typedef struct device device_t;
 typedef void (*device_created_cb)(void* user_data);
 typedef void (*device_create_error_cb)(void* user_data);
 
-void devices_init(void);
+/*
+ * With `lazy_properties`, the state of an interface is only queried once a
+ * client first accesses it.
+ *
+ * A device that loses its connection is kept for `reconnect_grace` seconds.
+ * If it connects again in that time its interfaces stay exported and are
+ * only updated. Zero removes it right away.
+ *
+ * A device is announced as connected once it is fully initialized, or
+ * after `init_deadline` seconds with whatever interfaces are ready by then.
+ *
+ * Notifications from a device are held for `coalesce_window` milliseconds
+ * so that their property changes go out together. Zero only merges those
+ * made in one main loop iteration.
+ *
+ * Device command timeouts fire with a granularity of `timer_slack`
+ * milliseconds.
+ *
+ * Does not need the bus connection.
+ */
+void devices_init(bool lazy_properties,
+                  guint reconnect_grace,
+                  guint init_deadline,
+                  guint coalesce_window,
+                  guint timer_slack);
+
+/*
+ * Exports the devices, through an object manager at /, on `connection`.
+ */
+void devices_set_connection(GDBusConnection* connection);
+
+/*
+ * Exports the devices on `peer`, a direct connection to a client, as well.
+ * They stay exported there until the connection is closed.
+ */
+void devices_add_peer(GDBusConnection* peer);
 
 void devices_deinit(void);
 
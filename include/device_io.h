@@ -0,0 +1,308 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DEVICE_IO_H__
+#define __DEVICE_IO_H__
+
+#include <gio/gio.h>
+#include <stdbool.h>
+
+#include "mdr/device.h"
+
+/*
+ * Runs every device socket and all libmdr processing on a dedicated I/O
+ * thread with its own GMainContext.
+ *
+ * The D-Bus (default) context talks to it exclusively through two SPSC
+ * channels: commands flow to the I/O thread and decoded results and
+ * notifications flow back as events. Neither side ever touches the other
+ * side's state.
+ *
+ * Commands for a device are handed to libmdr one at a time. Queued commands
+ * are issued by class: setters (interactive) first, then state reads, then
+ * capability discovery (background). A setter for volume, ambient sound
+ * mode or EQ levels replaces the value of a queued one of the same type,
+ * unless a command queued after it changes the same state (noise
+ * cancelling and ambient sound, or the EQ). The replaced command's result
+ * callback runs with the surviving one's.
+ */
+typedef struct device_io device_io_t;
+
+typedef enum
+{
+    DEVICE_COMMAND_CONNECT,
+    DEVICE_COMMAND_DISCONNECT,
+    DEVICE_COMMAND_QUIT,
+    // Answered by the I/O thread itself, without talking to the device.
+    DEVICE_COMMAND_GET_IO_STATS,
+
+    DEVICE_COMMAND_INIT,
+    DEVICE_COMMAND_GET_MODEL_NAME,
+    DEVICE_COMMAND_POWER_OFF,
+    DEVICE_COMMAND_GET_BATTERY,
+    DEVICE_COMMAND_GET_LEFT_RIGHT_BATTERY,
+    DEVICE_COMMAND_GET_CRADLE_BATTERY,
+    DEVICE_COMMAND_GET_LEFT_RIGHT_CONNECTION_STATUS,
+    DEVICE_COMMAND_GET_NOISE_CANCELLING,
+    DEVICE_COMMAND_ENABLE_NOISE_CANCELLING,
+    DEVICE_COMMAND_DISABLE_NCASM,
+    DEVICE_COMMAND_GET_AMBIENT_SOUND_MODE,
+    DEVICE_COMMAND_ENABLE_AMBIENT_SOUND_MODE,
+    DEVICE_COMMAND_GET_EQ_CAPABILITIES,
+    DEVICE_COMMAND_GET_EQ_PRESET_AND_LEVELS,
+    DEVICE_COMMAND_SET_EQ_PRESET,
+    DEVICE_COMMAND_SET_EQ_LEVELS,
+    DEVICE_COMMAND_GET_AUTO_POWER_OFF,
+    DEVICE_COMMAND_ENABLE_AUTO_POWER_OFF,
+    DEVICE_COMMAND_DISABLE_AUTO_POWER_OFF,
+    DEVICE_COMMAND_GET_AVAILABLE_BUTTON_PRESETS,
+    DEVICE_COMMAND_GET_ACTIVE_BUTTON_PRESETS,
+    DEVICE_COMMAND_SET_ACTIVE_BUTTON_PRESETS,
+    DEVICE_COMMAND_GET_VOLUME,
+    DEVICE_COMMAND_SET_VOLUME,
+}
+device_command_type_t;
+
+/*
+ * Arguments of a command or the value carried by an event.
+ *
+ * Which member is used depends on the command type. Pointers are heap
+ * allocated and owned by the message; they are released by whichever side
+ * consumes it.
+ */
+typedef union
+{
+    struct
+    {
+        gint sock;
+    }
+    connect;
+
+    // Also the result of DEVICE_COMMAND_INIT, without a name.
+    struct
+    {
+        gchar* name;
+        mdr_device_supported_functions_t supported_functions;
+    }
+    model;
+
+    struct
+    {
+        uint8_t level;
+        bool charging;
+    }
+    battery;
+
+    struct
+    {
+        uint8_t left_level;
+        bool left_charging;
+        uint8_t right_level;
+        bool right_charging;
+    }
+    left_right_battery;
+
+    struct
+    {
+        bool left_connected;
+        bool right_connected;
+    }
+    left_right_connection_status;
+
+    struct
+    {
+        bool enabled;
+    }
+    noise_cancelling;
+
+    struct
+    {
+        uint8_t amount;
+        bool voice;
+    }
+    ambient_sound_mode;
+
+    struct
+    {
+        uint8_t band_count;
+        uint8_t level_steps;
+        uint8_t num_presets;
+        mdr_packet_eqebb_eq_preset_id_t* presets;
+    }
+    eq_capabilities;
+
+    struct
+    {
+        mdr_packet_eqebb_eq_preset_id_t preset_id;
+        uint8_t num_levels;
+        uint8_t* levels;
+    }
+    eq_preset_and_levels;
+
+    struct
+    {
+        bool enabled;
+        mdr_packet_system_auto_power_off_element_id_t timeout;
+    }
+    auto_power_off;
+
+    struct
+    {
+        uint8_t num_keys;
+        mdr_packet_system_assignable_settings_capability_key_t* keys;
+    }
+    available_button_presets;
+
+    struct
+    {
+        uint8_t num_presets;
+        mdr_packet_system_assignable_settings_preset_t* presets;
+    }
+    active_button_presets;
+
+    struct
+    {
+        uint8_t volume;
+    }
+    playback;
+
+    // Per command class ("interactive", "state-sync", "background") and
+    // for the connection as a whole, as a{sa{st}}.
+    struct
+    {
+        GVariant* stats;
+    }
+    io_stats;
+}
+device_value_t;
+
+typedef enum
+{
+    // A command completed successfully.
+    DEVICE_EVENT_RESULT,
+    // A command failed.
+    DEVICE_EVENT_ERROR,
+    // The device reported a new value for the getter in `command`.
+    DEVICE_EVENT_UPDATE,
+    // The socket was hung up by the remote end.
+    DEVICE_EVENT_HANGUP,
+    // The connection has been closed; no more events will follow.
+    DEVICE_EVENT_CLOSED,
+}
+device_event_type_t;
+
+typedef struct device_event device_event_t;
+
+typedef void (*device_io_result_cb)(const device_event_t* event,
+                                    void* user_data);
+
+typedef void (*device_io_event_cb)(const device_event_t* event);
+
+typedef struct
+{
+    device_command_type_t type;
+    device_io_t* io;
+    device_value_t value;
+
+    device_io_result_cb result_cb;
+    void* user_data;
+}
+device_command_t;
+
+struct device_event
+{
+    device_event_type_t type;
+    device_command_type_t command;
+    void* owner;
+    device_value_t value;
+
+    device_io_result_cb result_cb;
+    void* user_data;
+};
+
+/*
+ * Starts the I/O thread.
+ *
+ * `event_cb` is called in the default context for every event that is not
+ * the result of a command.
+ *
+ * Command timeouts fire with a granularity of `timer_slack` milliseconds.
+ * Larger values mean fewer wakeups with many idle devices, at the cost of
+ * timeouts firing later.
+ */
+void device_io_init(device_io_event_cb event_cb, guint timer_slack);
+
+/*
+ * Stops the I/O thread once it has handled every command submitted so far.
+ *
+ * Connections are not closed: disconnect them first. Events still pending
+ * for the D-Bus thread, including DEVICE_EVENT_CLOSED, are dropped.
+ */
+void device_io_deinit(void);
+
+/*
+ * Takes ownership of `sock` and starts servicing it on the I/O thread.
+ *
+ * `owner` is passed back in every event for this connection. If the
+ * connection fails the handle is released before `result_cb` is called.
+ */
+device_io_t* device_io_connect(gint sock,
+                               void* owner,
+                               device_io_result_cb result_cb,
+                               void* user_data);
+
+/*
+ * Closes the connection. The handle must not be used afterwards; a
+ * DEVICE_EVENT_CLOSED event is sent once it is gone.
+ */
+void device_io_disconnect(device_io_t*);
+
+/*
+ * Frees any heap allocated members of `value` for the given command type.
+ */
+void device_value_clear(device_command_type_t, device_value_t* value);
+
+/*
+ * Returns true if `a` and `b` hold the same state.
+ *
+ * Only defined for the getters that devices report updates for; false for
+ * any other command type.
+ */
+bool device_value_equal(device_command_type_t,
+                        const device_value_t* a,
+                        const device_value_t* b);
+
+/*
+ * Copies `src` into `dst`, duplicating any heap allocated members.
+ */
+void device_value_copy(device_command_type_t,
+                       device_value_t* dst,
+                       const device_value_t* src);
+
+/*
+ * Queues `command` for the I/O thread.
+ *
+ * Ownership of any heap allocated arguments is transferred.
+ */
+void device_io_submit(device_io_t*, const device_command_t* command);
+
+#endif /* __DEVICE_IO_H__ */
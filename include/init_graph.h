@@ -0,0 +1,101 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __INIT_GRAPH_H__
+#define __INIT_GRAPH_H__
+
+#include <gio/gio.h>
+
+#include <stdbool.h>
+
+/*
+ * Runs a fixed set of initialization phases in dependency order.
+ *
+ * Each phase lists the phases it depends on as a bitmask and is started as
+ * soon as all of them have succeeded, so independent phases are in progress
+ * at the same time. A phase that fails or is disabled is never depended on:
+ * every phase that needs it is skipped.
+ *
+ * `done_cb` is called once every phase has finished or been skipped. It may
+ * free the graph.
+ */
+typedef struct init_graph init_graph_t;
+
+#define INIT_GRAPH_MAX_PHASES 32
+
+#define INIT_PHASE(phase) (1u << (phase))
+
+/*
+ * Starts `phase`. The phase is completed by calling init_graph_finish,
+ * either from here or later.
+ */
+typedef void (*init_phase_start_cb)(init_graph_t*,
+                                    guint phase,
+                                    void* user_data);
+
+typedef void (*init_graph_done_cb)(init_graph_t*, void* user_data);
+
+typedef struct
+{
+    const gchar* name;
+    guint32 after;
+    init_phase_start_cb start;
+}
+init_phase_t;
+
+/*
+ * `phases` must outlive the graph. The clock used for timings starts here.
+ */
+init_graph_t* init_graph_new(const init_phase_t* phases,
+                             guint num_phases,
+                             init_graph_done_cb done_cb,
+                             void* user_data);
+
+void init_graph_free(init_graph_t*);
+
+/*
+ * Starts every phase without dependencies.
+ */
+void init_graph_run(init_graph_t*);
+
+/*
+ * Skips `phase`, and with it everything that depends on it. Has no effect
+ * once the phase has been started or skipped; returns whether it had any.
+ */
+bool init_graph_disable(init_graph_t*, guint phase);
+
+void init_graph_finish(init_graph_t*, guint phase, bool success);
+
+bool init_graph_succeeded(const init_graph_t*, guint phase);
+
+/*
+ * Whether `phase` has been started and not yet finished.
+ */
+bool init_graph_running(const init_graph_t*, guint phase);
+
+/*
+ * Logs when each phase started and finished relative to init_graph_new,
+ * and the total time.
+ */
+void init_graph_log_timings(const init_graph_t*, const gchar* name);
+
+#endif /* __INIT_GRAPH_H__ */
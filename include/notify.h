@@ -0,0 +1,35 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __NOTIFY_H__
+#define __NOTIFY_H__
+
+#include <gio/gio.h>
+#include <stdbool.h>
+
+/*
+ * Sends `state` (e.g. "READY=1") to the service manager, following the
+ * sd_notify protocol. Does nothing unless NOTIFY_SOCKET is set.
+ */
+bool notify_send(const gchar* state);
+
+#endif /* __NOTIFY_H__ */
@@ -0,0 +1,44 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PEER_SERVER_H__
+#define __PEER_SERVER_H__
+
+#include <gio/gio.h>
+#include <stdbool.h>
+
+/*
+ * Serves the device objects directly to local clients, without going
+ * through the bus daemon.
+ *
+ * Peers connect to `address` (e.g. "unix:path=/run/mdrd/peer") and see the
+ * same object manager and org.mdr.* objects as on the bus. Only peers that
+ * authenticate with their unix credentials and run as root or as the
+ * daemon's user are accepted.
+ *
+ * Returns false if the address cannot be listened on.
+ */
+bool peer_server_start(const gchar* address);
+
+void peer_server_stop(void);
+
+#endif /* __PEER_SERVER_H__ */
@@ -0,0 +1,94 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __POLLER_H__
+#define __POLLER_H__
+
+#include <gio/gio.h>
+
+#include <stdbool.h>
+
+/*
+ * Readiness notification for many fds through a single fd that can be
+ * watched by a GSource.
+ *
+ * When built with MDRD_IO_URING the poller uses io_uring poll requests,
+ * whose completions are signalled through an eventfd, and falls back to
+ * epoll if io_uring cannot be set up at runtime.
+ *
+ * A watch may stop reporting events once one has been returned, until
+ * poller_modify is called for it again (with the same or new conditions).
+ * Changes may be batched until poller_commit.
+ */
+typedef struct poller poller_t;
+typedef struct poller_watch poller_watch_t;
+
+typedef struct
+{
+    void* data;
+    GIOCondition condition;
+}
+poller_event_t;
+
+poller_t* poller_new(void);
+
+void poller_free(poller_t*);
+
+/*
+ * The fd that becomes readable when poller_wait has events to return.
+ */
+gint poller_get_fd(poller_t*);
+
+const char* poller_get_backend_name(poller_t*);
+
+poller_watch_t* poller_add(poller_t*,
+                           gint fd,
+                           GIOCondition condition,
+                           void* data);
+
+/*
+ * Sets the conditions of `watch` and re-arms it.
+ */
+void poller_modify(poller_t*, poller_watch_t* watch, GIOCondition condition);
+
+/*
+ * `watch` is invalid after this returns and its events are no longer
+ * reported.
+ */
+void poller_remove(poller_t*, poller_watch_t* watch);
+
+/*
+ * Submits any pending changes. Must be called before the thread sleeps.
+ */
+void poller_commit(poller_t*);
+
+/*
+ * Whether events are ready even though the poller fd may not be readable.
+ */
+bool poller_has_pending(poller_t*);
+
+/*
+ * Returns up to `max_events` ready events without blocking.
+ */
+int poller_wait(poller_t*, poller_event_t* events, int max_events);
+
+#endif /* __POLLER_H__ */
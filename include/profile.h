@@ -25,11 +25,23 @@
 
 #include <gio/gio.h>
 
+typedef void (*profile_registered_cb)(void* user_data);
+typedef void (*profile_register_error_cb)(void* user_data);
+
+/*
+ * Creates the profile object. Does not need the bus connection.
+ */
 void profile_init(void);
 
 void profile_deinit(void);
 
-void profile_register(void);
+/*
+ * Exports the profile object and registers it with BlueZ without blocking.
+ * One of the callbacks is called once BlueZ has replied.
+ */
+void profile_register(profile_registered_cb,
+                      profile_register_error_cb,
+                      void* user_data);
 
 void profile_unregister(void);
 
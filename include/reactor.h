@@ -0,0 +1,70 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include <gio/gio.h>
+
+#include "mdr/device.h"
+
+/*
+ * A single GSource that multiplexes every device socket through one
+ * poller (epoll, or io_uring when available).
+ *
+ * Poll info for an entry is cached and only re-queried once the entry
+ * has been invalidated, either by being dispatched or by an explicit
+ * call to reactor_invalidate. Write interest is only registered while the
+ * poll info asks for it, and the poller is only updated when that
+ * changes.
+ *
+ * Timeouts of all entries are kept in a shared timer wheel, so the loop
+ * wakes up at most once per `timer_slack` ms and expires every timeout
+ * that falls within it in one batch.
+ */
+typedef struct reactor reactor_t;
+typedef struct reactor_entry reactor_entry_t;
+
+typedef mdr_poll_info (*reactor_poll_cb)(void* user_data);
+
+/*
+ * Called when the entry's fd is ready or its timeout has expired.
+ *
+ * `condition` is 0 on timeout.
+ */
+typedef void (*reactor_ready_cb)(GIOCondition condition, void* user_data);
+
+reactor_t* reactor_new(GMainContext* context, guint timer_slack);
+
+void reactor_free(reactor_t*);
+
+reactor_entry_t* reactor_add(reactor_t*,
+                             gint fd,
+                             reactor_poll_cb,
+                             reactor_ready_cb,
+                             void* user_data);
+
+void reactor_remove(reactor_t*, reactor_entry_t*);
+
+void reactor_invalidate(reactor_t*, reactor_entry_t*);
+
+#endif /* __REACTOR_H__ */
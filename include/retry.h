@@ -0,0 +1,77 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RETRY_H__
+#define __RETRY_H__
+
+#include <gio/gio.h>
+
+#include <stdbool.h>
+
+/*
+ * Exponential backoff with jitter for operations that fail transiently.
+ *
+ * The n:th retry waits a random time between half and all of
+ * `initial_delay` * 2^(n - 1), capped at `max_delay`. Randomizing the
+ * delay keeps devices that failed together from retrying together.
+ */
+typedef struct
+{
+    // In ms.
+    guint initial_delay;
+    guint max_delay;
+
+    // Retries of a single operation.
+    guint max_retries;
+}
+retry_policy_t;
+
+/*
+ * Retries shared by a group of operations, and what became of them.
+ */
+typedef struct
+{
+    guint budget;
+
+    guint retries;
+    guint recovered;
+    guint exhausted;
+}
+retry_state_t;
+
+void retry_state_init(retry_state_t*, guint budget);
+
+/*
+ * Decides whether an operation that has failed `attempts` times should be
+ * tried again. If so, takes a retry from the budget and sets `delay` (ms).
+ */
+bool retry_next(const retry_policy_t*,
+                retry_state_t*,
+                guint attempts,
+                guint* delay);
+
+/*
+ * Records that an operation succeeded after `attempts` failures.
+ */
+void retry_succeeded(retry_state_t*, guint attempts);
+
+#endif /* __RETRY_H__ */
@@ -0,0 +1,58 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SPSC_H__
+#define __SPSC_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A bounded, lock-free, single-producer single-consumer ring of fixed size
+ * elements.
+ *
+ * Exactly one thread may push and exactly one (other) thread may pop.
+ */
+typedef struct spsc_queue spsc_queue_t;
+
+/*
+ * `capacity` is rounded up to the next power of two.
+ */
+spsc_queue_t* spsc_queue_new(size_t capacity, size_t element_size);
+
+void spsc_queue_free(spsc_queue_t*);
+
+/*
+ * Copies `element` into the queue.
+ *
+ * Returns false if the queue is full.
+ */
+bool spsc_queue_push(spsc_queue_t*, const void* element);
+
+/*
+ * Copies the oldest element into `element` and removes it from the queue.
+ *
+ * Returns false if the queue is empty.
+ */
+bool spsc_queue_pop(spsc_queue_t*, void* element);
+
+#endif /* __SPSC_H__ */
@@ -0,0 +1,128 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STATE_PAGE_H__
+#define __STATE_PAGE_H__
+
+#include <gio/gio.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "device_io.h"
+
+/*
+ * A device's state in shared memory, for clients that poll it.
+ *
+ * The page is a memfd handed out by org.mdr.Device.GetStatePage. Clients
+ * map it read-only and read it without any further calls:
+ *
+ *     do
+ *     {
+ *         seq = atomic_load_explicit(&page->sequence, memory_order_acquire);
+ *         copy = *page;
+ *         atomic_thread_fence(memory_order_acquire);
+ *     }
+ *     while ((seq & 1)
+ *            || seq != atomic_load_explicit(&page->sequence,
+ *                                           memory_order_relaxed));
+ *
+ * The sequence is odd while the page is being written. A member is only
+ * meaningful while its bit is set in `valid`; all bits are cleared once the
+ * device is gone.
+ */
+#define STATE_PAGE_MAGIC 0x3152444d // "MDR1"
+#define STATE_PAGE_VERSION 1
+
+#define STATE_PAGE_MAX_EQ_BANDS 16
+
+typedef enum
+{
+    STATE_PAGE_VALID_BATTERY = 1 << 0,
+    STATE_PAGE_VALID_LEFT_RIGHT_BATTERY = 1 << 1,
+    STATE_PAGE_VALID_CRADLE_BATTERY = 1 << 2,
+    STATE_PAGE_VALID_LEFT_RIGHT = 1 << 3,
+    STATE_PAGE_VALID_NOISE_CANCELLING = 1 << 4,
+    STATE_PAGE_VALID_AMBIENT_SOUND_MODE = 1 << 5,
+    STATE_PAGE_VALID_EQ = 1 << 6,
+    STATE_PAGE_VALID_PLAYBACK = 1 << 7,
+}
+state_page_valid_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    // sizeof(state_page_layout_t); later versions only append.
+    uint16_t size;
+    _Atomic uint32_t sequence;
+    uint32_t valid;
+
+    uint8_t battery_level;
+    uint8_t battery_charging;
+    uint8_t left_battery_level;
+    uint8_t left_battery_charging;
+    uint8_t right_battery_level;
+    uint8_t right_battery_charging;
+    uint8_t cradle_battery_level;
+    uint8_t cradle_battery_charging;
+
+    uint8_t left_connected;
+    uint8_t right_connected;
+    uint8_t noise_cancelling;
+    uint8_t ambient_sound_amount;
+    // 1 for the voice mode, 0 for normal.
+    uint8_t ambient_sound_voice;
+    uint8_t volume;
+    uint8_t reserved;
+    uint8_t eq_band_count;
+
+    uint8_t eq_levels[STATE_PAGE_MAX_EQ_BANDS];
+}
+state_page_layout_t;
+
+typedef struct state_page state_page_t;
+
+/*
+ * Creates an empty page. Returns NULL if the memfd cannot be set up.
+ */
+state_page_t* state_page_new(void);
+
+/*
+ * Marks everything invalid and unmaps the page. Clients keep their
+ * mappings.
+ */
+void state_page_free(state_page_t*);
+
+/*
+ * Returns the memfd; it stays owned by the page.
+ */
+gint state_page_get_fd(state_page_t*);
+
+/*
+ * Stores the result of the getter `command`. Results of other commands
+ * are ignored.
+ */
+void state_page_write(state_page_t*,
+                      device_command_type_t command,
+                      const device_value_t* value);
+
+#endif /* __STATE_PAGE_H__ */
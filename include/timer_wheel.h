@@ -0,0 +1,96 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <gio/gio.h>
+
+#include <stdbool.h>
+
+/*
+ * A hierarchical timer wheel.
+ *
+ * Deadlines are rounded up to whole ticks so that every timer expiring
+ * within the same tick is fired in one batch, and the owner only needs
+ * to wake up once per tick that actually has work in it. The tick length
+ * therefore doubles as the timer slack.
+ *
+ * Timers are embedded in the caller's own structures and never allocated
+ * by the wheel.
+ */
+typedef struct timer_wheel timer_wheel_t;
+
+typedef struct timer_wheel_timer
+{
+    // Expiry, in ticks.
+    guint64 expires;
+
+    GList link;
+    GQueue* slot;
+    guint level;
+}
+timer_wheel_timer_t;
+
+typedef void (*timer_wheel_expire_cb)(timer_wheel_timer_t* timer,
+                                      void* user_data);
+
+/*
+ * `tick` and `now` are in µs.
+ */
+timer_wheel_t* timer_wheel_new(gint64 tick, gint64 now);
+
+void timer_wheel_free(timer_wheel_t*);
+
+void timer_wheel_timer_init(timer_wheel_timer_t*);
+
+/*
+ * (Re)schedules `timer` to expire at the absolute time `deadline` (µs).
+ *
+ * The timer never fires early, and at most one tick late.
+ */
+void timer_wheel_schedule(timer_wheel_t*,
+                          timer_wheel_timer_t*,
+                          gint64 deadline);
+
+void timer_wheel_cancel(timer_wheel_t*, timer_wheel_timer_t*);
+
+bool timer_wheel_timer_pending(const timer_wheel_timer_t*);
+
+/*
+ * Returns the time (µs) at which the wheel next needs to be advanced,
+ * or -1 if no timers are pending.
+ */
+gint64 timer_wheel_next_deadline(timer_wheel_t*);
+
+/*
+ * Fires every timer whose deadline is at or before `now` (µs).
+ *
+ * `expire_cb` may schedule or cancel any timer, including the one it is
+ * called for.
+ */
+void timer_wheel_advance(timer_wheel_t*,
+                         gint64 now,
+                         timer_wheel_expire_cb expire_cb,
+                         void* user_data);
+
+#endif /* __TIMER_WHEEL_H__ */
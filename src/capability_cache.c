@@ -0,0 +1,684 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "capability_cache.h"
+
+#include <string.h>
+
+/*
+ * File layout, all integers little endian:
+ *
+ *   u32 magic, u32 version
+ *   entries until the end of the file:
+ *     u16 length of the rest of the entry
+ *     u8 key length, key
+ *     u8 model name length, model name
+ *     u16 supported functions, one bit each
+ *     u8 EQ band count, u8 EQ level steps, u8 preset count, presets
+ *     u8 key count, then for each key:
+ *       u8 key, u8 key type, u8 default preset, u8 preset count,
+ *       then for each preset:
+ *         u8 preset, u8 action count, then (u8 action, u8 function) pairs
+ */
+#define CAPABILITY_CACHE_MAGIC 0x4344524d // "MRDC"
+#define CAPABILITY_CACHE_VERSION 1
+#define CAPABILITY_CACHE_HEADER_SIZE 8
+#define CAPABILITY_CACHE_FILE "capabilities"
+
+static gchar* cache_path = NULL;
+// The current contents of the cache, ahead of the file while it is being
+// written. NULL if there are none.
+static GBytes* cache_data = NULL;
+
+// Writes the cache file off the D-Bus thread. Changes made meanwhile are
+// written once it is done.
+static GThread* write_thread = NULL;
+static bool write_pending = false;
+
+typedef struct
+{
+    const guint8* data;
+    gsize length;
+    gsize offset;
+    bool error;
+}
+capability_cache_reader_t;
+
+static void capability_cache_map(void)
+{
+    GError* error = NULL;
+
+    GMappedFile* cache_file = g_mapped_file_new(cache_path, FALSE, &error);
+    if (cache_file == NULL)
+    {
+        if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+            g_warning("Failed to open capability cache: %s", error->message);
+        }
+
+        g_error_free(error);
+        return;
+    }
+
+    const guint8* data = (const guint8*) g_mapped_file_get_contents(cache_file);
+    gsize length = g_mapped_file_get_length(cache_file);
+
+    if (length < CAPABILITY_CACHE_HEADER_SIZE
+            || GUINT32_FROM_LE(((const guint32*) data)[0])
+                != CAPABILITY_CACHE_MAGIC
+            || GUINT32_FROM_LE(((const guint32*) data)[1])
+                != CAPABILITY_CACHE_VERSION)
+    {
+        g_debug("Ignoring capability cache with unknown format");
+    }
+    else
+    {
+        // Keeps the file mapped.
+        cache_data = g_mapped_file_get_bytes(cache_file);
+    }
+
+    g_mapped_file_unref(cache_file);
+}
+
+void capability_cache_init(void)
+{
+    // Set by systemd when the unit has a CacheDirectory.
+    const gchar* dir = g_getenv("CACHE_DIRECTORY");
+
+    if (dir != NULL)
+    {
+        cache_path = g_build_filename(dir, CAPABILITY_CACHE_FILE, NULL);
+    }
+    else
+    {
+        cache_path = g_build_filename(g_get_user_cache_dir(),
+                                      "mdrd",
+                                      CAPABILITY_CACHE_FILE,
+                                      NULL);
+    }
+
+    capability_cache_map();
+}
+
+static void capability_cache_write_file(GBytes* data);
+
+void capability_cache_deinit(void)
+{
+    if (write_thread != NULL)
+    {
+        g_thread_join(write_thread);
+        write_thread = NULL;
+    }
+
+    if (write_pending)
+    {
+        capability_cache_write_file(cache_data);
+        write_pending = false;
+    }
+
+    if (cache_data != NULL)
+    {
+        g_bytes_unref(cache_data);
+        cache_data = NULL;
+    }
+
+    g_free(cache_path);
+    cache_path = NULL;
+}
+
+static guint8 capability_cache_read_u8(capability_cache_reader_t* reader)
+{
+    if (reader->offset + 1 > reader->length)
+    {
+        reader->error = true;
+        return 0;
+    }
+
+    return reader->data[reader->offset++];
+}
+
+static guint16 capability_cache_read_u16(capability_cache_reader_t* reader)
+{
+    guint16 low = capability_cache_read_u8(reader);
+    guint16 high = capability_cache_read_u8(reader);
+
+    return low | (high << 8);
+}
+
+static const guint8* capability_cache_read_bytes(
+        capability_cache_reader_t* reader,
+        gsize count)
+{
+    if (reader->offset + count > reader->length)
+    {
+        reader->error = true;
+        return NULL;
+    }
+
+    const guint8* bytes = &reader->data[reader->offset];
+    reader->offset += count;
+
+    return bytes;
+}
+
+static void capability_cache_write_u8(GByteArray* out, guint8 value)
+{
+    g_byte_array_append(out, &value, 1);
+}
+
+static void capability_cache_write_u16(GByteArray* out, guint16 value)
+{
+    capability_cache_write_u8(out, value & 0xff);
+    capability_cache_write_u8(out, value >> 8);
+}
+
+static guint16 capability_cache_encode_functions(
+        const mdr_device_supported_functions_t* functions)
+{
+    return functions->power_off << 0
+        | functions->battery << 1
+        | functions->left_right_battery << 2
+        | functions->left_right_connection_status << 3
+        | functions->cradle_battery << 4
+        | functions->noise_cancelling << 5
+        | functions->ambient_sound_mode << 6
+        | functions->eq << 7
+        | functions->eq_non_customizable << 8
+        | functions->auto_power_off << 9
+        | functions->assignable_settings << 10
+        | functions->playback_controller << 11;
+}
+
+static mdr_device_supported_functions_t capability_cache_decode_functions(
+        guint16 bits)
+{
+    mdr_device_supported_functions_t functions = {
+        .power_off = bits & (1 << 0),
+        .battery = bits & (1 << 1),
+        .left_right_battery = bits & (1 << 2),
+        .left_right_connection_status = bits & (1 << 3),
+        .cradle_battery = bits & (1 << 4),
+        .noise_cancelling = bits & (1 << 5),
+        .ambient_sound_mode = bits & (1 << 6),
+        .eq = bits & (1 << 7),
+        .eq_non_customizable = bits & (1 << 8),
+        .auto_power_off = bits & (1 << 9),
+        .assignable_settings = bits & (1 << 10),
+        .playback_controller = bits & (1 << 11),
+    };
+
+    return functions;
+}
+
+/*
+ * Appends the entry for `key`, including its length prefix, to `out`.
+ */
+static bool capability_cache_encode(GByteArray* out,
+                                    const gchar* key,
+                                    const capability_cache_entry_t* entry)
+{
+    const gchar* name = entry->model.model.name;
+    gsize key_length = strlen(key);
+    gsize name_length = name != NULL ? strlen(name) : 0;
+
+    if (key_length > G_MAXUINT8 || name_length > G_MAXUINT8)
+    {
+        return false;
+    }
+
+    guint start = out->len;
+
+    capability_cache_write_u16(out, 0);
+
+    capability_cache_write_u8(out, key_length);
+    g_byte_array_append(out, (const guint8*) key, key_length);
+
+    capability_cache_write_u8(out, name_length);
+    g_byte_array_append(out, (const guint8*) name, name_length);
+
+    capability_cache_write_u16(out, capability_cache_encode_functions(
+                &entry->model.model.supported_functions));
+
+    const device_value_t* eq = &entry->eq_capabilities;
+
+    capability_cache_write_u8(out, eq->eq_capabilities.band_count);
+    capability_cache_write_u8(out, eq->eq_capabilities.level_steps);
+    capability_cache_write_u8(out, eq->eq_capabilities.num_presets);
+
+    for (int i = 0; i < eq->eq_capabilities.num_presets; i++)
+    {
+        capability_cache_write_u8(out, eq->eq_capabilities.presets[i]);
+    }
+
+    const device_value_t* kf = &entry->available_button_presets;
+
+    capability_cache_write_u8(out, kf->available_button_presets.num_keys);
+
+    for (int i = 0; i < kf->available_button_presets.num_keys; i++)
+    {
+        mdr_packet_system_assignable_settings_capability_key_t* key
+            = &kf->available_button_presets.keys[i];
+
+        capability_cache_write_u8(out, key->key);
+        capability_cache_write_u8(out, key->key_type);
+        capability_cache_write_u8(out, key->default_preset);
+        capability_cache_write_u8(out, key->num_capability_presets);
+
+        for (int j = 0; j < key->num_capability_presets; j++)
+        {
+            mdr_packet_system_assignable_settings_capability_preset_t* preset
+                = &key->capability_presets[j];
+
+            capability_cache_write_u8(out, preset->preset);
+            capability_cache_write_u8(out, preset->num_capability_actions);
+
+            for (int k = 0; k < preset->num_capability_actions; k++)
+            {
+                capability_cache_write_u8(
+                        out,
+                        preset->capability_actions[k].action);
+                capability_cache_write_u8(
+                        out,
+                        preset->capability_actions[k].function);
+            }
+        }
+    }
+
+    gsize length = out->len - start - 2;
+
+    if (length > G_MAXUINT16)
+    {
+        g_byte_array_set_size(out, start);
+        return false;
+    }
+
+    out->data[start] = length & 0xff;
+    out->data[start + 1] = length >> 8;
+
+    return true;
+}
+
+/*
+ * Decodes the body of an entry, after its key.
+ */
+static bool capability_cache_decode(capability_cache_reader_t* reader,
+                                    capability_cache_entry_t* entry)
+{
+    memset(entry, 0, sizeof(*entry));
+
+    guint8 name_length = capability_cache_read_u8(reader);
+    const guint8* name = capability_cache_read_bytes(reader, name_length);
+
+    mdr_device_supported_functions_t functions
+        = capability_cache_decode_functions(
+                capability_cache_read_u16(reader));
+
+    if (reader->error)
+    {
+        return false;
+    }
+
+    entry->model.model.name = g_strndup((const gchar*) name, name_length);
+    entry->model.model.supported_functions = functions;
+
+    device_value_t* eq = &entry->eq_capabilities;
+
+    eq->eq_capabilities.band_count = capability_cache_read_u8(reader);
+    eq->eq_capabilities.level_steps = capability_cache_read_u8(reader);
+    eq->eq_capabilities.num_presets = capability_cache_read_u8(reader);
+
+    const guint8* presets = capability_cache_read_bytes(
+            reader,
+            eq->eq_capabilities.num_presets);
+
+    if (reader->error)
+    {
+        eq->eq_capabilities.num_presets = 0;
+        return false;
+    }
+
+    eq->eq_capabilities.presets = g_new(mdr_packet_eqebb_eq_preset_id_t,
+                                        eq->eq_capabilities.num_presets);
+
+    for (int i = 0; i < eq->eq_capabilities.num_presets; i++)
+    {
+        eq->eq_capabilities.presets[i] = presets[i];
+    }
+
+    device_value_t* kf = &entry->available_button_presets;
+
+    guint8 num_keys = capability_cache_read_u8(reader);
+
+    kf->available_button_presets.keys = g_new0(
+            mdr_packet_system_assignable_settings_capability_key_t,
+            num_keys);
+
+    for (int i = 0; i < num_keys && !reader->error; i++)
+    {
+        mdr_packet_system_assignable_settings_capability_key_t* key
+            = &kf->available_button_presets.keys[i];
+
+        // Counted as soon as it owns memory, so that clearing frees it.
+        kf->available_button_presets.num_keys = i + 1;
+
+        key->key = capability_cache_read_u8(reader);
+        key->key_type = capability_cache_read_u8(reader);
+        key->default_preset = capability_cache_read_u8(reader);
+
+        guint8 num_presets = capability_cache_read_u8(reader);
+
+        key->capability_presets = g_new0(
+                mdr_packet_system_assignable_settings_capability_preset_t,
+                num_presets);
+
+        for (int j = 0; j < num_presets && !reader->error; j++)
+        {
+            mdr_packet_system_assignable_settings_capability_preset_t* preset
+                = &key->capability_presets[j];
+
+            key->num_capability_presets = j + 1;
+
+            preset->preset = capability_cache_read_u8(reader);
+
+            guint8 num_actions = capability_cache_read_u8(reader);
+
+            preset->capability_actions = g_new0(
+                    mdr_packet_system_assignable_settings_capability_action_t,
+                    num_actions);
+            preset->num_capability_actions = num_actions;
+
+            for (int k = 0; k < num_actions; k++)
+            {
+                preset->capability_actions[k].action
+                    = capability_cache_read_u8(reader);
+                preset->capability_actions[k].function
+                    = capability_cache_read_u8(reader);
+            }
+        }
+    }
+
+    return !reader->error;
+}
+
+/*
+ * Finds the entry for `key` in the mapped file.
+ *
+ * On success `body` covers the entry after its key, and `raw` the whole
+ * entry including its length prefix.
+ */
+static bool capability_cache_find(const gchar* key,
+                                  capability_cache_reader_t* body,
+                                  capability_cache_reader_t* raw)
+{
+    if (cache_data == NULL)
+    {
+        return false;
+    }
+
+    capability_cache_reader_t reader = {
+        .data = g_bytes_get_data(cache_data, NULL),
+        .length = g_bytes_get_size(cache_data),
+        .offset = CAPABILITY_CACHE_HEADER_SIZE,
+    };
+
+    gsize key_length = strlen(key);
+
+    while (reader.offset < reader.length)
+    {
+        gsize start = reader.offset;
+        guint16 length = capability_cache_read_u16(&reader);
+        const guint8* data = capability_cache_read_bytes(&reader, length);
+
+        if (reader.error)
+        {
+            g_debug("Capability cache is truncated");
+            return false;
+        }
+
+        capability_cache_reader_t entry = {
+            .data = data,
+            .length = length,
+        };
+
+        guint8 entry_key_length = capability_cache_read_u8(&entry);
+        const guint8* entry_key
+            = capability_cache_read_bytes(&entry, entry_key_length);
+
+        if (!entry.error
+                && entry_key_length == key_length
+                && memcmp(entry_key, key, key_length) == 0)
+        {
+            *body = entry;
+
+            *raw = (capability_cache_reader_t) {
+                .data = &reader.data[start],
+                .length = reader.offset - start,
+            };
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool capability_cache_lookup(const gchar* key,
+                             capability_cache_entry_t* entry)
+{
+    capability_cache_reader_t body;
+    capability_cache_reader_t raw;
+
+    if (!capability_cache_find(key, &body, &raw))
+    {
+        return false;
+    }
+
+    if (!capability_cache_decode(&body, entry))
+    {
+        g_debug("Ignoring damaged capability cache entry for '%s'", key);
+
+        capability_cache_entry_clear(entry);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Replaces the cache file with `data`. Runs on the write thread, so only
+ * touches `data` and cache_path.
+ */
+static void capability_cache_write_file(GBytes* data)
+{
+    gchar* dir = g_path_get_dirname(cache_path);
+    GError* error = NULL;
+
+    if (g_mkdir_with_parents(dir, 0755) != 0)
+    {
+        g_warning("Failed to create capability cache directory '%s'", dir);
+    }
+    else if (!g_file_set_contents(cache_path,
+                                  g_bytes_get_data(data, NULL),
+                                  g_bytes_get_size(data),
+                                  &error))
+    {
+        g_warning("Failed to write capability cache: %s", error->message);
+        g_error_free(error);
+    }
+
+    g_free(dir);
+}
+
+static void capability_cache_schedule_write(void);
+
+static gboolean capability_cache_written(gpointer user_data)
+{
+    // Already joined by capability_cache_deinit.
+    if (write_thread == NULL)
+    {
+        return G_SOURCE_REMOVE;
+    }
+
+    g_thread_join(write_thread);
+    write_thread = NULL;
+
+    if (write_pending)
+    {
+        write_pending = false;
+        capability_cache_schedule_write();
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer capability_cache_write_thread(gpointer user_data)
+{
+    GBytes* data = user_data;
+
+    capability_cache_write_file(data);
+    g_bytes_unref(data);
+
+    g_idle_add(capability_cache_written, NULL);
+
+    return NULL;
+}
+
+/*
+ * Writes the current contents to the file in the background, since
+ * g_file_set_contents may wait for the disk.
+ */
+static void capability_cache_schedule_write(void)
+{
+    if (write_thread != NULL)
+    {
+        write_pending = true;
+        return;
+    }
+
+    write_thread = g_thread_new("mdrd-cache",
+                                capability_cache_write_thread,
+                                g_bytes_ref(cache_data));
+}
+
+/*
+ * Rewrites the cache with every entry except the one for `key`, followed by
+ * `entry` if not NULL.
+ */
+static void capability_cache_write(const gchar* key,
+                                   const GByteArray* entry)
+{
+    GByteArray* out = g_byte_array_new();
+
+    guint32 header[2] = {
+        GUINT32_TO_LE(CAPABILITY_CACHE_MAGIC),
+        GUINT32_TO_LE(CAPABILITY_CACHE_VERSION),
+    };
+
+    g_byte_array_append(out, (const guint8*) header, sizeof(header));
+
+    capability_cache_reader_t body;
+    capability_cache_reader_t raw;
+
+    if (capability_cache_find(key, &body, &raw))
+    {
+        const guint8* data = g_bytes_get_data(cache_data, NULL);
+        gsize length = g_bytes_get_size(cache_data);
+        gsize skip_start = raw.data - data;
+        gsize skip_end = skip_start + raw.length;
+
+        g_byte_array_append(out,
+                            &data[CAPABILITY_CACHE_HEADER_SIZE],
+                            skip_start - CAPABILITY_CACHE_HEADER_SIZE);
+        g_byte_array_append(out, &data[skip_end], length - skip_end);
+    }
+    else if (cache_data != NULL)
+    {
+        const guint8* data = g_bytes_get_data(cache_data, NULL);
+        gsize length = g_bytes_get_size(cache_data);
+
+        g_byte_array_append(out,
+                            &data[CAPABILITY_CACHE_HEADER_SIZE],
+                            length - CAPABILITY_CACHE_HEADER_SIZE);
+    }
+
+    if (entry != NULL)
+    {
+        g_byte_array_append(out, entry->data, entry->len);
+    }
+
+    if (cache_data != NULL)
+    {
+        g_bytes_unref(cache_data);
+    }
+
+    cache_data = g_byte_array_free_to_bytes(out);
+
+    capability_cache_schedule_write();
+}
+
+bool capability_cache_store(const gchar* key,
+                            const capability_cache_entry_t* entry)
+{
+    GByteArray* encoded = g_byte_array_new();
+
+    if (!capability_cache_encode(encoded, key, entry))
+    {
+        g_byte_array_unref(encoded);
+        return false;
+    }
+
+    capability_cache_reader_t body;
+    capability_cache_reader_t raw;
+
+    if (capability_cache_find(key, &body, &raw)
+            && raw.length == encoded->len
+            && memcmp(raw.data, encoded->data, encoded->len) == 0)
+    {
+        g_byte_array_unref(encoded);
+        return false;
+    }
+
+    capability_cache_write(key, encoded);
+    g_byte_array_unref(encoded);
+
+    return true;
+}
+
+void capability_cache_remove(const gchar* key)
+{
+    capability_cache_reader_t body;
+    capability_cache_reader_t raw;
+
+    if (capability_cache_find(key, &body, &raw))
+    {
+        capability_cache_write(key, NULL);
+    }
+}
+
+void capability_cache_entry_clear(capability_cache_entry_t* entry)
+{
+    device_value_clear(DEVICE_COMMAND_GET_MODEL_NAME, &entry->model);
+    device_value_clear(DEVICE_COMMAND_GET_EQ_CAPABILITIES,
+                       &entry->eq_capabilities);
+    device_value_clear(DEVICE_COMMAND_GET_AVAILABLE_BUTTON_PRESETS,
+                       &entry->available_button_presets);
+}
@@ -0,0 +1,234 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "channel.h"
+
+#include "spsc.h"
+
+#include <glib-unix.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define CHANNEL_RETRY_INTERVAL_MS 1
+
+struct channel
+{
+    spsc_queue_t* queue;
+    size_t message_size;
+
+    gint wakeup_fd;
+    atomic_bool wakeup_pending;
+
+    // Consumer side
+    GSource* consumer_source;
+    channel_handler_cb handler;
+    channel_drained_cb drained;
+    void* user_data;
+    void* scratch;
+
+    // Producer side
+    GMainContext* producer_context;
+    GQueue backlog;
+    GSource* retry_source;
+};
+
+static gboolean channel_dispatch(gint fd,
+                                 GIOCondition condition,
+                                 gpointer user_data);
+
+channel_t* channel_new(size_t capacity,
+                       size_t message_size,
+                       GMainContext* producer_context,
+                       GMainContext* consumer_context,
+                       channel_handler_cb handler,
+                       channel_drained_cb drained,
+                       void* user_data)
+{
+    gint wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0)
+    {
+        g_warning("Failed to create channel eventfd: %d", errno);
+        return NULL;
+    }
+
+    spsc_queue_t* queue = spsc_queue_new(capacity, message_size);
+    if (queue == NULL)
+    {
+        close(wakeup_fd);
+        return NULL;
+    }
+
+    channel_t* channel = g_new0(channel_t, 1);
+
+    channel->queue = queue;
+    channel->message_size = message_size;
+    channel->wakeup_fd = wakeup_fd;
+    atomic_init(&channel->wakeup_pending, false);
+
+    channel->handler = handler;
+    channel->drained = drained;
+    channel->user_data = user_data;
+    channel->scratch = g_malloc(message_size);
+
+    channel->producer_context = producer_context;
+    g_queue_init(&channel->backlog);
+    channel->retry_source = NULL;
+
+    channel->consumer_source = g_unix_fd_source_new(wakeup_fd, G_IO_IN);
+    g_source_set_callback(channel->consumer_source,
+                          (GSourceFunc) channel_dispatch,
+                          channel,
+                          NULL);
+    g_source_attach(channel->consumer_source, consumer_context);
+
+    return channel;
+}
+
+void channel_free(channel_t* channel)
+{
+    g_source_destroy(channel->consumer_source);
+    g_source_unref(channel->consumer_source);
+
+    if (channel->retry_source != NULL)
+    {
+        g_source_destroy(channel->retry_source);
+        g_source_unref(channel->retry_source);
+    }
+
+    g_queue_clear_full(&channel->backlog, g_free);
+
+    spsc_queue_free(channel->queue);
+    close(channel->wakeup_fd);
+
+    g_free(channel->scratch);
+    g_free(channel);
+}
+
+static void channel_wakeup(channel_t* channel)
+{
+    if (atomic_exchange(&channel->wakeup_pending, true))
+    {
+        return;
+    }
+
+    uint64_t one = 1;
+
+    if (write(channel->wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+        g_warning("Failed to wake up channel consumer: %d", errno);
+    }
+}
+
+static bool channel_flush_backlog(channel_t* channel)
+{
+    bool pushed = false;
+    void* message;
+
+    while ((message = g_queue_peek_head(&channel->backlog)) != NULL)
+    {
+        if (!spsc_queue_push(channel->queue, message))
+        {
+            break;
+        }
+
+        g_queue_pop_head(&channel->backlog);
+        g_free(message);
+        pushed = true;
+    }
+
+    if (pushed)
+    {
+        channel_wakeup(channel);
+    }
+
+    return g_queue_is_empty(&channel->backlog);
+}
+
+static gboolean channel_retry(gpointer user_data)
+{
+    channel_t* channel = user_data;
+
+    if (!channel_flush_backlog(channel))
+    {
+        return G_SOURCE_CONTINUE;
+    }
+
+    g_source_unref(channel->retry_source);
+    channel->retry_source = NULL;
+
+    return G_SOURCE_REMOVE;
+}
+
+void channel_send(channel_t* channel, const void* message)
+{
+    if (g_queue_is_empty(&channel->backlog)
+            && spsc_queue_push(channel->queue, message))
+    {
+        channel_wakeup(channel);
+        return;
+    }
+
+    void* copy = g_malloc(channel->message_size);
+    memcpy(copy, message, channel->message_size);
+    g_queue_push_tail(&channel->backlog, copy);
+
+    if (channel->retry_source == NULL)
+    {
+        channel->retry_source
+            = g_timeout_source_new(CHANNEL_RETRY_INTERVAL_MS);
+        g_source_set_callback(channel->retry_source,
+                              channel_retry,
+                              channel,
+                              NULL);
+        g_source_attach(channel->retry_source, channel->producer_context);
+    }
+}
+
+static gboolean channel_dispatch(gint fd,
+                                 GIOCondition condition,
+                                 gpointer user_data)
+{
+    channel_t* channel = user_data;
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        g_warning("Failed to read channel eventfd: %d", errno);
+    }
+
+    // Pairs with the exchange in channel_wakeup so that every message
+    // pushed before a suppressed wakeup is visible below.
+    atomic_exchange(&channel->wakeup_pending, false);
+
+    while (spsc_queue_pop(channel->queue, channel->scratch))
+    {
+        channel->handler(channel->scratch, channel->user_data);
+    }
+
+    if (channel->drained != NULL)
+    {
+        channel->drained(channel->user_data);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
@@ -22,24 +22,104 @@
 
 #include "device.h"
 
+#include "capability_cache.h"
+#include "device_io.h"
+#include "init_graph.h"
+#include "retry.h"
+#include "state_page.h"
+
 #include "mdr/device.h"
 #include "mdr_device_ifaces.h"
 
+#include <gio/gunixfdlist.h>
 #include <signal.h>
+#include <stddef.h>
 
 extern GDBusConnection* connection;
 
-typedef struct device_source device_source_t;
+static bool lazy_properties = false;
+static guint reconnect_grace = 0;
+static guint init_deadline = 5;
+static guint coalesce_window = 0;
+
+/*
+ * An assignable key, indexed like the presets the device reports as active.
+ */
+typedef struct
+{
+    // NULL for keys not known by name, which are not exported.
+    const char* name;
+    mdr_packet_system_assignable_settings_preset_t default_preset;
+    // Bitset of the presets that can be assigned, by preset id.
+    guint32 allowed[0x100 / 32];
+}
+key_functions_key_t;
+
+/*
+ * The available presets of every set of key capabilities in use, shared by
+ * all devices that report the same capabilities.
+ */
+typedef struct
+{
+    GBytes* capabilities;
+    GVariant* variant;
+    guint ref_count;
+
+    uint8_t num_keys;
+    key_functions_key_t* keys;
+}
+key_functions_presets_t;
+
+/*
+ * The EQ presets of every set of EQ capabilities in use, shared by all
+ * devices that report the same presets.
+ */
+typedef struct
+{
+    GBytes* capabilities;
+    guint ref_count;
+
+    // NULL terminated, in the order the device reports them.
+    const gchar** names;
+    // Maps preset ids to 1 + their index in names, 0 if not supported.
+    uint8_t index[0x100];
+    // Maps names to preset ids.
+    GHashTable* ids;
+}
+eq_presets_t;
 
 struct device
 {
     int ref_count;
     const gchar* dbus_name;
-    mdr_device_t* mdr_device;
+    device_io_t* io;
+
+    // Set while waiting for the device to reconnect.
+    guint grace_source;
+
+    // Holds the interfaces below; exported through device_manager once the
+    // device is announced.
+    GDBusObjectSkeleton* object;
+
+    // Bumped whenever a property or the set of interfaces changes.
+    guint64 state_sequence;
+    // Cached result of GetState.
+    GVariant* state;
+
+    // Notifications held back for the coalescing window, by query phase.
+    device_value_t* coalesced_values;
+    guint32 coalesced_queries;
+    guint coalesce_source;
 
-    device_source_t* source;
+    // The state last applied from each query, by query phase. Notifications
+    // that repeat it are dropped.
+    device_value_t* reported_values;
+    guint32 reported_queries;
+    guint64 updates_forwarded;
+    guint64 updates_suppressed;
 
-    int registrations_in_progress;
+    // Shared copy of the reported state; created on first request.
+    state_page_t* state_page;
 
     OrgMdrDevice* device_iface;
     OrgMdrPowerOff* power_off_iface;
@@ -54,389 +134,2129 @@ struct device
     OrgMdrKeyFunctions* key_functions_iface;
     OrgMdrPlayback* playback_iface;
 
+    key_functions_presets_t* key_functions_presets;
+
+    // Lazy mode: interfaces not yet fetched, and the query results they
+    // are built from.
+    GSList* lazy_ifaces;
+    device_value_t* lazy_values;
+
     uint8_t asm_amount;
     bool asm_voice;
 
     uint8_t eq_band_count;
     uint8_t eq_level_steps;
-    const gchar* eq_presets[0x100];
+    eq_presets_t* eq_presets;
 };
 
 GHashTable* device_table;
 
+static GDBusObjectManagerServer* device_manager;
+
+// An object manager for each peer connected directly, exporting the same
+// objects as device_manager.
+static GSList* device_peer_managers;
+
+// Maps the capabilities, as serialized by key_functions_capabilities, to
+// their key_functions_presets_t.
+static GHashTable* key_functions_presets_table;
+
+// Maps the preset ids, as serialized by eq_presets_ref, to their
+// eq_presets_t.
+static GHashTable* eq_presets_table;
+
+// Map the names of auto power off timeouts and key presets to their ids.
+static GHashTable* auto_power_off_timeout_ids;
+static GHashTable* key_functions_preset_ids;
+
+// Notifications applied and dropped as unchanged, over all devices.
+static guint64 device_updates_forwarded;
+static guint64 device_updates_suppressed;
+
+// Caches the properties of an interface skeleton as an a{sv} until they
+// change.
+static GQuark device_state_quark;
+
 static void device_removed(device_t* device);
 
 static void device_ref(device_t* device);
 
 static void device_unref(device_t* device);
 
-struct device_source
+static void device_io_event(const device_event_t* event);
+
+static void device_update(device_t* device,
+                          device_command_type_t command,
+                          const device_value_t* value);
+
+static void device_flush(device_t* device);
+
+static void device_coalesce_flush(device_t* device);
+
+static const gchar* auto_power_off_timeout_to_string(
+        mdr_packet_system_auto_power_off_element_id_t timeout);
+
+static const char* key_functions_preset_to_string(
+        mdr_packet_system_assignable_settings_preset_t preset);
+
+/*
+ * Registers the skeleton types and initializes their classes, which would
+ * otherwise happen on the first connection.
+ */
+static void devices_init_types(void)
 {
-    GSource source;
-    GPollFD poll_fd;
-    device_t* device;
-};
+    GType types[] = {
+        org_mdr_device_skeleton_get_type(),
+        org_mdr_power_off_skeleton_get_type(),
+        org_mdr_battery_skeleton_get_type(),
+        org_mdr_left_right_battery_skeleton_get_type(),
+        org_mdr_cradle_battery_skeleton_get_type(),
+        org_mdr_left_right_skeleton_get_type(),
+        org_mdr_noise_cancelling_skeleton_get_type(),
+        org_mdr_ambient_sound_mode_skeleton_get_type(),
+        org_mdr_eq_skeleton_get_type(),
+        org_mdr_auto_power_off_skeleton_get_type(),
+        org_mdr_key_functions_skeleton_get_type(),
+        org_mdr_playback_skeleton_get_type(),
+    };
+
+    for (size_t i = 0; i < G_N_ELEMENTS(types); i++)
+    {
+        g_type_class_unref(g_type_class_ref(types[i]));
+    }
+}
 
-void devices_init(void)
+/*
+ * Builds the maps from the names of auto power off timeouts and key presets
+ * to their ids.
+ */
+static void devices_init_names(void)
+{
+    auto_power_off_timeout_ids = g_hash_table_new(g_str_hash, g_str_equal);
+    key_functions_preset_ids = g_hash_table_new(g_str_hash, g_str_equal);
+
+    for (int i = 0; i < 0x100; i++)
+    {
+        const gchar* timeout = auto_power_off_timeout_to_string(i);
+        const gchar* preset = key_functions_preset_to_string(i);
+
+        if (timeout != NULL)
+        {
+            g_hash_table_insert(auto_power_off_timeout_ids,
+                                (gpointer) timeout,
+                                GINT_TO_POINTER(i));
+        }
+
+        if (preset != NULL)
+        {
+            g_hash_table_insert(key_functions_preset_ids,
+                                (gpointer) preset,
+                                GINT_TO_POINTER(i));
+        }
+    }
+}
+
+void devices_init(bool lazy,
+                  guint grace,
+                  guint deadline,
+                  guint window,
+                  guint slack)
 {
+    lazy_properties = lazy;
+    reconnect_grace = grace;
+    init_deadline = deadline;
+    coalesce_window = window;
+
+    devices_init_types();
+    devices_init_names();
+
+    device_manager = g_dbus_object_manager_server_new("/");
+    device_state_quark = g_quark_from_static_string("mdrd-device-state");
+    key_functions_presets_table = g_hash_table_new(g_bytes_hash,
+                                                   g_bytes_equal);
+    eq_presets_table = g_hash_table_new(g_bytes_hash, g_bytes_equal);
+
     device_table = g_hash_table_new_full(
             g_str_hash,
             g_str_equal,
             g_free,
             (void (*)(void*)) device_removed);
+
+    capability_cache_init();
+    device_io_init(device_io_event, slack);
 }
 
-void devices_deinit(void)
+void devices_set_connection(GDBusConnection* bus)
 {
-    g_hash_table_destroy(device_table);
+    g_dbus_object_manager_server_set_connection(device_manager, bus);
 }
 
-typedef struct
+static void device_peer_closed(GDBusConnection* peer,
+                               gboolean remote_peer_vanished,
+                               GError* error,
+                               gpointer user_data)
 {
-    device_t* device;
+    GDBusObjectManagerServer* manager = user_data;
 
-    device_created_cb success_cb;
-    device_create_error_cb error_cb;
-    void* user_data;
+    g_debug("Peer disconnected");
+
+    device_peer_managers = g_slist_remove(device_peer_managers, manager);
+    g_object_unref(manager);
 }
-device_add_init_data;
 
-static gboolean device_source_prepare(GSource*, gint* timeout);
-static gboolean device_source_check(GSource*);
-static gboolean device_source_dispatch(GSource*, GSourceFunc, gpointer);
+void devices_add_peer(GDBusConnection* peer)
+{
+    GDBusObjectManagerServer* manager = g_dbus_object_manager_server_new("/");
+    GHashTableIter iter;
+    device_t* device;
 
-static void device_source_dispose(GSource* source);
+    g_dbus_object_manager_server_set_connection(manager, peer);
 
-static GSourceFuncs device_source_funcs = {
-    .prepare = device_source_prepare,
-    .check = device_source_check,
-    .dispatch = device_source_dispatch,
-};
+    g_hash_table_iter_init(&iter, device_table);
+
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer*) &device))
+    {
+        if (g_dbus_object_manager_server_is_exported(device_manager,
+                                                     device->object))
+        {
+            g_dbus_object_manager_server_export(manager, device->object);
+        }
+    }
 
-static void device_add_init_success(void* user_data);
+    device_peer_managers = g_slist_prepend(device_peer_managers, manager);
 
-static void device_add_init_error(void* user_data);
+    g_signal_connect(peer,
+                     "closed",
+                     G_CALLBACK(device_peer_closed),
+                     manager);
+}
 
-void device_add(const gchar* name,
-                gint sock,
-                device_created_cb success_cb,
-                device_create_error_cb error_cb,
-                void* user_data)
+void devices_deinit(void)
 {
-    device_t* device = malloc(sizeof(device_t));
-    if (device == NULL)
-    {
-        error_cb(user_data);
-        return;
-    }
-    device_add_init_data* init_data = malloc(sizeof(device_add_init_data));
-    if (init_data == NULL)
-    {
-        free(device);
-        error_cb(user_data);
-        return;
-    }
+    g_hash_table_destroy(device_table);
 
-    mdr_device_t* mdr_device = mdr_device_new_from_sock(sock);
-    if (mdr_device == NULL)
-    {
-        error_cb(user_data);
-        return;
-    }
+    g_slist_free_full(device_peer_managers, g_object_unref);
+    device_peer_managers = NULL;
 
-    g_debug("Connected to MDR device '%s'", name);
+    g_hash_table_destroy(key_functions_presets_table);
+    g_hash_table_destroy(eq_presets_table);
+    g_hash_table_destroy(auto_power_off_timeout_ids);
+    g_hash_table_destroy(key_functions_preset_ids);
 
-    device->ref_count = 2; // Initialization/table + source
-    device->dbus_name = g_strdup(name);
-    device->mdr_device = mdr_device;
+    g_message("Device notifications: %" G_GUINT64_FORMAT " applied, "
+              "%" G_GUINT64_FORMAT " unchanged",
+              device_updates_forwarded,
+              device_updates_suppressed);
 
-    device->registrations_in_progress = 0;
+    g_object_unref(device_manager);
 
-    device->device_iface = NULL;
-    device->power_off_iface = NULL;
-    device->battery_iface = NULL;
-    device->left_right_battery_iface = NULL;
-    device->cradle_battery_iface = NULL;
-    device->left_right_iface = NULL;
-    device->noise_cancelling_iface = NULL;
-    device->ambient_sound_mode_iface = NULL;
-    device->eq_iface = NULL;
-    device->auto_power_off_iface = NULL;
-    device->key_functions_iface = NULL;
-    device->playback_iface = NULL;
+    device_io_deinit();
 
-    memset(&device->eq_presets, 0, sizeof(gchar*) * 0x100);
+    capability_cache_deinit();
+}
 
-    init_data->device = device;
+/*
+ * Device initialization is a graph of phases run by init_graph. Queries are
+ * submitted as soon as the device has been initialized, so all of them are
+ * queued together and the I/O thread can keep the link busy. Each
+ * interface is registered once its queries and the device interface are in.
+ *
+ * The model name, EQ capabilities and available button presets never
+ * change for a device. If they are in the capability cache they are taken
+ * from there instead, and queried again only once the device is connected.
+ *
+ * In lazy mode the state queries are left out. Each interface that needs
+ * one is exported as a placeholder and built on first access instead.
+ *
+ * Clients are sent a ready signal for every interface as soon as it has
+ * been exported. If initialization has not finished by the deadline the
+ * device is announced as connected anyway, and queries that are still
+ * outstanding are sent again.
+ *
+ * A device that reconnects within the grace period runs the same graph on
+ * its existing object. Interfaces that are already exported are updated
+ * from the query results instead of being built again.
+ */
+typedef enum
+{
+    DEVICE_INIT_CONNECT,
+    DEVICE_INIT_INIT,
+
+    DEVICE_INIT_GET_MODEL_NAME,
+    DEVICE_INIT_GET_BATTERY,
+    DEVICE_INIT_GET_LEFT_RIGHT_BATTERY,
+    DEVICE_INIT_GET_CRADLE_BATTERY,
+    DEVICE_INIT_GET_LEFT_RIGHT_CONNECTION_STATUS,
+    DEVICE_INIT_GET_NOISE_CANCELLING,
+    DEVICE_INIT_GET_AMBIENT_SOUND_MODE,
+    DEVICE_INIT_GET_EQ_CAPABILITIES,
+    DEVICE_INIT_GET_EQ_PRESET_AND_LEVELS,
+    DEVICE_INIT_GET_AUTO_POWER_OFF,
+    DEVICE_INIT_GET_AVAILABLE_BUTTON_PRESETS,
+    DEVICE_INIT_GET_ACTIVE_BUTTON_PRESETS,
+    DEVICE_INIT_GET_VOLUME,
+
+    DEVICE_INIT_DEVICE,
+    DEVICE_INIT_POWER_OFF,
+    DEVICE_INIT_BATTERY,
+    DEVICE_INIT_LEFT_RIGHT_BATTERY,
+    DEVICE_INIT_CRADLE_BATTERY,
+    DEVICE_INIT_LEFT_RIGHT_CONNECTION_STATUS,
+    DEVICE_INIT_NOISE_CANCELLING,
+    DEVICE_INIT_AMBIENT_SOUND_MODE,
+    DEVICE_INIT_EQ,
+    DEVICE_INIT_AUTO_POWER_OFF,
+    DEVICE_INIT_KEY_FUNCTIONS,
+    DEVICE_INIT_PLAYBACK,
+
+    DEVICE_INIT_NUM_PHASES,
+}
+device_init_phase_t;
 
-    init_data->success_cb = success_cb;
-    init_data->error_cb = error_cb;
-    init_data->user_data = user_data;
+typedef struct
+{
+    device_t* device;
+    gint sock;
+    init_graph_t* graph;
+
+    // Results of the query phases.
+    device_value_t values[DEVICE_INIT_NUM_PHASES];
 
-    mdr_device_init(mdr_device,
-                    device_add_init_success,
-                    device_add_init_error,
-                    init_data);
+    bool cached;
+    capability_cache_entry_t cache;
 
-    device_source_t* dev_source =
-            (device_source_t*) g_source_new(&device_source_funcs,
-                                            sizeof(device_source_t));
-    dev_source->poll_fd.fd = sock;
-    dev_source->poll_fd.events = G_IO_IN | G_IO_OUT | G_IO_ERR | G_IO_HUP;
-    dev_source->poll_fd.revents = 0;
-    dev_source->device = device;
+    // State queries left to lazy interfaces.
+    guint32 lazy_queries;
 
-    device->source = dev_source;
+    // Reconnecting a device kept in the grace period.
+    bool rebind;
 
-    g_source_set_dispose_function(&dev_source->source, device_source_dispose);
+    guint deadline_source;
+    guint deadline_retries;
+    bool deadline_passed;
+    bool connected;
 
-    g_source_add_poll(&dev_source->source, &dev_source->poll_fd);
+    // Queries submitted and not yet answered. Resent queries may still be
+    // outstanding once the graph is done; the data is freed after them.
+    guint outstanding;
+    bool released;
 
-    g_source_attach(&dev_source->source, g_main_context_default());
-    // TODO add source destory func
+    retry_state_t retry;
+    guint8 failures[DEVICE_INIT_NUM_PHASES];
+
+    device_created_cb success_cb;
+    device_create_error_cb error_cb;
+    void* user_data;
 }
+device_add_init_data;
 
-static void device_add_init_name_success(uint8_t len,
-                                         const uint8_t* name,
-                                         void* user_data);
+static void device_init_connect(init_graph_t*, guint, void*);
+static void device_init_query(init_graph_t*, guint, void*);
+static void device_init_cached_query(init_graph_t*, guint, void*);
+static void device_init_device(init_graph_t*, guint, void*);
+static void device_init_register(init_graph_t*, guint, void*);
+static void device_init_power_off(device_t*, const device_value_t*);
+static void device_init_battery(device_t*, const device_value_t*);
+static void device_init_left_right_battery(device_t*, const device_value_t*);
+static void device_init_cradle_battery(device_t*, const device_value_t*);
+static void device_init_left_right_connection_status(device_t*,
+                                                     const device_value_t*);
+static void device_init_noise_cancelling(device_t*, const device_value_t*);
+static void device_init_ambient_sound_mode(device_t*, const device_value_t*);
+static void device_init_eq(device_t*, const device_value_t*);
+static void device_init_auto_power_off(device_t*, const device_value_t*);
+static void device_init_key_functions(device_t*, const device_value_t*);
+static void device_init_playback(device_t*, const device_value_t*);
+
+// Times unanswered queries are sent again, once per deadline period.
+#define DEVICE_INIT_MAX_RESENDS 3
+
+// Failed queries are retried, up to this many times per connection.
+#define DEVICE_INIT_RETRY_BUDGET 16
+
+static const retry_policy_t device_init_retry_policy = {
+    .initial_delay = 250,
+    .max_delay = 4000,
+    .max_retries = 4,
+};
 
-static void device_add_init_success(void* user_data)
-{
-    device_add_init_data* init_data = user_data;
-    device_t* device = init_data->device;
+#define AFTER_INIT INIT_PHASE(DEVICE_INIT_INIT)
+#define AFTER_DEVICE(phases) (INIT_PHASE(DEVICE_INIT_DEVICE) | (phases))
+
+static const init_phase_t device_init_phases[DEVICE_INIT_NUM_PHASES] = {
+    [DEVICE_INIT_CONNECT] = {
+        "connect", 0, device_init_connect },
+    [DEVICE_INIT_INIT] = {
+        "init", INIT_PHASE(DEVICE_INIT_CONNECT), device_init_query },
+
+    [DEVICE_INIT_GET_MODEL_NAME] = {
+        "get model name", AFTER_INIT, device_init_cached_query },
+    [DEVICE_INIT_GET_BATTERY] = {
+        "get battery", AFTER_INIT, device_init_query },
+    [DEVICE_INIT_GET_LEFT_RIGHT_BATTERY] = {
+        "get left-right battery", AFTER_INIT, device_init_query },
+    [DEVICE_INIT_GET_CRADLE_BATTERY] = {
+        "get cradle battery", AFTER_INIT, device_init_query },
+    [DEVICE_INIT_GET_LEFT_RIGHT_CONNECTION_STATUS] = {
+        "get left-right connection status", AFTER_INIT, device_init_query },
+    [DEVICE_INIT_GET_NOISE_CANCELLING] = {
+        "get noise cancelling", AFTER_INIT, device_init_query },
+    [DEVICE_INIT_GET_AMBIENT_SOUND_MODE] = {
+        "get ambient sound mode", AFTER_INIT, device_init_query },
+    [DEVICE_INIT_GET_EQ_CAPABILITIES] = {
+        "get EQ capabilities", AFTER_INIT, device_init_cached_query },
+    [DEVICE_INIT_GET_EQ_PRESET_AND_LEVELS] = {
+        "get EQ preset and levels", AFTER_INIT, device_init_query },
+    [DEVICE_INIT_GET_AUTO_POWER_OFF] = {
+        "get auto power off", AFTER_INIT, device_init_query },
+    [DEVICE_INIT_GET_AVAILABLE_BUTTON_PRESETS] = {
+        "get available button presets", AFTER_INIT, device_init_cached_query },
+    [DEVICE_INIT_GET_ACTIVE_BUTTON_PRESETS] = {
+        "get active button presets", AFTER_INIT, device_init_query },
+    [DEVICE_INIT_GET_VOLUME] = {
+        "get volume", AFTER_INIT, device_init_query },
+
+    [DEVICE_INIT_DEVICE] = {
+        "device",
+        INIT_PHASE(DEVICE_INIT_GET_MODEL_NAME),
+        device_init_device },
+    [DEVICE_INIT_POWER_OFF] = {
+        "power off",
+        AFTER_DEVICE(0),
+        device_init_register },
+    [DEVICE_INIT_BATTERY] = {
+        "battery",
+        AFTER_DEVICE(INIT_PHASE(DEVICE_INIT_GET_BATTERY)),
+        device_init_register },
+    [DEVICE_INIT_LEFT_RIGHT_BATTERY] = {
+        "left-right battery",
+        AFTER_DEVICE(INIT_PHASE(DEVICE_INIT_GET_LEFT_RIGHT_BATTERY)),
+        device_init_register },
+    [DEVICE_INIT_CRADLE_BATTERY] = {
+        "cradle battery",
+        AFTER_DEVICE(INIT_PHASE(DEVICE_INIT_GET_CRADLE_BATTERY)),
+        device_init_register },
+    [DEVICE_INIT_LEFT_RIGHT_CONNECTION_STATUS] = {
+        "left-right connection status",
+        AFTER_DEVICE(INIT_PHASE(DEVICE_INIT_GET_LEFT_RIGHT_CONNECTION_STATUS)),
+        device_init_register },
+    [DEVICE_INIT_NOISE_CANCELLING] = {
+        "noise cancelling",
+        AFTER_DEVICE(INIT_PHASE(DEVICE_INIT_GET_NOISE_CANCELLING)),
+        device_init_register },
+    [DEVICE_INIT_AMBIENT_SOUND_MODE] = {
+        "ambient sound mode",
+        AFTER_DEVICE(INIT_PHASE(DEVICE_INIT_GET_AMBIENT_SOUND_MODE)),
+        device_init_register },
+    [DEVICE_INIT_EQ] = {
+        "EQ",
+        AFTER_DEVICE(INIT_PHASE(DEVICE_INIT_GET_EQ_CAPABILITIES)
+                     | INIT_PHASE(DEVICE_INIT_GET_EQ_PRESET_AND_LEVELS)),
+        device_init_register },
+    [DEVICE_INIT_AUTO_POWER_OFF] = {
+        "auto power off",
+        AFTER_DEVICE(INIT_PHASE(DEVICE_INIT_GET_AUTO_POWER_OFF)),
+        device_init_register },
+    [DEVICE_INIT_KEY_FUNCTIONS] = {
+        "key functions",
+        AFTER_DEVICE(INIT_PHASE(DEVICE_INIT_GET_AVAILABLE_BUTTON_PRESETS)
+                     | INIT_PHASE(DEVICE_INIT_GET_ACTIVE_BUTTON_PRESETS)),
+        device_init_register },
+    [DEVICE_INIT_PLAYBACK] = {
+        "playback",
+        AFTER_DEVICE(INIT_PHASE(DEVICE_INIT_GET_VOLUME)),
+        device_init_register },
+};
 
-    g_debug("Device '%s' initialized", device->dbus_name);
+#undef AFTER_INIT
+#undef AFTER_DEVICE
+
+static const device_command_type_t
+        device_init_commands[DEVICE_INIT_NUM_PHASES] = {
+    [DEVICE_INIT_INIT] = DEVICE_COMMAND_INIT,
+    [DEVICE_INIT_GET_MODEL_NAME] = DEVICE_COMMAND_GET_MODEL_NAME,
+    [DEVICE_INIT_GET_BATTERY] = DEVICE_COMMAND_GET_BATTERY,
+    [DEVICE_INIT_GET_LEFT_RIGHT_BATTERY]
+        = DEVICE_COMMAND_GET_LEFT_RIGHT_BATTERY,
+    [DEVICE_INIT_GET_CRADLE_BATTERY] = DEVICE_COMMAND_GET_CRADLE_BATTERY,
+    [DEVICE_INIT_GET_LEFT_RIGHT_CONNECTION_STATUS]
+        = DEVICE_COMMAND_GET_LEFT_RIGHT_CONNECTION_STATUS,
+    [DEVICE_INIT_GET_NOISE_CANCELLING] = DEVICE_COMMAND_GET_NOISE_CANCELLING,
+    [DEVICE_INIT_GET_AMBIENT_SOUND_MODE]
+        = DEVICE_COMMAND_GET_AMBIENT_SOUND_MODE,
+    [DEVICE_INIT_GET_EQ_CAPABILITIES] = DEVICE_COMMAND_GET_EQ_CAPABILITIES,
+    [DEVICE_INIT_GET_EQ_PRESET_AND_LEVELS]
+        = DEVICE_COMMAND_GET_EQ_PRESET_AND_LEVELS,
+    [DEVICE_INIT_GET_AUTO_POWER_OFF] = DEVICE_COMMAND_GET_AUTO_POWER_OFF,
+    [DEVICE_INIT_GET_AVAILABLE_BUTTON_PRESETS]
+        = DEVICE_COMMAND_GET_AVAILABLE_BUTTON_PRESETS,
+    [DEVICE_INIT_GET_ACTIVE_BUTTON_PRESETS]
+        = DEVICE_COMMAND_GET_ACTIVE_BUTTON_PRESETS,
+    [DEVICE_INIT_GET_VOLUME] = DEVICE_COMMAND_GET_VOLUME,
+};
 
-    mdr_device_get_model_name(
-            device->mdr_device,
-            device_add_init_name_success,
-            device_add_init_error,
-            user_data);
-}
+// Queries for values that change while connected.
+#define DEVICE_INIT_STATE_QUERIES \
+    (INIT_PHASE(DEVICE_INIT_GET_BATTERY) \
+     | INIT_PHASE(DEVICE_INIT_GET_LEFT_RIGHT_BATTERY) \
+     | INIT_PHASE(DEVICE_INIT_GET_CRADLE_BATTERY) \
+     | INIT_PHASE(DEVICE_INIT_GET_LEFT_RIGHT_CONNECTION_STATUS) \
+     | INIT_PHASE(DEVICE_INIT_GET_NOISE_CANCELLING) \
+     | INIT_PHASE(DEVICE_INIT_GET_AMBIENT_SOUND_MODE) \
+     | INIT_PHASE(DEVICE_INIT_GET_EQ_PRESET_AND_LEVELS) \
+     | INIT_PHASE(DEVICE_INIT_GET_AUTO_POWER_OFF) \
+     | INIT_PHASE(DEVICE_INIT_GET_ACTIVE_BUTTON_PRESETS) \
+     | INIT_PHASE(DEVICE_INIT_GET_VOLUME))
 
-static void device_start_registration(device_t*);
-static void device_finish_registration(device_t*);
+/*
+ * The interface built by each registration phase. `init` reads the query
+ * results it needs from `values`, indexed by phase.
+ */
+typedef struct
+{
+    void (*init)(device_t*, const device_value_t* values);
+    GDBusInterfaceInfo* (*info)(void);
+    size_t offset;
+}
+device_iface_t;
+
+#define DEVICE_IFACE(init, iface, member) \
+    { init, org_mdr_##iface##_interface_info, offsetof(device_t, member) }
+
+static const device_iface_t device_ifaces[DEVICE_INIT_NUM_PHASES] = {
+    [DEVICE_INIT_POWER_OFF] = DEVICE_IFACE(
+            device_init_power_off,
+            power_off,
+            power_off_iface),
+    [DEVICE_INIT_BATTERY] = DEVICE_IFACE(
+            device_init_battery,
+            battery,
+            battery_iface),
+    [DEVICE_INIT_LEFT_RIGHT_BATTERY] = DEVICE_IFACE(
+            device_init_left_right_battery,
+            left_right_battery,
+            left_right_battery_iface),
+    [DEVICE_INIT_CRADLE_BATTERY] = DEVICE_IFACE(
+            device_init_cradle_battery,
+            cradle_battery,
+            cradle_battery_iface),
+    [DEVICE_INIT_LEFT_RIGHT_CONNECTION_STATUS] = DEVICE_IFACE(
+            device_init_left_right_connection_status,
+            left_right,
+            left_right_iface),
+    [DEVICE_INIT_NOISE_CANCELLING] = DEVICE_IFACE(
+            device_init_noise_cancelling,
+            noise_cancelling,
+            noise_cancelling_iface),
+    [DEVICE_INIT_AMBIENT_SOUND_MODE] = DEVICE_IFACE(
+            device_init_ambient_sound_mode,
+            ambient_sound_mode,
+            ambient_sound_mode_iface),
+    [DEVICE_INIT_EQ] = DEVICE_IFACE(
+            device_init_eq,
+            eq,
+            eq_iface),
+    [DEVICE_INIT_AUTO_POWER_OFF] = DEVICE_IFACE(
+            device_init_auto_power_off,
+            auto_power_off,
+            auto_power_off_iface),
+    [DEVICE_INIT_KEY_FUNCTIONS] = DEVICE_IFACE(
+            device_init_key_functions,
+            key_functions,
+            key_functions_iface),
+    [DEVICE_INIT_PLAYBACK] = DEVICE_IFACE(
+            device_init_playback,
+            playback,
+            playback_iface),
+};
 
-static void device_init_power_off(device_t*);
-static void device_init_battery(device_t*);
-static void device_init_left_right_battery(device_t*);
-static void device_init_cradle_battery(device_t*);
-static void device_init_left_right_connection_status(device_t*);
-static void device_init_noise_cancelling(device_t*);
-static void device_init_ambient_sound_mode(device_t*);
-static void device_init_eq(device_t* device);
-static void device_init_auto_power_off(device_t* device);
-static void device_init_key_functions(device_t* device);
-static void device_init_playback(device_t* device);
+#undef DEVICE_IFACE
 
-static void device_add_init_name_success(uint8_t len,
-                                         const uint8_t* name,
-                                         void* user_data)
+static GDBusInterfaceSkeleton* device_get_iface(device_t* device,
+                                                guint phase)
 {
-    device_add_init_data* init_data = user_data;
-    device_t* device = init_data->device;
+    return *(GDBusInterfaceSkeleton**)
+        ((char*) device + device_ifaces[phase].offset);
+}
 
-    g_debug("Got name for device '%s'", device->dbus_name);
+static void device_init_done(init_graph_t* graph, void* user_data);
 
-    device->device_iface = org_mdr_device_skeleton_new();
+static void device_validate_capabilities(device_t* device,
+                                         capability_cache_entry_t* entry);
 
-    GError* error = NULL;
+static void device_add_init_error(void* user_data);
 
-    if (g_dbus_interface_skeleton_export(
-            G_DBUS_INTERFACE_SKELETON(device->device_iface),
-            connection,
-            device->dbus_name,
-            &error))
-    {
-        g_dbus_interface_skeleton_flush(
-                G_DBUS_INTERFACE_SKELETON(device->device_iface));
+static gboolean device_init_deadline(gpointer user_data);
 
-        org_mdr_device_set_name(
-                device->device_iface,
-                g_strndup((gchar*) name, len));
+static void device_state_invalidate(device_t* device)
+{
+    device->state_sequence++;
 
-        g_debug("Registered device interface for '%s'", device->dbus_name);
-    }
-    else
+    if (device->state != NULL)
     {
-        g_warning("Failed to register device interface: "
-                  "%s", error->message);
-        
-        init_data->error_cb(init_data->user_data);
+        g_variant_unref(device->state);
+        device->state = NULL;
+    }
+}
 
-        // TODO cleanup device
+static void device_state_changed(GObject* skeleton,
+                                 GParamSpec* pspec,
+                                 gpointer user_data)
+{
+    g_object_set_qdata(skeleton, device_state_quark, NULL);
 
-        return;
-    }
+    device_state_invalidate(user_data);
+}
 
-    g_hash_table_insert(device_table, g_strdup(device->dbus_name), device);
+/*
+ * Adds `skeleton` to the device object. Once the device has been announced
+ * this exports it right away, with its own InterfacesAdded.
+ */
+static void device_add_iface(device_t* device,
+                             GDBusInterfaceSkeleton* skeleton)
+{
+    g_signal_connect(skeleton,
+                     "notify",
+                     G_CALLBACK(device_state_changed),
+                     device);
 
-    init_data->success_cb(init_data->user_data);
-    free(init_data);
+    g_dbus_object_skeleton_add_interface(device->object, skeleton);
 
-    mdr_device_supported_functions_t supported_functions
-            = mdr_device_get_supported_functions(device->mdr_device);
+    device_state_invalidate(device);
+}
 
-    if (supported_functions.power_off)
-        device_init_power_off(device);
+static GVariant* device_iface_state(GDBusInterfaceSkeleton* skeleton)
+{
+    GVariant* state = g_object_get_qdata(G_OBJECT(skeleton),
+                                         device_state_quark);
 
-    if (supported_functions.battery)
-        device_init_battery(device);
+    if (state == NULL)
+    {
+        state = g_variant_ref_sink(
+                g_dbus_interface_skeleton_get_properties(skeleton));
 
-    if (supported_functions.left_right_battery)
-        device_init_left_right_battery(device);
+        g_object_set_qdata_full(G_OBJECT(skeleton),
+                                device_state_quark,
+                                state,
+                                (GDestroyNotify) g_variant_unref);
+    }
 
-    if (supported_functions.left_right_connection_status)
-        device_init_left_right_connection_status(device);
+    return state;
+}
 
-    if (supported_functions.cradle_battery)
-        device_init_cradle_battery(device);
+/*
+ * Returns the properties of every interface of the device, keyed by
+ * interface name. Only interfaces that changed since the last call are
+ * read again; when nothing has changed the previous result is reused.
+ */
+static GVariant* device_state(device_t* device)
+{
+    if (device->state != NULL)
+    {
+        return device->state;
+    }
 
-    if (supported_functions.noise_cancelling)
-        device_init_noise_cancelling(device);
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sa{sv}}"));
 
-    if (supported_functions.ambient_sound_mode)
-        device_init_ambient_sound_mode(device);
+    GList* ifaces = g_dbus_object_get_interfaces(
+            G_DBUS_OBJECT(device->object));
 
-    if (supported_functions.eq || supported_functions.eq_non_customizable)
-        device_init_eq(device);
+    for (GList* item = ifaces; item != NULL; item = item->next)
+    {
+        GDBusInterfaceSkeleton* skeleton = item->data;
 
-    if (supported_functions.auto_power_off)
-        device_init_auto_power_off(device);
+        g_variant_builder_add(
+                &builder,
+                "{s@a{sv}}",
+                g_dbus_interface_skeleton_get_info(skeleton)->name,
+                device_iface_state(skeleton));
+    }
 
-    if (supported_functions.assignable_settings)
-        device_init_key_functions(device);
+    g_list_free_full(ifaces, g_object_unref);
 
-    if (supported_functions.playback_controller)
-        device_init_playback(device);
+    device->state = g_variant_ref_sink(g_variant_builder_end(&builder));
 
-    if (device->registrations_in_progress == 0)
-    {
-        org_mdr_device_emit_connected(device->device_iface);
-    }
+    return device->state;
 }
 
-static void device_start_registration(device_t* device)
+static gboolean device_handle_get_state(OrgMdrDevice* interface,
+                                        GDBusMethodInvocation* invocation,
+                                        gpointer user_data)
 {
-    device->registrations_in_progress++;
-}
+    device_t* device = user_data;
 
-static void device_finish_registration(device_t* device)
-{
-    device->registrations_in_progress--;
+    device_coalesce_flush(device);
 
-    if (device->registrations_in_progress == 0)
-    {
-        org_mdr_device_emit_connected(device->device_iface);
-    }
+    org_mdr_device_complete_get_state(interface,
+                                      invocation,
+                                      device->state_sequence,
+                                      device_state(device));
+
+    return TRUE;
 }
 
-static gboolean device_handle_power_off(
-        OrgMdrNoiseCancelling* interface,
+/*
+ * Hands out the device's state page, creating it from the state reported
+ * so far on the first call.
+ */
+static gboolean device_handle_get_state_page(
+        OrgMdrDevice* interface,
         GDBusMethodInvocation* invocation,
-        gpointer user_data);
-
-static void device_init_power_off(device_t* device)
+        GUnixFDList* fd_list,
+        gpointer user_data)
 {
-    device->power_off_iface = org_mdr_power_off_skeleton_new();
-
+    device_t* device = user_data;
     GError* error = NULL;
 
-    if (g_dbus_interface_skeleton_export(
-            G_DBUS_INTERFACE_SKELETON(device->power_off_iface),
-            connection,
-            device->dbus_name,
-            &error))
+    if (device->state_page == NULL)
     {
-        g_dbus_interface_skeleton_flush(
-                G_DBUS_INTERFACE_SKELETON(device->power_off_iface));
+        device->state_page = state_page_new();
+
+        if (device->state_page == NULL)
+        {
+            g_dbus_method_invocation_return_dbus_error(
+                    invocation,
+                    "org.mdr.DeviceError",
+                    "Failed to create the state page.");
+            return TRUE;
+        }
 
-        g_signal_connect(device->power_off_iface,
-                         "handle-power-off",
-                         G_CALLBACK(device_handle_power_off),
-                         device);
+        for (guint phase = 0; phase < DEVICE_INIT_DEVICE; phase++)
+        {
+            if (device->reported_queries & INIT_PHASE(phase))
+            {
+                state_page_write(device->state_page,
+                                 device_init_commands[phase],
+                                 &device->reported_values[phase]);
+            }
+        }
     }
-    else
+
+    GUnixFDList* fds = g_unix_fd_list_new();
+    gint index = g_unix_fd_list_append(fds,
+                                       state_page_get_fd(device->state_page),
+                                       &error);
+    if (index < 0)
     {
-        g_warning("Failed to register power off interface: "
-                  "%s", error->message);
+        g_dbus_method_invocation_return_gerror(invocation, error);
+        g_error_free(error);
+        g_object_unref(fds);
+        return TRUE;
     }
+
+    org_mdr_device_complete_get_state_page(interface,
+                                           invocation,
+                                           fds,
+                                           g_variant_new_handle(index));
+    g_object_unref(fds);
+
+    return TRUE;
 }
 
-static void device_handle_power_off_success(void* user_data);
+static void device_queue_stats_result(const device_event_t* event,
+                                      void* user_data)
+{
+    GDBusMethodInvocation* invocation = user_data;
+
+    if (event->type == DEVICE_EVENT_ERROR)
+    {
+        g_dbus_method_invocation_return_dbus_error(
+                invocation,
+                "org.mdr.DeviceError",
+                "Call failed.");
+        return;
+    }
 
-static void device_handle_power_off_error(void* user_data);
+    g_dbus_method_invocation_return_value(
+            invocation,
+            g_variant_new("(@a{sa{st}})", event->value.io_stats.stats));
+}
 
-static gboolean device_handle_power_off(
-        OrgMdrNoiseCancelling* interface,
+/*
+ * Returns the command scheduling counters of the device's connection, as
+ * kept by the I/O thread.
+ */
+static gboolean device_handle_get_queue_stats(
+        OrgMdrDevice* interface,
         GDBusMethodInvocation* invocation,
         gpointer user_data)
 {
     device_t* device = user_data;
 
-    if (mdr_device_power_off(
-            device->mdr_device,
-            device_handle_power_off_success,
-            device_handle_power_off_error,
-            invocation) < 0)
+    if (device->io == NULL)
     {
         g_dbus_method_invocation_return_dbus_error(
                 invocation,
                 "org.mdr.DeviceError",
-                "Failed to make call.");
+                "Device disconnected.");
+        return TRUE;
     }
 
+    device_io_submit(device->io, &(device_command_t) {
+        .type = DEVICE_COMMAND_GET_IO_STATS,
+        .result_cb = device_queue_stats_result,
+        .user_data = invocation,
+    });
+
     return TRUE;
 }
 
-static void device_handle_power_off_success(void* user_data)
+static device_t* device_new(const gchar* name)
 {
-    GDBusMethodInvocation* invocation = user_data;
+    device_t* device = malloc(sizeof(device_t));
+    if (device == NULL)
+    {
+        return NULL;
+    }
 
-    g_dbus_method_invocation_return_value(invocation, NULL);
+    device->ref_count = 2; // Initialization/table + I/O
+    device->dbus_name = g_strdup(name);
+    device->io = NULL;
+    device->grace_source = 0;
+
+    device->object = g_dbus_object_skeleton_new(name);
+    device->state_sequence = 0;
+    device->state = NULL;
+
+    device->coalesced_values = NULL;
+    device->coalesced_queries = 0;
+    device->coalesce_source = 0;
+
+    device->reported_values = NULL;
+    device->reported_queries = 0;
+    device->updates_forwarded = 0;
+    device->updates_suppressed = 0;
+
+    device->state_page = NULL;
+
+    device->device_iface = NULL;
+    device->power_off_iface = NULL;
+    device->battery_iface = NULL;
+    device->left_right_battery_iface = NULL;
+    device->cradle_battery_iface = NULL;
+    device->left_right_iface = NULL;
+    device->noise_cancelling_iface = NULL;
+    device->ambient_sound_mode_iface = NULL;
+    device->eq_iface = NULL;
+    device->auto_power_off_iface = NULL;
+    device->key_functions_iface = NULL;
+    device->playback_iface = NULL;
+
+    device->key_functions_presets = NULL;
+
+    device->lazy_ifaces = NULL;
+    device->lazy_values = NULL;
+
+    device->eq_presets = NULL;
+
+    return device;
+}
+
+void device_add(const gchar* name,
+                gint sock,
+                device_created_cb success_cb,
+                device_create_error_cb error_cb,
+                void* user_data)
+{
+    device_add_init_data* init_data = malloc(sizeof(device_add_init_data));
+    if (init_data == NULL)
+    {
+        error_cb(user_data);
+        return;
+    }
+
+    device_t* device = g_hash_table_lookup(device_table, name);
+
+    if (device != NULL && device->grace_source != 0)
+    {
+        g_source_remove(device->grace_source);
+        device->grace_source = 0;
+
+        device_ref(device); // Initialization
+        device_ref(device); // I/O
+
+        init_data->rebind = true;
+    }
+    else
+    {
+        device = device_new(name);
+        if (device == NULL)
+        {
+            free(init_data);
+            error_cb(user_data);
+            return;
+        }
+
+        init_data->rebind = false;
+    }
+
+    init_data->device = device;
+    init_data->sock = sock;
+    init_data->graph = init_graph_new(device_init_phases,
+                                      DEVICE_INIT_NUM_PHASES,
+                                      device_init_done,
+                                      init_data);
+
+    memset(&init_data->values, 0, sizeof(init_data->values));
+
+    init_data->cached = capability_cache_lookup(device->dbus_name,
+                                                &init_data->cache);
+    init_data->lazy_queries = 0;
+
+    init_data->deadline_source = g_timeout_add_seconds(init_deadline,
+                                                       device_init_deadline,
+                                                       init_data);
+    init_data->deadline_retries = 0;
+    init_data->deadline_passed = false;
+    init_data->connected = false;
+
+    init_data->outstanding = 0;
+    init_data->released = false;
+
+    retry_state_init(&init_data->retry, DEVICE_INIT_RETRY_BUDGET);
+    memset(init_data->failures, 0, sizeof(init_data->failures));
+
+    init_data->success_cb = success_cb;
+    init_data->error_cb = error_cb;
+    init_data->user_data = user_data;
+
+    init_graph_run(init_data->graph);
+}
+
+static void device_add_init_data_free(device_add_init_data* init_data)
+{
+    if (init_data->deadline_source != 0)
+    {
+        g_source_remove(init_data->deadline_source);
+        init_data->deadline_source = 0;
+    }
+
+    if (init_data->outstanding > 0)
+    {
+        init_data->released = true;
+        return;
+    }
+
+    for (int i = 0; i < DEVICE_INIT_NUM_PHASES; i++)
+    {
+        device_value_clear(device_init_commands[i], &init_data->values[i]);
+    }
+
+    if (init_data->cached)
+    {
+        capability_cache_entry_clear(&init_data->cache);
+    }
+
+    init_graph_free(init_data->graph);
+    free(init_data);
+}
+
+static void device_init_connect_result(const device_event_t* event,
+                                       void* user_data);
+
+static void device_init_connect(init_graph_t* graph,
+                                guint phase,
+                                void* user_data)
+{
+    device_add_init_data* init_data = user_data;
+    device_t* device = init_data->device;
+
+    device->io = device_io_connect(init_data->sock,
+                                   device,
+                                   device_init_connect_result,
+                                   init_data);
+}
+
+static void device_init_connect_result(const device_event_t* event,
+                                       void* user_data)
+{
+    device_add_init_data* init_data = user_data;
+    device_t* device = init_data->device;
+
+    if (event->type == DEVICE_EVENT_ERROR)
+    {
+        // The I/O handle has already been released.
+        device->io = NULL;
+
+        init_graph_finish(init_data->graph, DEVICE_INIT_CONNECT, false);
+        return;
+    }
+
+    g_debug("Connected to MDR device '%s'", device->dbus_name);
+
+    init_graph_finish(init_data->graph, DEVICE_INIT_CONNECT, true);
+}
+
+static void device_init_query_result(const device_event_t* event,
+                                     void* user_data);
+
+static void device_init_query(init_graph_t* graph,
+                              guint phase,
+                              void* user_data)
+{
+    device_add_init_data* init_data = user_data;
+    device_t* device = init_data->device;
+
+    if (device->io == NULL)
+    {
+        init_graph_finish(graph, phase, false);
+        return;
+    }
+
+    init_data->outstanding++;
+
+    device_io_submit(device->io, &(device_command_t) {
+        .type = device_init_commands[phase],
+        .result_cb = device_init_query_result,
+        .user_data = init_data,
+    });
+}
+
+static guint device_init_query_phase(device_command_type_t command)
+{
+    guint phase = DEVICE_INIT_INIT;
+
+    while (device_init_commands[phase] != command)
+    {
+        phase++;
+    }
+
+    return phase;
+}
+
+/*
+ * Returns the member of `entry` that caches the result of `command`.
+ */
+static device_value_t* device_cached_value(capability_cache_entry_t* entry,
+                                           device_command_type_t command)
+{
+    switch (command)
+    {
+        case DEVICE_COMMAND_GET_MODEL_NAME:
+            return &entry->model;
+
+        case DEVICE_COMMAND_GET_EQ_CAPABILITIES:
+            return &entry->eq_capabilities;
+
+        case DEVICE_COMMAND_GET_AVAILABLE_BUTTON_PRESETS:
+            return &entry->available_button_presets;
+
+        default:
+            return NULL;
+    }
+}
+
+static void device_init_cached_query(init_graph_t* graph,
+                                     guint phase,
+                                     void* user_data)
+{
+    device_add_init_data* init_data = user_data;
+    device_command_type_t command = device_init_commands[phase];
+
+    if (!init_data->cached)
+    {
+        device_init_query(graph, phase, user_data);
+        return;
+    }
+
+    device_value_copy(command,
+                      &init_data->values[phase],
+                      device_cached_value(&init_data->cache, command));
+
+    init_graph_finish(graph, phase, true);
+}
+
+static void device_init_disable_unsupported(
+        init_graph_t* graph,
+        const mdr_device_supported_functions_t* supported_functions)
+{
+    if (!supported_functions->power_off)
+        init_graph_disable(graph, DEVICE_INIT_POWER_OFF);
+
+    if (!supported_functions->battery)
+        init_graph_disable(graph, DEVICE_INIT_GET_BATTERY);
+
+    if (!supported_functions->left_right_battery)
+        init_graph_disable(graph, DEVICE_INIT_GET_LEFT_RIGHT_BATTERY);
+
+    if (!supported_functions->left_right_connection_status)
+        init_graph_disable(graph,
+                           DEVICE_INIT_GET_LEFT_RIGHT_CONNECTION_STATUS);
+
+    if (!supported_functions->cradle_battery)
+        init_graph_disable(graph, DEVICE_INIT_GET_CRADLE_BATTERY);
+
+    if (!supported_functions->noise_cancelling)
+        init_graph_disable(graph, DEVICE_INIT_GET_NOISE_CANCELLING);
+
+    if (!supported_functions->ambient_sound_mode)
+        init_graph_disable(graph, DEVICE_INIT_GET_AMBIENT_SOUND_MODE);
+
+    if (!supported_functions->eq && !supported_functions->eq_non_customizable)
+    {
+        init_graph_disable(graph, DEVICE_INIT_GET_EQ_CAPABILITIES);
+        init_graph_disable(graph, DEVICE_INIT_GET_EQ_PRESET_AND_LEVELS);
+    }
+
+    if (!supported_functions->auto_power_off)
+        init_graph_disable(graph, DEVICE_INIT_GET_AUTO_POWER_OFF);
+
+    if (!supported_functions->assignable_settings)
+    {
+        init_graph_disable(graph, DEVICE_INIT_GET_AVAILABLE_BUTTON_PRESETS);
+        init_graph_disable(graph, DEVICE_INIT_GET_ACTIVE_BUTTON_PRESETS);
+    }
+
+    if (!supported_functions->playback_controller)
+        init_graph_disable(graph, DEVICE_INIT_GET_VOLUME);
+}
+
+typedef struct
+{
+    device_add_init_data* init_data;
+    guint phase;
+}
+device_init_retry_data;
+
+static gboolean device_init_retry_expired(gpointer user_data)
+{
+    device_init_retry_data* retry = user_data;
+    device_add_init_data* init_data = retry->init_data;
+
+    init_data->outstanding--;
+
+    if (init_data->released)
+    {
+        if (init_data->outstanding == 0)
+        {
+            device_add_init_data_free(init_data);
+        }
+    }
+    else if (init_graph_running(init_data->graph, retry->phase))
+    {
+        device_init_query(init_data->graph, retry->phase, init_data);
+    }
+
+    g_free(retry);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Schedules a failed query to be sent again after a backoff, if the retry
+ * policy allows it. The phase keeps running meanwhile, so everything that
+ * depends on it waits and is registered once it succeeds.
+ */
+static bool device_init_retry(device_add_init_data* init_data, guint phase)
+{
+    guint delay;
+
+    if (init_data->device->io == NULL
+            || !retry_next(&device_init_retry_policy,
+                           &init_data->retry,
+                           ++init_data->failures[phase],
+                           &delay))
+    {
+        return false;
+    }
+
+    g_debug("%s: retrying %s in %u ms",
+            init_data->device->dbus_name,
+            device_init_phases[phase].name,
+            delay);
+
+    device_init_retry_data* retry = g_new(device_init_retry_data, 1);
+
+    retry->init_data = init_data;
+    retry->phase = phase;
+
+    // The pending retry keeps the init data alive like a query would.
+    init_data->outstanding++;
+
+    g_timeout_add(delay, device_init_retry_expired, retry);
+
+    return true;
+}
+
+/*
+ * Returns the state queries of the interfaces `device` has exported.
+ */
+static guint32 device_exported_queries(device_t* device)
+{
+    guint32 queries = 0;
+
+    for (guint phase = DEVICE_INIT_POWER_OFF; phase < DEVICE_INIT_NUM_PHASES;
+            phase++)
+    {
+        if (device_get_iface(device, phase) != NULL)
+        {
+            queries |= device_init_phases[phase].after;
+        }
+    }
+
+    return queries & DEVICE_INIT_STATE_QUERIES;
+}
+
+static void device_init_query_result(const device_event_t* event,
+                                     void* user_data)
+{
+    device_add_init_data* init_data = user_data;
+    guint phase = device_init_query_phase(event->command);
+
+    init_data->outstanding--;
+
+    if (init_data->released)
+    {
+        if (init_data->outstanding == 0)
+        {
+            device_add_init_data_free(init_data);
+        }
+        return;
+    }
+
+    // Answered already, by an earlier or a resent query.
+    if (!init_graph_running(init_data->graph, phase))
+    {
+        return;
+    }
+
+    if (event->type == DEVICE_EVENT_ERROR)
+    {
+        if (!device_init_retry(init_data, phase))
+        {
+            init_graph_finish(init_data->graph, phase, false);
+        }
+        return;
+    }
+
+    retry_succeeded(&init_data->retry, init_data->failures[phase]);
+
+    device_value_copy(event->command, &init_data->values[phase], &event->value);
+
+    if (phase == DEVICE_INIT_INIT)
+    {
+        const mdr_device_supported_functions_t* supported_functions
+            = &event->value.model.supported_functions;
+
+        g_debug("Device '%s' initialized", init_data->device->dbus_name);
+
+        if (init_data->cached
+                && memcmp(supported_functions,
+                          &init_data->cache.model.model.supported_functions,
+                          sizeof(*supported_functions)) != 0)
+        {
+            g_debug("Cached capabilities of '%s' are outdated",
+                    init_data->device->dbus_name);
+
+            capability_cache_remove(init_data->device->dbus_name);
+            capability_cache_entry_clear(&init_data->cache);
+            init_data->cached = false;
+        }
+
+        device_init_disable_unsupported(init_data->graph,
+                                        supported_functions);
+
+        if (lazy_properties)
+        {
+            // Exported interfaces are kept up to date on reconnect.
+            guint32 queries = DEVICE_INIT_STATE_QUERIES
+                              & ~device_exported_queries(init_data->device);
+
+            for (guint query = 0; query < DEVICE_INIT_NUM_PHASES; query++)
+            {
+                if ((queries & INIT_PHASE(query))
+                        && init_graph_disable(init_data->graph, query))
+                {
+                    init_data->lazy_queries |= INIT_PHASE(query);
+                }
+            }
+        }
+    }
+
+    init_graph_finish(init_data->graph, phase, true);
+}
+
+static void device_init_connected(device_add_init_data* init_data)
+{
+    device_t* device = init_data->device;
+
+    if (init_data->connected || device->io == NULL)
+    {
+        return;
+    }
+
+    init_data->connected = true;
+
+    // Everything ready so far is announced in a single InterfacesAdded.
+    if (!g_dbus_object_manager_server_is_exported(device_manager,
+                                                  device->object))
+    {
+        g_dbus_object_manager_server_export(device_manager, device->object);
+
+        for (GSList* item = device_peer_managers; item != NULL;
+                item = item->next)
+        {
+            g_dbus_object_manager_server_export(item->data, device->object);
+        }
+    }
+
+    // Clients were never told a reconnected device had gone.
+    if (!init_data->rebind)
+    {
+        org_mdr_device_emit_connected(device->device_iface);
+    }
+}
+
+/*
+ * Announces the device with the interfaces it has so far and sends the
+ * queries that have not been answered again.
+ */
+static gboolean device_init_deadline(gpointer user_data)
+{
+    device_add_init_data* init_data = user_data;
+    device_t* device = init_data->device;
+    init_graph_t* graph = init_data->graph;
+
+    init_data->deadline_passed = true;
+
+    if (init_graph_succeeded(graph, DEVICE_INIT_DEVICE))
+    {
+        g_message("Device '%s' is not fully initialized after %u s",
+                  device->dbus_name,
+                  init_deadline);
+
+        device_init_connected(init_data);
+    }
+
+    if (device->io == NULL
+            || init_data->deadline_retries >= DEVICE_INIT_MAX_RESENDS)
+    {
+        init_data->deadline_source = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    init_data->deadline_retries++;
+
+    for (guint phase = DEVICE_INIT_INIT; phase < DEVICE_INIT_DEVICE; phase++)
+    {
+        if (init_graph_running(graph, phase))
+        {
+            g_debug("%s: resending %s",
+                    device->dbus_name,
+                    device_init_phases[phase].name);
+
+            device_init_query(graph, phase, init_data);
+        }
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean device_handle_apply_settings(
+        OrgMdrDevice* interface,
+        GDBusMethodInvocation* invocation,
+        GVariant* settings,
+        gpointer user_data);
+
+static void device_init_device(init_graph_t* graph,
+                               guint phase,
+                               void* user_data)
+{
+    device_add_init_data* init_data = user_data;
+    device_t* device = init_data->device;
+
+    if (init_data->rebind)
+    {
+        org_mdr_device_set_name(
+                device->device_iface,
+                init_data->values[DEVICE_INIT_GET_MODEL_NAME].model.name);
+
+        init_data->success_cb(init_data->user_data);
+
+        init_graph_finish(graph, phase, true);
+        return;
+    }
+
+    device->device_iface = org_mdr_device_skeleton_new();
+
+    g_signal_connect(device->device_iface,
+                     "handle-get-state",
+                     G_CALLBACK(device_handle_get_state),
+                     device);
+
+    g_signal_connect(device->device_iface,
+                     "handle-apply-settings",
+                     G_CALLBACK(device_handle_apply_settings),
+                     device);
+
+    g_signal_connect(device->device_iface,
+                     "handle-get-state-page",
+                     G_CALLBACK(device_handle_get_state_page),
+                     device);
+
+    g_signal_connect(device->device_iface,
+                     "handle-get-queue-stats",
+                     G_CALLBACK(device_handle_get_queue_stats),
+                     device);
+
+    org_mdr_device_set_name(
+            device->device_iface,
+            init_data->values[DEVICE_INIT_GET_MODEL_NAME].model.name);
+
+    device_add_iface(device, G_DBUS_INTERFACE_SKELETON(device->device_iface));
+
+    g_debug("Registered device interface for '%s'", device->dbus_name);
+
+    if (init_data->deadline_passed)
+    {
+        device_init_connected(init_data);
+    }
+
+    // The table takes over the initial reference.
+    g_hash_table_insert(device_table, g_strdup(device->dbus_name), device);
+    device_ref(device); // Initialization
+
+    init_data->success_cb(init_data->user_data);
+
+    init_graph_finish(graph, phase, true);
+}
+
+/*
+ * Caches what discovery found, unless part of it failed.
+ */
+static void device_init_store_capabilities(device_add_init_data* init_data)
+{
+    init_graph_t* graph = init_data->graph;
+    const mdr_device_supported_functions_t* supported_functions
+        = &init_data->values[DEVICE_INIT_INIT].model.supported_functions;
+
+    if (!init_graph_succeeded(graph, DEVICE_INIT_GET_MODEL_NAME))
+        return;
+
+    if ((supported_functions->eq || supported_functions->eq_non_customizable)
+            && !init_graph_succeeded(graph, DEVICE_INIT_GET_EQ_CAPABILITIES))
+        return;
+
+    if (supported_functions->assignable_settings
+            && !init_graph_succeeded(graph,
+                                     DEVICE_INIT_GET_AVAILABLE_BUTTON_PRESETS))
+        return;
+
+    // Borrows the values; the entry is only encoded.
+    capability_cache_entry_t entry = {
+        .model = init_data->values[DEVICE_INIT_GET_MODEL_NAME],
+        .eq_capabilities
+            = init_data->values[DEVICE_INIT_GET_EQ_CAPABILITIES],
+        .available_button_presets
+            = init_data->values[DEVICE_INIT_GET_AVAILABLE_BUTTON_PRESETS],
+    };
+
+    entry.model.model.supported_functions = *supported_functions;
+
+    capability_cache_store(init_data->device->dbus_name, &entry);
+}
+
+/*
+ * Tells clients that the interface of `phase` can be used.
+ */
+static void device_init_ready(device_t* device, guint phase)
+{
+    if (device_get_iface(device, phase) != NULL)
+    {
+        org_mdr_device_emit_ready(device->device_iface,
+                                  device_ifaces[phase].info()->name);
+    }
+}
+
+/*
+ * Records `value` as the state last applied for the getter `command`.
+ *
+ * Returns false, and counts the notification as suppressed, if it is the
+ * state already recorded.
+ */
+static bool device_report(device_t* device,
+                          device_command_type_t command,
+                          const device_value_t* value)
+{
+    guint query = device_init_query_phase(command);
+
+    if (device->reported_values == NULL)
+    {
+        device->reported_values = g_new0(device_value_t, DEVICE_INIT_DEVICE);
+    }
+
+    if (device->reported_queries & INIT_PHASE(query))
+    {
+        if (device_value_equal(command,
+                               &device->reported_values[query],
+                               value))
+        {
+            device->updates_suppressed++;
+            device_updates_suppressed++;
+            return false;
+        }
+
+        device_value_clear(command, &device->reported_values[query]);
+    }
+
+    device_value_copy(command, &device->reported_values[query], value);
+    device->reported_queries |= INIT_PHASE(query);
+
+    if (device->state_page != NULL)
+    {
+        state_page_write(device->state_page, command, value);
+    }
+
+    return true;
+}
+
+/*
+ * Forgets the state recorded for `command`, after a property has been set
+ * to `value` ahead of the device reporting it. The state page shows
+ * `value` right away, like the property.
+ */
+static void device_report_forget(device_t* device,
+                                 device_command_type_t command,
+                                 const device_value_t* value)
+{
+    guint query = device_init_query_phase(command);
+
+    if (device->reported_queries & INIT_PHASE(query))
+    {
+        device_value_clear(command, &device->reported_values[query]);
+        device->reported_queries &= ~INIT_PHASE(query);
+    }
+
+    if (device->state_page != NULL)
+    {
+        state_page_write(device->state_page, command, value);
+    }
+}
+
+/*
+ * Returns the state last reported for `command`, or NULL if there is none.
+ */
+static const device_value_t* device_reported_value(
+        device_t* device,
+        device_command_type_t command)
+{
+    guint query = device_init_query_phase(command);
+
+    if (!(device->reported_queries & INIT_PHASE(query)))
+    {
+        return NULL;
+    }
+
+    return &device->reported_values[query];
+}
+
+/*
+ * Records the state an interface has just been built from.
+ */
+static void device_report_phase(device_t* device,
+                                guint phase,
+                                const device_value_t* values)
+{
+    guint32 queries = device_init_phases[phase].after
+                      & DEVICE_INIT_STATE_QUERIES;
+
+    for (guint query = 0; query < DEVICE_INIT_NUM_PHASES; query++)
+    {
+        if (queries & INIT_PHASE(query))
+        {
+            device_report(device, device_init_commands[query], &values[query]);
+        }
+    }
+}
+
+static void device_init_register(init_graph_t* graph,
+                                 guint phase,
+                                 void* user_data)
+{
+    device_add_init_data* init_data = user_data;
+    device_t* device = init_data->device;
+
+    if (device_get_iface(device, phase) == NULL)
+    {
+        device_ifaces[phase].init(device, init_data->values);
+        device_report_phase(device, phase, init_data->values);
+
+        device_init_ready(device, phase);
+    }
+    else
+    {
+        guint32 queries = device_init_phases[phase].after
+                          & DEVICE_INIT_STATE_QUERIES;
+
+        for (guint query = 0; query < DEVICE_INIT_NUM_PHASES; query++)
+        {
+            if (queries & INIT_PHASE(query))
+            {
+                device_update(device,
+                              device_init_commands[query],
+                              &init_data->values[query]);
+            }
+        }
+    }
+
+    init_graph_finish(graph, phase, true);
+}
+
+static void device_lazy_export(device_t* device,
+                               device_add_init_data* init_data);
+
+static void device_init_done(init_graph_t* graph, void* user_data)
+{
+    device_add_init_data* init_data = user_data;
+    device_t* device = init_data->device;
+
+    if (!init_graph_succeeded(graph, DEVICE_INIT_CONNECT)
+            && init_data->rebind)
+    {
+        init_data->error_cb(init_data->user_data);
+        device_add_init_data_free(init_data);
+
+        g_hash_table_remove(device_table, device->dbus_name);
+
+        device_unref(device); // I/O
+        device_unref(device); // Initialization
+        return;
+    }
+
+    if (!init_graph_succeeded(graph, DEVICE_INIT_CONNECT))
+    {
+        g_free((gchar*) device->dbus_name);
+        free(device);
+
+        init_data->error_cb(init_data->user_data);
+        device_add_init_data_free(init_data);
+        return;
+    }
+
+    if (!init_graph_succeeded(graph, DEVICE_INIT_DEVICE))
+    {
+        device_add_init_error(init_data);
+        return;
+    }
+
+    init_graph_log_timings(graph, device->dbus_name);
+
+    if (init_data->retry.retries > 0)
+    {
+        g_message("Device '%s': %u retries, %u recovered, %u given up",
+                  device->dbus_name,
+                  init_data->retry.retries,
+                  init_data->retry.recovered,
+                  init_data->retry.exhausted);
+    }
+
+    device_init_connected(init_data);
+
+    // After the device object, so that clients see the ready signals.
+    if (init_data->lazy_queries != 0)
+    {
+        device_lazy_export(device, init_data);
+    }
+
+    if (init_data->cached)
+    {
+        device_validate_capabilities(device, &init_data->cache);
+        init_data->cached = false;
+    }
+    else
+    {
+        device_init_store_capabilities(init_data);
+    }
+
+    device_add_init_data_free(init_data);
+    device_unref(device); // Initialization
+}
+
+/*
+ * An interface exported in lazy mode before its values have been fetched.
+ *
+ * The object is registered with the interface's introspection data only, so
+ * GDBus routes property access to the method handler as well. Every call
+ * is held until the first one has fetched the values, then the real
+ * skeleton replaces the placeholder and the held calls are replayed on it.
+ */
+typedef struct
+{
+    device_t* device;
+    guint phase;
+    guint registration_id;
+
+    GQueue waiters;
+    guint32 pending;
+    bool failed;
+}
+device_lazy_iface_t;
+
+static void device_lazy_method_call(GDBusConnection* bus,
+                                    const gchar* sender,
+                                    const gchar* object_path,
+                                    const gchar* interface_name,
+                                    const gchar* method_name,
+                                    GVariant* parameters,
+                                    GDBusMethodInvocation* invocation,
+                                    gpointer user_data);
+
+static const GDBusInterfaceVTable device_lazy_vtable = {
+    .method_call = device_lazy_method_call,
+};
+
+static device_lazy_iface_t* device_lazy_find(device_t* device, guint phase)
+{
+    for (GSList* item = device->lazy_ifaces; item != NULL; item = item->next)
+    {
+        device_lazy_iface_t* lazy = item->data;
+
+        if (lazy->phase == phase)
+        {
+            return lazy;
+        }
+    }
+
+    return NULL;
+}
+
+static void device_lazy_export(device_t* device,
+                               device_add_init_data* init_data)
+{
+    init_graph_t* graph = init_data->graph;
+
+    for (guint phase = DEVICE_INIT_DEVICE; phase < DEVICE_INIT_NUM_PHASES;
+            phase++)
+    {
+        guint32 after = device_init_phases[phase].after;
+        guint32 eager = after & ~init_data->lazy_queries;
+
+        if (device_ifaces[phase].info == NULL
+                || !(after & init_data->lazy_queries)
+                || device_get_iface(device, phase) != NULL
+                || device_lazy_find(device, phase) != NULL)
+        {
+            continue;
+        }
+
+        bool ready = true;
+
+        for (guint dependency = 0; dependency < DEVICE_INIT_NUM_PHASES;
+                dependency++)
+        {
+            if ((eager & INIT_PHASE(dependency))
+                    && !init_graph_succeeded(graph, dependency))
+            {
+                ready = false;
+            }
+        }
+
+        if (!ready)
+        {
+            continue;
+        }
+
+        device_lazy_iface_t* lazy = g_new0(device_lazy_iface_t, 1);
+        GError* error = NULL;
+
+        lazy->device = device;
+        lazy->phase = phase;
+        g_queue_init(&lazy->waiters);
+
+        lazy->registration_id = g_dbus_connection_register_object(
+                connection,
+                device->dbus_name,
+                device_ifaces[phase].info(),
+                &device_lazy_vtable,
+                lazy,
+                NULL,
+                &error);
+
+        if (lazy->registration_id == 0)
+        {
+            g_warning("Failed to register %s interface: %s",
+                      device_init_phases[phase].name,
+                      error->message);
+            g_error_free(error);
+            g_free(lazy);
+            continue;
+        }
+
+        device->lazy_ifaces = g_slist_prepend(device->lazy_ifaces, lazy);
+
+        org_mdr_device_emit_ready(device->device_iface,
+                                  device_ifaces[phase].info()->name);
+    }
+
+    if (device->lazy_ifaces == NULL || device->lazy_values != NULL)
+    {
+        return;
+    }
+
+    // The interfaces are built from the discovered capabilities as well.
+    device->lazy_values = g_new0(device_value_t, DEVICE_INIT_NUM_PHASES);
+
+    for (guint phase = DEVICE_INIT_INIT; phase < DEVICE_INIT_DEVICE; phase++)
+    {
+        if (!(init_data->lazy_queries & INIT_PHASE(phase)))
+        {
+            device_value_copy(device_init_commands[phase],
+                              &device->lazy_values[phase],
+                              &init_data->values[phase]);
+        }
+    }
+}
+
+static void device_lazy_fail(device_lazy_iface_t* lazy, const gchar* message)
+{
+    GDBusMethodInvocation* invocation;
+
+    while ((invocation = g_queue_pop_head(&lazy->waiters)) != NULL)
+    {
+        g_dbus_method_invocation_return_dbus_error(
+                invocation,
+                "org.mdr.DeviceError",
+                message);
+    }
+}
+
+/*
+ * Completes `invocation`, made on the placeholder, on `skeleton`.
+ */
+static void device_lazy_dispatch(GDBusInterfaceSkeleton* skeleton,
+                                 GDBusMethodInvocation* invocation)
+{
+    GDBusInterfaceVTable* vtable
+        = g_dbus_interface_skeleton_get_vtable(skeleton);
+    const gchar* sender = g_dbus_method_invocation_get_sender(invocation);
+    const gchar* object_path
+        = g_dbus_method_invocation_get_object_path(invocation);
+    const gchar* interface_name
+        = g_dbus_method_invocation_get_interface_name(invocation);
+    const gchar* method_name
+        = g_dbus_method_invocation_get_method_name(invocation);
+    GVariant* parameters = g_dbus_method_invocation_get_parameters(invocation);
+
+    if (g_strcmp0(interface_name, "org.freedesktop.DBus.Properties") != 0)
+    {
+        vtable->method_call(connection,
+                            sender,
+                            object_path,
+                            interface_name,
+                            method_name,
+                            parameters,
+                            invocation,
+                            skeleton);
+    }
+    else if (g_strcmp0(method_name, "Get") == 0)
+    {
+        const gchar* property_name;
+        GError* error = NULL;
+
+        g_variant_get(parameters, "(&s&s)", &interface_name, &property_name);
+
+        GVariant* value = vtable->get_property(connection,
+                                               sender,
+                                               object_path,
+                                               interface_name,
+                                               property_name,
+                                               &error,
+                                               skeleton);
+        if (value == NULL)
+        {
+            g_dbus_method_invocation_return_gerror(invocation, error);
+            g_error_free(error);
+            return;
+        }
+
+        g_variant_take_ref(value);
+        g_dbus_method_invocation_return_value(invocation,
+                                              g_variant_new("(v)", value));
+        g_variant_unref(value);
+    }
+    else if (g_strcmp0(method_name, "GetAll") == 0)
+    {
+        GVariant* properties = g_variant_ref_sink(
+                g_dbus_interface_skeleton_get_properties(skeleton));
+
+        g_dbus_method_invocation_return_value(
+                invocation,
+                g_variant_new("(@a{sv})", properties));
+        g_variant_unref(properties);
+    }
+    else
+    {
+        g_dbus_method_invocation_return_dbus_error(
+                invocation,
+                "org.freedesktop.DBus.Error.PropertyReadOnly",
+                "Property is read-only.");
+    }
+}
+
+/*
+ * Replaces the placeholder with the real interface, built from the fetched
+ * values, and frees it.
+ */
+static void device_lazy_populate(device_lazy_iface_t* lazy)
+{
+    device_t* device = lazy->device;
+    guint phase = lazy->phase;
+    guint32 queries = device_init_phases[phase].after
+                      & DEVICE_INIT_STATE_QUERIES;
+
+    g_dbus_connection_unregister_object(connection, lazy->registration_id);
+    device->lazy_ifaces = g_slist_remove(device->lazy_ifaces, lazy);
+
+    device_ifaces[phase].init(device, device->lazy_values);
+    device_report_phase(device, phase, device->lazy_values);
+
+    for (guint query = 0; query < DEVICE_INIT_NUM_PHASES; query++)
+    {
+        if (queries & INIT_PHASE(query))
+        {
+            device_value_clear(device_init_commands[query],
+                               &device->lazy_values[query]);
+        }
+    }
+
+    GDBusInterfaceSkeleton* skeleton = device_get_iface(device, phase);
+
+    if (skeleton == NULL)
+    {
+        device_lazy_fail(lazy, "Call failed.");
+    }
+    else
+    {
+        GDBusMethodInvocation* invocation;
+
+        while ((invocation = g_queue_pop_head(&lazy->waiters)) != NULL)
+        {
+            device_lazy_dispatch(skeleton, invocation);
+        }
+    }
+
+    g_free(lazy);
+}
+
+static void device_lazy_result(const device_event_t* event, void* user_data)
+{
+    device_lazy_iface_t* lazy = user_data;
+    device_t* device = lazy->device;
+    guint query = device_init_query_phase(event->command);
+
+    lazy->pending &= ~INIT_PHASE(query);
+
+    if (event->type == DEVICE_EVENT_ERROR)
+    {
+        lazy->failed = true;
+    }
+    else
+    {
+        device_value_clear(event->command, &device->lazy_values[query]);
+        device_value_copy(event->command,
+                          &device->lazy_values[query],
+                          &event->value);
+    }
+
+    if (lazy->pending != 0)
+    {
+        return;
+    }
+
+    if (lazy->failed || device->io == NULL)
+    {
+        // The placeholder stays; the next call tries again.
+        lazy->failed = false;
+        device_lazy_fail(lazy, "Call failed.");
+    }
+    else
+    {
+        device_lazy_populate(lazy);
+    }
+
+    device_unref(device); // Lazy fetch
 }
 
-static void device_handle_power_off_error(void* user_data)
+/*
+ * Queries the values of a placeholder. Calls made while a fetch is in
+ * progress wait for it instead of starting another one.
+ */
+static void device_lazy_fetch(device_lazy_iface_t* lazy)
 {
-    GDBusMethodInvocation* invocation = user_data;
+    device_t* device = lazy->device;
+    guint32 queries = device_init_phases[lazy->phase].after
+                      & DEVICE_INIT_STATE_QUERIES;
 
-    g_dbus_method_invocation_return_dbus_error(
-            invocation,
-            "org.mdr.DeviceError",
-            "Call failed.");
+    if (lazy->pending != 0)
+    {
+        return;
+    }
+
+    if (device->io == NULL)
+    {
+        device_lazy_fail(lazy, "Device disconnected.");
+        return;
+    }
+
+    device_ref(device); // Lazy fetch
+
+    lazy->pending = queries;
+
+    for (guint query = 0; query < DEVICE_INIT_NUM_PHASES; query++)
+    {
+        if (queries & INIT_PHASE(query))
+        {
+            device_io_submit(device->io, &(device_command_t) {
+                .type = device_init_commands[query],
+                .result_cb = device_lazy_result,
+                .user_data = lazy,
+            });
+        }
+    }
 }
 
-static void device_init_battery_success(uint8_t level,
-                                        bool charging,
-                                        void* user_data);
+static void device_lazy_method_call(GDBusConnection* bus,
+                                    const gchar* sender,
+                                    const gchar* object_path,
+                                    const gchar* interface_name,
+                                    const gchar* method_name,
+                                    GVariant* parameters,
+                                    GDBusMethodInvocation* invocation,
+                                    gpointer user_data)
+{
+    device_lazy_iface_t* lazy = user_data;
+
+    g_queue_push_tail(&lazy->waiters, invocation);
+
+    device_lazy_fetch(lazy);
+}
+
+/*
+ * Unregisters the placeholders left when the device goes away.
+ */
+static void device_lazy_free(device_t* device)
+{
+    for (GSList* item = device->lazy_ifaces; item != NULL; item = item->next)
+    {
+        device_lazy_iface_t* lazy = item->data;
+
+        g_dbus_connection_unregister_object(connection,
+                                            lazy->registration_id);
+        device_lazy_fail(lazy, "Device disconnected.");
+        g_free(lazy);
+    }
+
+    g_slist_free(device->lazy_ifaces);
+    device->lazy_ifaces = NULL;
+
+    if (device->lazy_values != NULL)
+    {
+        for (guint phase = 0; phase < DEVICE_INIT_NUM_PHASES; phase++)
+        {
+            device_value_clear(device_init_commands[phase],
+                               &device->lazy_values[phase]);
+        }
+
+        g_free(device->lazy_values);
+        device->lazy_values = NULL;
+    }
+}
 
-static void device_init_battery_error(void* user_data);
+static gboolean device_handle_power_off(
+        OrgMdrNoiseCancelling* interface,
+        GDBusMethodInvocation* invocation,
+        gpointer user_data);
 
-static void device_init_battery(device_t* device)
+/*
+ * Completes a D-Bus method call with the result of a device command that
+ * does not return a value.
+ */
+static void device_invocation_result(const device_event_t* event,
+                                     void* user_data)
 {
-    if (mdr_device_get_battery_level(
-            device->mdr_device,
-            device_init_battery_success,
-            device_init_battery_error,
-            device) < 0)
+    GDBusMethodInvocation* invocation = user_data;
+
+    device_flush(event->owner);
+
+    if (event->type == DEVICE_EVENT_ERROR)
     {
-        g_warning("Device init battery failed: %d", errno);
+        g_dbus_method_invocation_return_dbus_error(
+                invocation,
+                "org.mdr.DeviceError",
+                "Call failed.");
     }
     else
     {
-        device_start_registration(device);
-        device_ref(device);
+        g_dbus_method_invocation_return_value(invocation, NULL);
     }
 }
 
-static void device_init_battery_error(void* user_data)
+/*
+ * Submits a command whose result completes `invocation`.
+ */
+static void device_invoke(device_t* device,
+                          GDBusMethodInvocation* invocation,
+                          device_command_t command)
+{
+    if (device->io == NULL)
+    {
+        device_value_clear(command.type, &command.value);
+
+        g_dbus_method_invocation_return_dbus_error(
+                invocation,
+                "org.mdr.DeviceError",
+                "Device disconnected.");
+        return;
+    }
+
+    command.result_cb = device_invocation_result;
+    command.user_data = invocation;
+
+    device_io_submit(device->io, &command);
+}
+
+static void device_init_power_off(device_t* device,
+                                  const device_value_t* values)
+{
+    device->power_off_iface = org_mdr_power_off_skeleton_new();
+
+    g_signal_connect(device->power_off_iface,
+                     "handle-power-off",
+                     G_CALLBACK(device_handle_power_off),
+                     device);
+
+    device_add_iface(device,
+                     G_DBUS_INTERFACE_SKELETON(device->power_off_iface));
+}
+
+static gboolean device_handle_power_off(
+        OrgMdrNoiseCancelling* interface,
+        GDBusMethodInvocation* invocation,
+        gpointer user_data)
 {
     device_t* device = user_data;
 
-    g_warning("Device init battery failed: %d", errno);
+    device_invoke(device, invocation, (device_command_t) {
+        .type = DEVICE_COMMAND_POWER_OFF,
+    });
 
-    device_finish_registration(device);
-    device_unref(device);
+    return TRUE;
+}
+
+static void device_init_battery_success(uint8_t level,
+                                        bool charging,
+                                        void* user_data);
+
+static void device_init_battery(device_t* device,
+                                const device_value_t* values)
+{
+    const device_value_t* value = &values[DEVICE_INIT_GET_BATTERY];
+
+    device_init_battery_success(
+            value->battery.level,
+            value->battery.charging,
+            device);
 }
 
 static void device_battery_update(uint8_t level,
@@ -451,35 +2271,13 @@ static void device_init_battery_success(uint8_t level,
 
     device->battery_iface = org_mdr_battery_skeleton_new();
 
-    GError* error = NULL;
-
-    if (g_dbus_interface_skeleton_export(
-            G_DBUS_INTERFACE_SKELETON(device->battery_iface),
-            connection,
-            device->dbus_name,
-            &error))
-    {
-        g_dbus_interface_skeleton_flush(
-                G_DBUS_INTERFACE_SKELETON(device->battery_iface));
-
-        org_mdr_battery_set_level(device->battery_iface, level);
-        org_mdr_battery_set_charging(device->battery_iface, charging);
+    org_mdr_battery_set_level(device->battery_iface, level);
+    org_mdr_battery_set_charging(device->battery_iface, charging);
 
-        g_debug("Registered battery interface for '%s'", device->dbus_name);
-
-        mdr_device_subscribe_battery_level(
-                device->mdr_device,
-                device_battery_update,
-                device);
-    }
-    else
-    {
-        g_warning("Failed to register battery interface: "
-                  "%s", error->message);
-    }
+    device_add_iface(device,
+                     G_DBUS_INTERFACE_SKELETON(device->battery_iface));
 
-    device_finish_registration(device);
-    device_unref(device);
+    g_debug("Registered battery interface for '%s'", device->dbus_name);
 }
 
 static void device_battery_update(uint8_t level,
@@ -501,33 +2299,17 @@ static void device_init_left_right_battery_success(uint8_t left_level,
                                                    bool right_charging,
                                                    void* user_data);
 
-static void device_init_left_right_battery_error(void* user_data);
-
-static void device_init_left_right_battery(device_t* device)
-{
-    if (mdr_device_get_left_right_battery_level(
-            device->mdr_device,
-            device_init_left_right_battery_success,
-            device_init_left_right_battery_error,
-            device) < 0)
-    {
-        g_warning("Device init left-right battery failed: %d", errno);
-    }
-    else
-    {
-        device_start_registration(device);
-        device_ref(device);
-    }
-}
-
-static void device_init_left_right_battery_error(void* user_data)
+static void device_init_left_right_battery(device_t* device,
+                                           const device_value_t* values)
 {
-    device_t* device = user_data;
+    const device_value_t* value = &values[DEVICE_INIT_GET_LEFT_RIGHT_BATTERY];
 
-    g_warning("Device init left-right battery failed: %d", errno);
-    
-    device_finish_registration(device);
-    device_unref(device);
+    device_init_left_right_battery_success(
+            value->left_right_battery.left_level,
+            value->left_right_battery.left_charging,
+            value->left_right_battery.right_level,
+            value->left_right_battery.right_charging,
+            device);
 }
 
 static void device_left_right_battery_update(uint8_t left_level,
@@ -547,46 +2329,25 @@ static void device_init_left_right_battery_success(uint8_t left_level,
     device->left_right_battery_iface
         = org_mdr_left_right_battery_skeleton_new();
 
-    GError* error = NULL;
-
-    if (g_dbus_interface_skeleton_export(
-            G_DBUS_INTERFACE_SKELETON(device->left_right_battery_iface),
-            connection,
-            device->dbus_name,
-            &error))
-    {
-        g_dbus_interface_skeleton_flush(
-                G_DBUS_INTERFACE_SKELETON(device->left_right_battery_iface));
-
-        org_mdr_left_right_battery_set_left_level(
-                device->left_right_battery_iface,
-                left_level);
-        org_mdr_left_right_battery_set_right_level(
-                device->left_right_battery_iface,
-                right_level);
-        org_mdr_left_right_battery_set_left_charging(
-                device->left_right_battery_iface,
-                left_charging);
-        org_mdr_left_right_battery_set_right_charging(
-                device->left_right_battery_iface,
-                right_charging);
-
-        g_debug("Registered left-right battery interface for '%s'",
-                device->dbus_name);
-
-        mdr_device_subscribe_left_right_battery_level(
-                device->mdr_device,
-                device_left_right_battery_update,
-                device);
-    }
-    else
-    {
-        g_warning("Failed to register left-right battery interface: "
-                  "%s", error->message);
-    }
-
-    device_finish_registration(device);
-    device_unref(device);
+    org_mdr_left_right_battery_set_left_level(
+            device->left_right_battery_iface,
+            left_level);
+    org_mdr_left_right_battery_set_right_level(
+            device->left_right_battery_iface,
+            right_level);
+    org_mdr_left_right_battery_set_left_charging(
+            device->left_right_battery_iface,
+            left_charging);
+    org_mdr_left_right_battery_set_right_charging(
+            device->left_right_battery_iface,
+            right_charging);
+
+    device_add_iface(
+            device,
+            G_DBUS_INTERFACE_SKELETON(device->left_right_battery_iface));
+
+    g_debug("Registered left-right battery interface for '%s'",
+            device->dbus_name);
 }
 
 static void device_left_right_battery_update(uint8_t left_level,
@@ -618,33 +2379,15 @@ static void device_init_cradle_battery_success(uint8_t level,
                                                bool charging,
                                                void* user_data);
 
-static void device_init_cradle_battery_error(void* user_data);
-
-static void device_init_cradle_battery(device_t* device)
-{
-    if (mdr_device_get_cradle_battery_level(
-            device->mdr_device,
-            device_init_cradle_battery_success,
-            device_init_cradle_battery_error,
-            device) < 0)
-    {
-        g_warning("Device init cradle battery failed: %d", errno);
-    }
-    else
-    {
-        device_start_registration(device);
-        device_ref(device);
-    }
-}
-
-static void device_init_cradle_battery_error(void* user_data)
+static void device_init_cradle_battery(device_t* device,
+                                       const device_value_t* values)
 {
-    device_t* device = user_data;
+    const device_value_t* value = &values[DEVICE_INIT_GET_CRADLE_BATTERY];
 
-    g_warning("Device init cradle battery failed: %d", errno);
-    
-    device_finish_registration(device);
-    device_unref(device);
+    device_init_cradle_battery_success(
+            value->battery.level,
+            value->battery.charging,
+            device);
 }
 
 static void device_cradle_battery_update(uint8_t level,
@@ -659,36 +2402,14 @@ static void device_init_cradle_battery_success(uint8_t level,
 
     device->cradle_battery_iface = org_mdr_cradle_battery_skeleton_new();
 
-    GError* error = NULL;
-
-    if (g_dbus_interface_skeleton_export(
-            G_DBUS_INTERFACE_SKELETON(device->cradle_battery_iface),
-            connection,
-            device->dbus_name,
-            &error))
-    {
-        g_dbus_interface_skeleton_flush(
-                G_DBUS_INTERFACE_SKELETON(device->cradle_battery_iface));
-
-        org_mdr_cradle_battery_set_level(device->cradle_battery_iface, level);
-        org_mdr_cradle_battery_set_charging(device->cradle_battery_iface,
-                                            charging);
-
-        g_debug("Registered cradle battery interface for '%s'", device->dbus_name);
+    org_mdr_cradle_battery_set_level(device->cradle_battery_iface, level);
+    org_mdr_cradle_battery_set_charging(device->cradle_battery_iface,
+                                        charging);
 
-        mdr_device_subscribe_cradle_battery_level(
-                device->mdr_device,
-                device_cradle_battery_update,
-                device);
-    }
-    else
-    {
-        g_warning("Failed to register cradle battery interface: "
-                  "%s", error->message);
-    }
+    device_add_iface(device,
+                     G_DBUS_INTERFACE_SKELETON(device->cradle_battery_iface));
 
-    device_finish_registration(device);
-    device_unref(device);
+    g_debug("Registered cradle battery interface for '%s'", device->dbus_name);
 }
 
 static void device_cradle_battery_update(uint8_t level,
@@ -710,33 +2431,17 @@ static void device_init_left_right_connection_status_success(
         bool right_connected,
         void* user_data);
 
-static void device_init_left_right_connection_status_error(void* user_data);
-
-static void device_init_left_right_connection_status(device_t* device)
-{
-    if (mdr_device_get_left_right_connection_status(
-            device->mdr_device,
-            device_init_left_right_connection_status_success,
-            device_init_left_right_connection_status_error,
-            device) < 0)
-    {
-        g_warning("Device init left-right connection status failed: %d", errno);
-    }
-    else
-    {
-        device_start_registration(device);
-        device_ref(device);
-    }
-}
-
-static void device_init_left_right_connection_status_error(void* user_data)
+static void device_init_left_right_connection_status(
+        device_t* device,
+        const device_value_t* values)
 {
-    device_t* device = user_data;
+    const device_value_t* value
+        = &values[DEVICE_INIT_GET_LEFT_RIGHT_CONNECTION_STATUS];
 
-    g_warning("Device init left-right connection status failed: %d", errno);
-    
-    device_finish_registration(device);
-    device_unref(device);
+    device_init_left_right_connection_status_success(
+            value->left_right_connection_status.left_connected,
+            value->left_right_connection_status.right_connected,
+            device);
 }
 
 static void device_left_right_connection_status_update(bool left_connected,
@@ -752,37 +2457,15 @@ static void device_init_left_right_connection_status_success(
 
     device->left_right_iface = org_mdr_left_right_skeleton_new();
 
-    GError* error = NULL;
-
-    if (g_dbus_interface_skeleton_export(
-            G_DBUS_INTERFACE_SKELETON(device->left_right_iface),
-            connection,
-            device->dbus_name,
-            &error))
-    {
-        g_dbus_interface_skeleton_flush(
-                G_DBUS_INTERFACE_SKELETON(device->left_right_iface));
-
-        org_mdr_left_right_set_left_connected(device->left_right_iface,
-                                              left_connected);
-        org_mdr_left_right_set_right_connected(device->left_right_iface,
-                                               right_connected);
+    org_mdr_left_right_set_left_connected(device->left_right_iface,
+                                          left_connected);
+    org_mdr_left_right_set_right_connected(device->left_right_iface,
+                                           right_connected);
 
-        g_debug("Registered left-right interface for '%s'", device->dbus_name);
-
-        mdr_device_subscribe_left_right_connection_status(
-                device->mdr_device,
-                device_left_right_connection_status_update,
-                device);
-    }
-    else
-    {
-        g_warning("Failed to register left-right interface: "
-                  "%s", error->message);
-    }
+    device_add_iface(device,
+                     G_DBUS_INTERFACE_SKELETON(device->left_right_iface));
 
-    device_finish_registration(device);
-    device_unref(device);
+    g_debug("Registered left-right interface for '%s'", device->dbus_name);
 }
 
 static void device_left_right_connection_status_update(bool left_connected,
@@ -803,33 +2486,14 @@ static void device_left_right_connection_status_update(bool left_connected,
 static void device_init_noise_cancelling_success(bool enabled,
                                                  void* user_data);
 
-static void device_init_noise_cancelling_error(void* user_data);
-
-static void device_init_noise_cancelling(device_t* device)
-{
-    if (mdr_device_get_noise_cancelling_enabled(
-                device->mdr_device,
-                device_init_noise_cancelling_success,
-                device_init_noise_cancelling_error,
-                device) < 0)
-    {
-        g_warning("Device init noise cancelling failed: %d", errno);
-    }
-    else
-    {
-        device_start_registration(device);
-        device_ref(device);
-    }
-}
-
-static void device_init_noise_cancelling_error(void* user_data)
+static void device_init_noise_cancelling(device_t* device,
+                                         const device_value_t* values)
 {
-    device_t* device = user_data;
+    const device_value_t* value = &values[DEVICE_INIT_GET_NOISE_CANCELLING];
 
-    g_warning("Device init noise cancelling failed: %d", errno);
-    
-    device_finish_registration(device);
-    device_unref(device);
+    device_init_noise_cancelling_success(
+            value->noise_cancelling.enabled,
+            device);
 }
 
 static void device_noise_cancelling_update(bool enabled,
@@ -862,110 +2526,43 @@ static void device_init_noise_cancelling_success(bool enabled,
                      G_CALLBACK(device_noise_cancelling_disable),
                      device);
 
-    GError* error = NULL;
-
-    if (g_dbus_interface_skeleton_export(
-            G_DBUS_INTERFACE_SKELETON(device->noise_cancelling_iface),
-            connection,
-            device->dbus_name,
-            &error))
-    {
-        g_dbus_interface_skeleton_flush(
-                G_DBUS_INTERFACE_SKELETON(device->noise_cancelling_iface));
-
-        org_mdr_noise_cancelling_set_enabled(device->noise_cancelling_iface,
-                                             enabled);
-
-        g_debug("Registered noise cancelling interface for '%s'",
-                device->dbus_name);
-
-        mdr_device_subscribe_noise_cancelling_enabled(
-                device->mdr_device,
-                device_noise_cancelling_update,
-                device);
-    }
-    else
-    {
-        g_warning("Failed to noise cancelling interface: "
-                  "%s", error->message);
-    }
-
-    device_finish_registration(device);
-    device_unref(device);
-}
-
-static void device_noise_cancelling_enable_success(void*);
-
-static void device_noise_cancelling_enable_error(void*);
-
-static gboolean device_noise_cancelling_enable(
-        OrgMdrNoiseCancelling* interface,
-        GDBusMethodInvocation* invocation,
-        gpointer user_data)
-{
-    device_t* device = user_data;
-
-    mdr_device_enable_noise_cancelling(
-            device->mdr_device,
-            device_noise_cancelling_enable_success,
-            device_noise_cancelling_enable_error,
-            invocation);
-
-    return TRUE;
-}
-
-static void device_noise_cancelling_enable_success(void* user_data)
-{
-    GDBusMethodInvocation* invocation = user_data;
-
-    g_dbus_method_invocation_return_value(invocation, NULL);
-}
-
-static void device_noise_cancelling_enable_error(void* user_data)
-{
-    GDBusMethodInvocation* invocation = user_data;
-
-    g_dbus_method_invocation_return_dbus_error(
-            invocation,
-            "org.mdr.DeviceError",
-            "Call failed");
-}
-
-static void device_noise_cancelling_disable_success(void*);
+    org_mdr_noise_cancelling_set_enabled(device->noise_cancelling_iface,
+                                         enabled);
 
-static void device_noise_cancelling_disable_error(void*);
+    device_add_iface(
+            device,
+            G_DBUS_INTERFACE_SKELETON(device->noise_cancelling_iface));
 
-static gboolean device_noise_cancelling_disable(
+    g_debug("Registered noise cancelling interface for '%s'",
+            device->dbus_name);
+}
+
+static gboolean device_noise_cancelling_enable(
         OrgMdrNoiseCancelling* interface,
         GDBusMethodInvocation* invocation,
         gpointer user_data)
 {
     device_t* device = user_data;
 
-    mdr_device_disable_ncasm(
-            device->mdr_device,
-            device_noise_cancelling_disable_success,
-            device_noise_cancelling_disable_error,
-            invocation);
+    device_invoke(device, invocation, (device_command_t) {
+        .type = DEVICE_COMMAND_ENABLE_NOISE_CANCELLING,
+    });
 
     return TRUE;
 }
 
-static void device_noise_cancelling_disable_success(void* user_data)
+static gboolean device_noise_cancelling_disable(
+        OrgMdrNoiseCancelling* interface,
+        GDBusMethodInvocation* invocation,
+        gpointer user_data)
 {
-    GDBusMethodInvocation* invocation = user_data;
-
-    g_dbus_method_invocation_return_value(invocation, NULL);
-}
+    device_t* device = user_data;
 
-static void device_noise_cancelling_disable_error(void* user_data)
-{
-    GDBusMethodInvocation* invocation = user_data;
+    device_invoke(device, invocation, (device_command_t) {
+        .type = DEVICE_COMMAND_DISABLE_NCASM,
+    });
 
-    g_dbus_method_invocation_return_dbus_error(
-            invocation,
-            "org.mdr.DeviceError",
-            "Call failed");
+    return TRUE;
 }
 
 static void device_noise_cancelling_update(bool enabled,
@@ -984,33 +2581,15 @@ static void device_init_ambient_sound_mode_success(uint8_t amount,
                                                    bool voice,
                                                    void* user_data);
 
-static void device_init_ambient_sound_mode_error(void* user_data);
-
-static void device_init_ambient_sound_mode(device_t* device)
-{
-    if (mdr_device_get_ambient_sound_mode_settings(
-                device->mdr_device,
-                device_init_ambient_sound_mode_success,
-                device_init_ambient_sound_mode_error,
-                device) < 0)
-    {
-        g_warning("Device init ambient sound mode failed: %d", errno);
-    }
-    else
-    {
-        device_start_registration(device);
-        device_ref(device);
-    }
-}
-
-static void device_init_ambient_sound_mode_error(void* user_data)
+static void device_init_ambient_sound_mode(device_t* device,
+                                           const device_value_t* values)
 {
-    device_t* device = user_data;
+    const device_value_t* value = &values[DEVICE_INIT_GET_AMBIENT_SOUND_MODE];
 
-    g_warning("Device init ambient sound mode failed: %d", errno);
-    
-    device_finish_registration(device);
-    device_unref(device);
+    device_init_ambient_sound_mode_success(
+            value->ambient_sound_mode.amount,
+            value->ambient_sound_mode.voice,
+            device);
 }
 
 static void device_ambient_sound_mode_update(uint8_t amount,
@@ -1051,44 +2630,19 @@ static void device_init_ambient_sound_mode_success(uint8_t amount,
                      G_CALLBACK(device_ambient_sound_mode_set_mode),
                      device);
 
-    GError* error = NULL;
-
-    if (g_dbus_interface_skeleton_export(
-            G_DBUS_INTERFACE_SKELETON(device->ambient_sound_mode_iface),
-            connection,
-            device->dbus_name,
-            &error))
-    {
-        g_dbus_interface_skeleton_flush(
-                G_DBUS_INTERFACE_SKELETON(device->ambient_sound_mode_iface));
-
-        org_mdr_ambient_sound_mode_set_amount(device->ambient_sound_mode_iface,
-                                              amount);
-        org_mdr_ambient_sound_mode_set_mode(device->ambient_sound_mode_iface,
-                                            voice ? "voice" : "normal");
+    org_mdr_ambient_sound_mode_set_amount(device->ambient_sound_mode_iface,
+                                          amount);
+    org_mdr_ambient_sound_mode_set_mode(device->ambient_sound_mode_iface,
+                                        voice ? "voice" : "normal");
 
-        g_debug("Registered ambient sound mode interface for '%s'",
-                device->dbus_name);
-
-        mdr_device_subscribe_ambient_sound_mode_settings(
-                device->mdr_device,
-                device_ambient_sound_mode_update,
-                device);
-    }
-    else
-    {
-        g_warning("Failed to ambient sound mode interface: "
-                  "%s", error->message);
-    }
+    device_add_iface(
+            device,
+            G_DBUS_INTERFACE_SKELETON(device->ambient_sound_mode_iface));
 
-    device_finish_registration(device);
-    device_unref(device);
+    g_debug("Registered ambient sound mode interface for '%s'",
+            device->dbus_name);
 }
 
-static void device_ambient_sound_mode_set_amount_success(void*);
-
-static void device_ambient_sound_mode_set_amount_error(void*);
-
 static gboolean device_ambient_sound_mode_set_amount(
         OrgMdrNoiseCancelling* interface,
         GDBusMethodInvocation* invocation,
@@ -1097,37 +2651,21 @@ static gboolean device_ambient_sound_mode_set_amount(
 {
     device_t* device = user_data;
 
-    mdr_device_enable_ambient_sound_mode(
-            device->mdr_device,
-            amount > 0xff ? 0xff : amount,
-            device->asm_voice,
-            device_ambient_sound_mode_set_amount_success,
-            device_ambient_sound_mode_set_amount_error,
-            invocation);
-
-    return TRUE;
-}
-
-static void device_ambient_sound_mode_set_amount_success(void* user_data)
-{
-    GDBusMethodInvocation* invocation = user_data;
-
-    g_dbus_method_invocation_return_value(invocation, NULL);
-}
+    // Queued ASM commands are coalesced, so the mode must already reflect
+    // any earlier, still pending, SetMode and vice versa.
+    device->asm_amount = amount > 0xff ? 0xff : amount;
 
-static void device_ambient_sound_mode_set_amount_error(void* user_data)
-{
-    GDBusMethodInvocation* invocation = user_data;
+    device_invoke(device, invocation, (device_command_t) {
+        .type = DEVICE_COMMAND_ENABLE_AMBIENT_SOUND_MODE,
+        .value.ambient_sound_mode = {
+            .amount = device->asm_amount,
+            .voice = device->asm_voice,
+        },
+    });
 
-    g_dbus_method_invocation_return_dbus_error(invocation,
-                                               "org.mdr.DeviceError",
-                                               "Call failed");
+    return TRUE;
 }
 
-static void device_ambient_sound_mode_set_mode_success(void*);
-
-static void device_ambient_sound_mode_set_mode_error(void*);
-
 static gboolean device_ambient_sound_mode_set_mode(
         OrgMdrNoiseCancelling* interface,
         GDBusMethodInvocation* invocation,
@@ -1148,31 +2686,17 @@ static gboolean device_ambient_sound_mode_set_mode(
         return TRUE;
     }
 
-    mdr_device_enable_ambient_sound_mode(
-            device->mdr_device,
-            device->asm_amount,
-            voice,
-            device_ambient_sound_mode_set_mode_success,
-            device_ambient_sound_mode_set_mode_error,
-            invocation);
-
-    return TRUE;
-}
-
-static void device_ambient_sound_mode_set_mode_success(void* user_data)
-{
-    GDBusMethodInvocation* invocation = user_data;
-
-    g_dbus_method_invocation_return_value(invocation, NULL);
-}
+    device->asm_voice = voice;
 
-static void device_ambient_sound_mode_set_mode_error(void* user_data)
-{
-    GDBusMethodInvocation* invocation = user_data;
+    device_invoke(device, invocation, (device_command_t) {
+        .type = DEVICE_COMMAND_ENABLE_AMBIENT_SOUND_MODE,
+        .value.ambient_sound_mode = {
+            .amount = device->asm_amount,
+            .voice = device->asm_voice,
+        },
+    });
 
-    g_dbus_method_invocation_return_dbus_error(invocation,
-                                               "org.mdr.DeviceError",
-                                               "Call failed");
+    return TRUE;
 }
 
 static void device_ambient_sound_mode_update(uint8_t amount,
@@ -1193,39 +2717,126 @@ static void device_ambient_sound_mode_update(uint8_t amount,
     }
 }
 
-static void device_init_eq_get_capabilities_result(
+static void device_init_eq_get_capabilities_success(
         uint8_t band_count,
         uint8_t level_steps,
         uint8_t num_presets,
         mdr_packet_eqebb_eq_preset_id_t* presets,
         void* user_data);
 
-static void device_init_eq_error(void* user_data);
+static void device_init_eq_get_preset_and_levels_success(
+        mdr_packet_eqebb_eq_preset_id_t,
+        uint8_t num_levels,
+        uint8_t* levels,
+        void* user_data);
+
+static void device_init_eq(device_t* device,
+                           const device_value_t* values)
+{
+    const device_value_t* capabilities
+        = &values[DEVICE_INIT_GET_EQ_CAPABILITIES];
+    const device_value_t* preset_and_levels
+        = &values[DEVICE_INIT_GET_EQ_PRESET_AND_LEVELS];
+
+    device_init_eq_get_capabilities_success(
+            capabilities->eq_capabilities.band_count,
+            capabilities->eq_capabilities.level_steps,
+            capabilities->eq_capabilities.num_presets,
+            capabilities->eq_capabilities.presets,
+            device);
+
+    device_init_eq_get_preset_and_levels_success(
+            preset_and_levels->eq_preset_and_levels.preset_id,
+            preset_and_levels->eq_preset_and_levels.num_levels,
+            preset_and_levels->eq_preset_and_levels.levels,
+            device);
+}
 
-static void device_init_eq(device_t* device)
+/*
+ * Returns a reference to the EQ presets for `presets`, building them only
+ * if no other device has the same ones.
+ */
+static eq_presets_t* eq_presets_ref(uint8_t num_presets,
+                                    mdr_packet_eqebb_eq_preset_id_t* presets)
 {
-    if (mdr_device_get_eq_capabilities(
-            device->mdr_device,
-            device_init_eq_get_capabilities_result,
-            device_init_eq_error,
-            device) < 0)
+    GByteArray* bytes = g_byte_array_sized_new(num_presets);
+
+    for (int i = 0; i < num_presets; i++)
     {
-        g_warning("Device init EQ failed: %d", errno);
+        uint8_t id = presets[i];
+        g_byte_array_append(bytes, &id, 1);
     }
-    else
+
+    GBytes* capabilities = g_byte_array_free_to_bytes(bytes);
+    eq_presets_t* eq_presets
+        = g_hash_table_lookup(eq_presets_table, capabilities);
+
+    if (eq_presets != NULL)
+    {
+        g_bytes_unref(capabilities);
+        eq_presets->ref_count++;
+        return eq_presets;
+    }
+
+    eq_presets = g_new0(eq_presets_t, 1);
+    eq_presets->capabilities = capabilities;
+    eq_presets->ref_count = 1;
+    eq_presets->names = g_new0(const gchar*, num_presets + 1);
+    eq_presets->ids = g_hash_table_new(g_str_hash, g_str_equal);
+
+    for (int i = 0, j = 0; i < num_presets; i++)
+    {
+        mdr_packet_eqebb_eq_preset_id_t preset = presets[i];
+
+        const char* name = mdr_packet_eqebb_get_preset_name(preset);
+        if (name == NULL || preset >= 0x100 || eq_presets->index[preset] != 0)
+        {
+            continue;
+        }
+
+        eq_presets->names[j] = name;
+        eq_presets->index[preset] = ++j;
+        g_hash_table_insert(eq_presets->ids,
+                            (gpointer) name,
+                            GINT_TO_POINTER(preset));
+    }
+
+    g_hash_table_insert(eq_presets_table, capabilities, eq_presets);
+
+    return eq_presets;
+}
+
+static void eq_presets_unref(eq_presets_t* eq_presets)
+{
+    if (--eq_presets->ref_count > 0)
     {
-        device_start_registration(device);
-        device_ref(device);
+        return;
     }
+
+    g_hash_table_remove(eq_presets_table, eq_presets->capabilities);
+
+    g_hash_table_destroy(eq_presets->ids);
+    g_free(eq_presets->names);
+    g_bytes_unref(eq_presets->capabilities);
+    g_free(eq_presets);
 }
 
-static void device_init_eq_get_preset_and_levels_result(
-        mdr_packet_eqebb_eq_preset_id_t,
-        uint8_t num_levels,
-        uint8_t* levels,
-        void* user_data);
+/*
+ * Returns the name of the EQ preset `preset_id`, or "<Unknown>" if the
+ * device does not support it.
+ */
+static const gchar* device_eq_preset_name(
+        device_t* device,
+        mdr_packet_eqebb_eq_preset_id_t preset_id)
+{
+    uint8_t index = preset_id < 0x100
+        ? device->eq_presets->index[preset_id]
+        : 0;
+
+    return index != 0 ? device->eq_presets->names[index - 1] : "<Unknown>";
+}
 
-static void device_init_eq_get_capabilities_result(
+static void device_init_eq_get_capabilities_success(
         uint8_t band_count,
         uint8_t level_steps,
         uint8_t num_presets,
@@ -1237,24 +2848,14 @@ static void device_init_eq_get_capabilities_result(
     device->eq_band_count = band_count;
     device->eq_level_steps = level_steps;
 
-    for (int i = 0; i < num_presets; i++)
-    {
-        mdr_packet_eqebb_eq_preset_id_t preset = presets[i];
-
-        const char* name = mdr_packet_eqebb_get_preset_name(preset);
-        if (name == NULL)
-        {
-            continue;
-        }
+    eq_presets_t* eq_presets = eq_presets_ref(num_presets, presets);
 
-        device->eq_presets[preset] = name;
+    if (device->eq_presets != NULL)
+    {
+        eq_presets_unref(device->eq_presets);
     }
 
-    mdr_device_get_eq_preset_and_levels(
-            device->mdr_device,
-            device_init_eq_get_preset_and_levels_result,
-            device_init_eq_error,
-            device);
+    device->eq_presets = eq_presets;
 }
 
 static gboolean device_eq_set_preset(
@@ -1275,7 +2876,7 @@ static void device_eq_preset_and_levels_update(
         uint8_t* levels,
         void* user_data);
 
-static void device_init_eq_get_preset_and_levels_result(
+static void device_init_eq_get_preset_and_levels_success(
         mdr_packet_eqebb_eq_preset_id_t preset_id,
         uint8_t num_levels,
         uint8_t* levels,
@@ -1295,89 +2896,52 @@ static void device_init_eq_get_preset_and_levels_result(
                      G_CALLBACK(device_eq_set_levels),
                      device);
 
-    GError* error = NULL;
-
-    if (g_dbus_interface_skeleton_export(
-            G_DBUS_INTERFACE_SKELETON(device->eq_iface),
-            connection,
-            device->dbus_name,
-            &error))
-    {
-        g_dbus_interface_skeleton_flush(
-                G_DBUS_INTERFACE_SKELETON(device->eq_iface));
-
-        const gchar* preset_name = device->eq_presets[preset_id];
-
-        if (preset_name == NULL)
-        {
-            preset_name = "<Unknown>";
-        }
-
-        int preset_count = 0;
-        for (int i = 0; i < 0x100; i++)
-        {
-            if (device->eq_presets[i] != NULL)
-                preset_count++;
-        }
-
-        const gchar** preset_names = g_malloc_n(preset_count + 1, sizeof(gchar*));
-        for (int i = 0, j = 0; i < 0x100; i++)
-        {
-            if (device->eq_presets[i] != NULL)
-            {
-                preset_names[j] = device->eq_presets[i];
-                j++;
-            }
-        }
-        preset_names[preset_count] = 0;
-
-        GVariantBuilder* levels_variant = g_variant_builder_new(G_VARIANT_TYPE("au"));
-
-        for (int i = 0; i < num_levels; i++)
-        {
-            g_variant_builder_add(levels_variant, "u", (guint32) levels[i]);
-        }
-
-        org_mdr_eq_set_band_count(device->eq_iface, device->eq_band_count);
-        org_mdr_eq_set_level_steps(device->eq_iface, device->eq_level_steps);
-        org_mdr_eq_set_preset(device->eq_iface, preset_name);
-        org_mdr_eq_set_available_presets(device->eq_iface, preset_names);
-        org_mdr_eq_set_levels(device->eq_iface,
-                              g_variant_builder_end(levels_variant));
+    const gchar* preset_name = device_eq_preset_name(device, preset_id);
 
-        g_debug("Registered EQ interface for '%s'", device->dbus_name);
+    GVariantBuilder levels_variant;
+    g_variant_builder_init(&levels_variant, G_VARIANT_TYPE("au"));
 
-        g_free(preset_names);
-
-        mdr_device_subscribe_eq_preset_and_levels(
-                device->mdr_device,
-                device_eq_preset_and_levels_update,
-                device);
-    }
-    else
+    for (int i = 0; i < num_levels; i++)
     {
-        g_warning("Failed to register EQ interface: "
-                  "%s", error->message);
+        g_variant_builder_add(&levels_variant, "u", (guint32) levels[i]);
     }
 
-    device_finish_registration(device);
-    device_unref(device);
+    org_mdr_eq_set_band_count(device->eq_iface, device->eq_band_count);
+    org_mdr_eq_set_level_steps(device->eq_iface, device->eq_level_steps);
+    org_mdr_eq_set_preset(device->eq_iface, preset_name);
+    org_mdr_eq_set_available_presets(device->eq_iface,
+                                     device->eq_presets->names);
+    org_mdr_eq_set_levels(device->eq_iface,
+                          g_variant_builder_end(&levels_variant));
+
+    device_add_iface(device,
+                     G_DBUS_INTERFACE_SKELETON(device->eq_iface));
+
+    g_debug("Registered EQ interface for '%s'", device->dbus_name);
 }
 
-static void device_init_eq_error(void* user_data)
+/*
+ * Looks up the id of the EQ preset called `preset`.
+ */
+static bool device_eq_preset_id(device_t* device,
+                                const gchar* preset,
+                                mdr_packet_eqebb_eq_preset_id_t* preset_id)
 {
-    device_t* device = user_data;
+    gpointer id;
 
-    g_warning("Device init EQ failed: %d", errno);
+    if (device->eq_presets == NULL
+            || !g_hash_table_lookup_extended(device->eq_presets->ids,
+                                             preset,
+                                             NULL,
+                                             &id))
+    {
+        return false;
+    }
 
-    device_finish_registration(device);
-    device_unref(device);
+    *preset_id = GPOINTER_TO_INT(id);
+    return true;
 }
 
-static void device_eq_set_preset_success(void* user_data);
-
-static void device_eq_set_preset_error(void* user_data);
-
 static gboolean device_eq_set_preset(
         OrgMdrNoiseCancelling* interface,
         GDBusMethodInvocation* invocation,
@@ -1387,20 +2951,8 @@ static gboolean device_eq_set_preset(
     device_t* device = user_data;
 
     mdr_packet_eqebb_eq_preset_id_t preset_id;
-    bool preset_found = false;
 
-    for (int i = 0; i < 0x100; i++)
-    {
-        if (device->eq_presets[i] != NULL
-                && g_str_equal(device->eq_presets[i], preset))
-        {
-            preset_id = i;
-            preset_found = true;
-            break;
-        }
-    }
-
-    if (!preset_found)
+    if (!device_eq_preset_id(device, preset, &preset_id))
     {
         g_dbus_method_invocation_return_dbus_error(
                 invocation,
@@ -1409,42 +2961,60 @@ static gboolean device_eq_set_preset(
         return TRUE;
     }
 
-    if (mdr_device_set_eq_preset(
-            device->mdr_device,
-            preset_id,
-            device_eq_set_preset_success,
-            device_eq_set_preset_error,
-            invocation) < 0)
-    {
-        g_dbus_method_invocation_return_dbus_error(
-                invocation,
-                "org.mdr.DeviceError",
-                "Failed to make the call.");
-    }
+    device_invoke(device, invocation, (device_command_t) {
+        .type = DEVICE_COMMAND_SET_EQ_PRESET,
+        .value.eq_preset_and_levels.preset_id = preset_id,
+    });
 
     return TRUE;
 }
 
-static void device_eq_set_preset_success(void* user_data)
+/*
+ * Builds the command that sets the EQ levels to `levels_variant`.
+ *
+ * Returns a description of the problem if the levels do not fit the
+ * device's bands and steps.
+ */
+static const gchar* device_eq_levels_command(device_t* device,
+                                             GVariant* levels_variant,
+                                             device_command_t* command)
 {
-    GDBusMethodInvocation* invocation = user_data;
+    gsize num_levels;
+    const guint32* level_ints = g_variant_get_fixed_array(levels_variant,
+                                                          &num_levels,
+                                                          sizeof(guint32));
 
-    g_dbus_method_invocation_return_value(invocation, NULL);
-}
+    if (num_levels != device->eq_band_count)
+    {
+        return "The number of bands must match the device's.";
+    }
 
-static void device_eq_set_preset_error(void* user_data)
-{
-    GDBusMethodInvocation* invocation = user_data;
+    for (int i = 0; i < num_levels; i++)
+    {
+        if (level_ints[i] >= device->eq_level_steps)
+        {
+            return "Level not within range.";
+        }
+    }
 
-    g_dbus_method_invocation_return_dbus_error(
-            invocation,
-            "org.mdr.DeviceError",
-            "Call failed.");
-}
+    uint8_t* level_bytes = g_malloc_n(num_levels, sizeof(uint8_t));
+
+    for (int i = 0; i < num_levels; i++)
+    {
+        level_bytes[i] = level_ints[i];
+    }
 
-static void device_eq_set_levels_success(void* user_data);
+    // Ownership of level_bytes passes to the I/O thread.
+    *command = (device_command_t) {
+        .type = DEVICE_COMMAND_SET_EQ_LEVELS,
+        .value.eq_preset_and_levels = {
+            .num_levels = num_levels,
+            .levels = level_bytes,
+        },
+    };
 
-static void device_eq_set_levels_error(void* user_data);
+    return NULL;
+}
 
 static gboolean device_eq_set_levels(
         OrgMdrNoiseCancelling* interface,
@@ -1453,77 +3023,33 @@ static gboolean device_eq_set_levels(
         gpointer user_data)
 {
     device_t* device = user_data;
+    device_command_t command;
 
-    gsize num_levels;
-    const guint32* level_ints = g_variant_get_fixed_array(levels_variant,
-                                                          &num_levels,
-                                                          sizeof(guint32));
-
-    if (num_levels != device->eq_band_count)
+    const gchar* error = device_eq_levels_command(device,
+                                                  levels_variant,
+                                                  &command);
+    if (error != NULL)
     {
         g_dbus_method_invocation_return_dbus_error(
                 invocation,
                 "org.mdr.InvalidValue",
-                "The number of bands must match the device's.");
+                error);
         return TRUE;
     }
 
-    uint8_t* level_bytes = g_malloc_n(num_levels, sizeof(uint8_t));
-    if (level_bytes == NULL)
-    {
-        // TODO
-    }
-    
-
-    for (int i = 0; i < num_levels; i++)
-    {
-        if (level_ints[i] >= device->eq_level_steps)
-        {
-            g_dbus_method_invocation_return_dbus_error(
-                    invocation,
-                    "org.mdr.InvalidValue",
-                    "Level not within range.");
-            return TRUE;
-        }
-
-        level_bytes[i] = level_ints[i];
-    }
-
     if (device->eq_iface)
     {
         org_mdr_eq_set_levels(device->eq_iface, levels_variant);
+        device_report_forget(device,
+                             DEVICE_COMMAND_GET_EQ_PRESET_AND_LEVELS,
+                             &command.value);
     }
 
-    mdr_device_set_eq_levels(
-            device->mdr_device,
-            num_levels,
-            level_bytes,
-            device_eq_set_levels_success,
-            device_eq_set_levels_error,
-            invocation);
-
-    free(level_bytes);
+    device_invoke(device, invocation, command);
 
     return TRUE;
 }
 
-static void device_eq_set_levels_success(void* user_data)
-{
-    GDBusMethodInvocation* invocation = user_data;
-
-    g_dbus_method_invocation_return_value(invocation, NULL);
-}
-
-static void device_eq_set_levels_error(void* user_data)
-{
-    GDBusMethodInvocation* invocation = user_data;
-
-    g_dbus_method_invocation_return_dbus_error(
-            invocation,
-            "org.mdr.DeviceError",
-            "Call failed.");
-}
-
 static void device_eq_preset_and_levels_update(
         mdr_packet_eqebb_eq_preset_id_t preset_id,
         uint8_t num_levels,
@@ -1534,48 +3060,36 @@ static void device_eq_preset_and_levels_update(
 
     if (device->eq_iface != NULL)
     {
-        const gchar* preset_name = device->eq_presets[preset_id];
-
-        if (preset_name == NULL)
-        {
-            preset_name = "<Unknown>";
-        }
+        const gchar* preset_name = device_eq_preset_name(device, preset_id);
 
-        GVariantBuilder* levels_variant = g_variant_builder_new(G_VARIANT_TYPE("au"));
+        GVariantBuilder levels_variant;
+        g_variant_builder_init(&levels_variant, G_VARIANT_TYPE("au"));
 
         for (int i = 0; i < num_levels; i++)
         {
-            g_variant_builder_add(levels_variant, "u", (guint32) levels[i]);
+            g_variant_builder_add(&levels_variant, "u", (guint32) levels[i]);
         }
 
         org_mdr_eq_set_preset(device->eq_iface, preset_name);
         org_mdr_eq_set_levels(device->eq_iface,
-                              g_variant_builder_end(levels_variant));
+                              g_variant_builder_end(&levels_variant));
     }
 }
 
-static void device_init_auto_power_off_result(
+static void device_init_auto_power_off_success(
         bool enabled,
-        mdr_packet_system_auto_power_off_element_id_t timeout,
-        void* user_data);
-
-static void device_init_auto_power_off_error(void* user_data);
-
-static void device_init_auto_power_off(device_t* device)
-{
-    if (mdr_device_setting_get_auto_power_off(
-            device->mdr_device,
-            device_init_auto_power_off_result,
-            device_init_auto_power_off_error,
-            device) < 0)
-    {
-        g_warning("Device init auto power off failed (1): %d", errno);
-    }
-    else
-    {
-        device_start_registration(device);
-        device_ref(device);
-    }
+        mdr_packet_system_auto_power_off_element_id_t timeout,
+        void* user_data);
+
+static void device_init_auto_power_off(device_t* device,
+                                       const device_value_t* values)
+{
+    const device_value_t* value = &values[DEVICE_INIT_GET_AUTO_POWER_OFF];
+
+    device_init_auto_power_off_success(
+            value->auto_power_off.enabled,
+            value->auto_power_off.timeout,
+            device);
 }
 
 static const gchar* auto_power_off_timeout_to_string(
@@ -1611,7 +3125,7 @@ static void device_auto_power_off_update(
         mdr_packet_system_auto_power_off_element_id_t timeout,
         void* user_data);
 
-static void device_init_auto_power_off_result(
+static void device_init_auto_power_off_success(
         bool enabled,
         mdr_packet_system_auto_power_off_element_id_t timeout,
         void* user_data)
@@ -1625,64 +3139,76 @@ static void device_init_auto_power_off_result(
                      G_CALLBACK(device_auto_power_off_set_timeout),
                      device);
 
-    GError* error = NULL;
+    const gchar* timeouts[5] = {
+        "5 min",
+        "30 min",
+        "60 min",
+        "180 min",
+    };
 
-    if (g_dbus_interface_skeleton_export(
-                G_DBUS_INTERFACE_SKELETON(device->auto_power_off_iface),
-                connection,
-                device->dbus_name,
-                &error))
+    org_mdr_auto_power_off_set_available_timeouts(
+            device->auto_power_off_iface,
+            timeouts);
+
+    if (enabled)
     {
-        const gchar* timeouts[5] = {
-            "5 min",
-            "30 min",
-            "60 min",
-            "180 min",
-        };
+        const gchar* timeout_str = auto_power_off_timeout_to_string(timeout);
 
-        org_mdr_auto_power_off_set_available_timeouts(
-                device->auto_power_off_iface,
-                timeouts);
+        if (timeout_str == NULL)
+            timeout_str = "<Unknown>";
 
-        if (enabled)
-        {
-            const gchar* timeout_str = auto_power_off_timeout_to_string(timeout);
+        org_mdr_auto_power_off_set_timeout(device->auto_power_off_iface,
+                                           timeout_str);
 
-            if (timeout_str == NULL)
-                timeout_str = "<Unknown>";
+    }
+    else
+    {
+        org_mdr_auto_power_off_set_timeout(device->auto_power_off_iface,
+                                           "Off");
+    }
 
-            org_mdr_auto_power_off_set_timeout(device->auto_power_off_iface,
-                                               timeout_str);
+    device_add_iface(device,
+                     G_DBUS_INTERFACE_SKELETON(device->auto_power_off_iface));
 
-        }
-        else
-        {
-            org_mdr_auto_power_off_set_timeout(device->auto_power_off_iface,
-                                               "Off");
-        }
+    g_debug("Registered auto power off interface for '%s'", device->dbus_name);
+}
 
-        g_debug("Registered auto power off interface for '%s'", device->dbus_name);
+/*
+ * Builds the command that sets the auto power off timeout to `timeout`.
+ *
+ * Returns false if it is not a valid timeout.
+ */
+static bool auto_power_off_timeout_command(const gchar* timeout,
+                                           device_command_t* command)
+{
+    gpointer timeout_id;
 
-        mdr_device_setting_subscribe_auto_power_off(
-                device->mdr_device,
-                device_auto_power_off_update,
-                device);
-    }
-    else
+    if (g_str_equal(timeout, "Off"))
     {
-        device->auto_power_off_iface = NULL;
-
-        g_warning("Failed to register auto power off interface (5): "
-                  "%s", error->message);
+        *command = (device_command_t) {
+            .type = DEVICE_COMMAND_DISABLE_AUTO_POWER_OFF,
+        };
+        return true;
     }
 
-    device_finish_registration(device);
-    device_unref(device);
-}
+    if (!g_hash_table_lookup_extended(auto_power_off_timeout_ids,
+                                      timeout,
+                                      NULL,
+                                      &timeout_id))
+    {
+        return false;
+    }
 
-static void device_auto_power_off_set_timeout_success(void* user_data);
+    *command = (device_command_t) {
+        .type = DEVICE_COMMAND_ENABLE_AUTO_POWER_OFF,
+        .value.auto_power_off = {
+            .enabled = true,
+            .timeout = GPOINTER_TO_INT(timeout_id),
+        },
+    };
 
-static void device_auto_power_off_set_timeout_error(void* user_data);
+    return true;
+}
 
 static gboolean device_auto_power_off_set_timeout(
         OrgMdrNoiseCancelling* interface,
@@ -1691,64 +3217,22 @@ static gboolean device_auto_power_off_set_timeout(
         gpointer user_data)
 {
     device_t* device = user_data;
+    device_command_t command;
 
-    mdr_packet_system_auto_power_off_element_id_t timeout_id;
-
-    if (g_str_equal(timeout, "Off"))
+    if (!auto_power_off_timeout_command(timeout, &command))
     {
-        mdr_device_setting_disable_auto_power_off(
-                device->mdr_device,
-                device_auto_power_off_set_timeout_success,
-                device_auto_power_off_set_timeout_error,
-                invocation);
+        g_dbus_method_invocation_return_dbus_error(
+                invocation,
+                "org.mdr.InvalidValue",
+                "Invalid timeout");
+        return TRUE;
     }
-    else
-    {
-        if (g_str_equal(timeout, "5 min"))
-            timeout_id = MDR_PACKET_SYSTEM_AUTO_POWER_OFF_ELEMENT_ID_POWER_OFF_IN_5_MIN;
-        else if (g_str_equal(timeout, "30 min"))
-            timeout_id = MDR_PACKET_SYSTEM_AUTO_POWER_OFF_ELEMENT_ID_POWER_OFF_IN_30_MIN;
-        else if (g_str_equal(timeout, "60 min"))
-            timeout_id = MDR_PACKET_SYSTEM_AUTO_POWER_OFF_ELEMENT_ID_POWER_OFF_IN_60_MIN;
-        else if (g_str_equal(timeout, "180 min"))
-            timeout_id = MDR_PACKET_SYSTEM_AUTO_POWER_OFF_ELEMENT_ID_POWER_OFF_IN_180_MIN;
-        else
-        {
-            g_dbus_method_invocation_return_dbus_error(
-                    invocation,
-                    "org.mdr.InvalidValue",
-                    "Invalid timeout");
-            return TRUE;
-        }
 
-        mdr_device_setting_enable_auto_power_off(
-                device->mdr_device,
-                timeout_id,
-                device_auto_power_off_set_timeout_success,
-                device_auto_power_off_set_timeout_error,
-                invocation);
-    }
+    device_invoke(device, invocation, command);
 
     return TRUE;
 }
 
-static void device_auto_power_off_set_timeout_success(void* user_data)
-{
-    GDBusMethodInvocation* invocation = user_data;
-
-    g_dbus_method_invocation_return_value(invocation, NULL);
-}
-
-static void device_auto_power_off_set_timeout_error(void* user_data)
-{
-    GDBusMethodInvocation* invocation = user_data;
-
-    g_dbus_method_invocation_return_dbus_error(
-            invocation,
-            "org.mdr.DeviceError",
-            "Call failed.");
-}
-
 static void device_auto_power_off_update(
         bool enabled,
         mdr_packet_system_auto_power_off_element_id_t timeout,
@@ -1777,39 +3261,33 @@ static void device_auto_power_off_update(
     }
 }
 
-static void device_init_auto_power_off_error(void* user_data)
-{
-    device_t* device = user_data;
-
-    device->auto_power_off_iface = NULL;
-    g_warning("Device init auto power off failed (4): %d", errno);
-
-    device_finish_registration(device);
-    device_unref(device);
-}
-
-static void device_init_key_functions_available_result(
+static void device_init_key_functions_available_success(
         uint8_t num_keys,
         mdr_packet_system_assignable_settings_capability_key_t* keys,
         void* user_data);
 
-static void device_init_key_functions_error(void* user_data);
+static void device_init_key_functions_active_success(
+        uint8_t num_presets,
+        mdr_packet_system_assignable_settings_preset_t* presets,
+        void* user_data);
 
-static void device_init_key_functions(device_t* device)
+static void device_init_key_functions(device_t* device,
+                                      const device_value_t* values)
 {
-    if (mdr_device_setting_get_available_button_presets(
-                device->mdr_device,
-                device_init_key_functions_available_result,
-                device_init_key_functions_error,
-                device) < 0)
-    {
-        g_warning("Device init key functions failed (1): %d", errno);
-    }
-    else
-    {
-        device_start_registration(device);
-        device_ref(device);
-    }
+    const device_value_t* available
+        = &values[DEVICE_INIT_GET_AVAILABLE_BUTTON_PRESETS];
+    const device_value_t* active
+        = &values[DEVICE_INIT_GET_ACTIVE_BUTTON_PRESETS];
+
+    device_init_key_functions_available_success(
+            available->available_button_presets.num_keys,
+            available->available_button_presets.keys,
+            device);
+
+    device_init_key_functions_active_success(
+            active->active_button_presets.num_presets,
+            active->active_button_presets.presets,
+            device);
 }
 
 static const char* key_functions_key_to_string(
@@ -1827,115 +3305,234 @@ static const char* key_functions_action_to_string(
 static const char* key_functions_function_to_string(
         mdr_packet_system_assignable_settings_function_t);
 
-static mdr_packet_system_assignable_settings_preset_t
-        key_functions_string_to_preset(const char*);
-
-static void device_init_key_functions_active_result(
-        uint8_t num_presets,
-        mdr_packet_system_assignable_settings_preset_t* presets,
-        void* user_data);
+static bool key_functions_string_to_preset(
+        const char* str,
+        mdr_packet_system_assignable_settings_preset_t* preset);
 
-static void device_init_key_functions_available_result(
+static GVariant* key_functions_available_presets_variant(
         uint8_t num_keys,
-        mdr_packet_system_assignable_settings_capability_key_t* keys,
-        void* user_data)
+        mdr_packet_system_assignable_settings_capability_key_t* keys)
 {
-    device_t* device = user_data;
-
-    if (mdr_device_setting_get_active_button_presets(
-                device->mdr_device,
-                device_init_key_functions_active_result,
-                device_init_key_functions_error,
-                device) < 0)
-    {
-        g_warning("Device init key functions failed (1): %d", errno);
-    }
-    else
+    GVariantBuilder available_presets;
+    g_variant_builder_init(&available_presets,
+                           G_VARIANT_TYPE("a{s(ssa{sa{ss}})}"));
+
+    for (
+            mdr_packet_system_assignable_settings_capability_key_t* key
+                = keys;
+            key != &keys[num_keys];
+            key++)
     {
-        device->key_functions_iface = org_mdr_key_functions_skeleton_new();
+        const char* key_name
+            = key_functions_key_to_string(key->key);
 
-        GVariantBuilder* available_presets
-                = g_variant_builder_new(G_VARIANT_TYPE("a{s(ssa{sa{ss}})}"));
+        if (key_name == NULL) continue;
 
-        for (
-                mdr_packet_system_assignable_settings_capability_key_t* key
-                    = keys;
-                key != &keys[num_keys];
-                key++)
-        {
-            const char* key_name
-                = key_functions_key_to_string(key->key);
+        const char* key_type
+            = key_functions_key_type_to_string(key->key_type);
 
-            if (key_name == NULL) continue;
+        if (key_type == NULL) continue;
 
-            const char* key_type
-                = key_functions_key_type_to_string(key->key_type);
+        const char* default_preset
+            = key_functions_preset_to_string(key->default_preset);
 
-            if (key_type == NULL) continue;
+        if (default_preset == NULL) continue;
 
-            const char* default_preset
-                = key_functions_preset_to_string(key->default_preset);
+        GVariantBuilder presets;
+        g_variant_builder_init(&presets, G_VARIANT_TYPE("a{sa{ss}}"));
+
+        for (
+                mdr_packet_system_assignable_settings_capability_preset_t* preset
+                    = key->capability_presets;
+                preset != &key->capability_presets[key->num_capability_presets];
+                preset++)
+        {
+            const char* preset_name
+                = key_functions_preset_to_string(preset->preset);
 
-            if (default_preset == NULL) continue;
+            if (preset_name == NULL) continue;
 
-            GVariantBuilder* presets
-                = g_variant_builder_new(G_VARIANT_TYPE("a{sa{ss}}"));
+            GVariantBuilder actions;
+            g_variant_builder_init(&actions, G_VARIANT_TYPE("a{ss}"));
 
             for (
-                    mdr_packet_system_assignable_settings_capability_preset_t* preset
-                        = key->capability_presets;
-                    preset != &key->capability_presets[key->num_capability_presets];
-                    preset++)
+                    mdr_packet_system_assignable_settings_capability_action_t* action
+                        = preset->capability_actions;
+                    action != &preset->capability_actions[preset->num_capability_actions];
+                    action++)
             {
-                GVariantBuilder* actions
-                    = g_variant_builder_new(G_VARIANT_TYPE("a{ss}"));
+                const char* action_name
+                    = key_functions_action_to_string(action->action);
 
-                const char* preset_name
-                    = key_functions_preset_to_string(preset->preset);
+                if (action_name == NULL) continue;
 
-                if (preset_name == NULL) continue;
+                const char* function
+                    = key_functions_function_to_string(action->function);
 
-                for (
-                        mdr_packet_system_assignable_settings_capability_action_t* action
-                            = preset->capability_actions;
-                        action != &preset->capability_actions[preset->num_capability_actions];
-                        action++)
-                {
-                    const char* action_name
-                        = key_functions_action_to_string(action->action);
+                if (function == NULL) continue;
+
+                g_variant_builder_add(
+                        &actions,
+                        "{ss}",
+                        action_name,
+                        function);
+            }
 
-                    if (action_name == NULL) continue;
+            g_variant_builder_add(&presets,
+                                  "{s@a{ss}}",
+                                  preset_name,
+                                  g_variant_builder_end(&actions));
+        }
 
-                    const char* function
-                        = key_functions_function_to_string(action->function);
+        g_variant_builder_add(&available_presets,
+                              "{s(ss@a{sa{ss}})}",
+                              key_name,
+                              key_type,
+                              default_preset,
+                              g_variant_builder_end(&presets));
+    }
 
-                    if (function == NULL) continue;
+    return g_variant_builder_end(&available_presets);
+}
 
-                    g_variant_builder_add(
-                            actions,
-                            "{ss}",
-                            action_name,
-                            function);
-                }
+static void key_functions_capabilities_append(GByteArray* bytes,
+                                              guint32 value)
+{
+    g_byte_array_append(bytes, (const guint8*) &value, sizeof(value));
+}
+
+/*
+ * Serializes the parts of `keys` the available presets are built from.
+ */
+static GBytes* key_functions_capabilities(
+        uint8_t num_keys,
+        mdr_packet_system_assignable_settings_capability_key_t* keys)
+{
+    GByteArray* bytes = g_byte_array_new();
+
+    for (int i = 0; i < num_keys; i++)
+    {
+        mdr_packet_system_assignable_settings_capability_key_t* key
+            = &keys[i];
+
+        key_functions_capabilities_append(bytes, key->key);
+        key_functions_capabilities_append(bytes, key->key_type);
+        key_functions_capabilities_append(bytes, key->default_preset);
+        key_functions_capabilities_append(bytes,
+                                          key->num_capability_presets);
+
+        for (int j = 0; j < key->num_capability_presets; j++)
+        {
+            mdr_packet_system_assignable_settings_capability_preset_t* preset
+                = &key->capability_presets[j];
 
-                g_variant_builder_add(presets,
-                                      "{sa{ss}}",
-                                      preset_name,
-                                      actions);
+            key_functions_capabilities_append(bytes, preset->preset);
+            key_functions_capabilities_append(bytes,
+                                              preset->num_capability_actions);
+
+            for (int k = 0; k < preset->num_capability_actions; k++)
+            {
+                key_functions_capabilities_append(
+                        bytes,
+                        preset->capability_actions[k].action);
+                key_functions_capabilities_append(
+                        bytes,
+                        preset->capability_actions[k].function);
             }
+        }
+    }
 
-            g_variant_builder_add(available_presets,
-                                  "{s(ssa{sa{ss}})}",
-                                  key_name,
-                                  key_type,
-                                  default_preset,
-                                  presets);
+    return g_byte_array_free_to_bytes(bytes);
+}
+
+/*
+ * Returns a reference to the available presets for `keys`, building them
+ * only if no other device has the same capabilities.
+ */
+static key_functions_presets_t* key_functions_presets_ref(
+        uint8_t num_keys,
+        mdr_packet_system_assignable_settings_capability_key_t* keys)
+{
+    GBytes* capabilities = key_functions_capabilities(num_keys, keys);
+    key_functions_presets_t* presets
+        = g_hash_table_lookup(key_functions_presets_table, capabilities);
+
+    if (presets != NULL)
+    {
+        g_bytes_unref(capabilities);
+        presets->ref_count++;
+        return presets;
+    }
+
+    presets = g_new0(key_functions_presets_t, 1);
+    presets->capabilities = capabilities;
+    presets->variant = g_variant_ref_sink(
+            key_functions_available_presets_variant(num_keys, keys));
+    presets->ref_count = 1;
+
+    presets->num_keys = num_keys;
+    presets->keys = g_new0(key_functions_key_t, num_keys);
+
+    for (int i = 0; i < num_keys; i++)
+    {
+        key_functions_key_t* key = &presets->keys[i];
+
+        // Matches the keys and presets included in the variant.
+        if (key_functions_key_type_to_string(keys[i].key_type) != NULL
+                && key_functions_preset_to_string(keys[i].default_preset)
+                    != NULL)
+        {
+            key->name = key_functions_key_to_string(keys[i].key);
         }
 
-        org_mdr_key_functions_set_available_presets(
-                device->key_functions_iface,
-                g_variant_builder_end(available_presets));
+        key->default_preset = keys[i].default_preset;
+
+        for (int j = 0; j < keys[i].num_capability_presets; j++)
+        {
+            mdr_packet_system_assignable_settings_preset_t preset
+                = keys[i].capability_presets[j].preset;
+
+            if (preset < 0x100
+                    && key_functions_preset_to_string(preset) != NULL)
+            {
+                key->allowed[preset / 32] |= 1u << (preset % 32);
+            }
+        }
+    }
+
+    g_hash_table_insert(key_functions_presets_table, capabilities, presets);
+
+    return presets;
+}
+
+static void key_functions_presets_unref(key_functions_presets_t* presets)
+{
+    if (--presets->ref_count > 0)
+    {
+        return;
     }
+
+    g_hash_table_remove(key_functions_presets_table, presets->capabilities);
+
+    g_variant_unref(presets->variant);
+    g_bytes_unref(presets->capabilities);
+    g_free(presets->keys);
+    g_free(presets);
+}
+
+static void device_init_key_functions_available_success(
+        uint8_t num_keys,
+        mdr_packet_system_assignable_settings_capability_key_t* keys,
+        void* user_data)
+{
+    device_t* device = user_data;
+
+    device->key_functions_iface = org_mdr_key_functions_skeleton_new();
+    device->key_functions_presets = key_functions_presets_ref(num_keys, keys);
+
+    org_mdr_key_functions_set_available_presets(
+            device->key_functions_iface,
+            device->key_functions_presets->variant);
 }
 
 static gboolean key_functions_handle_set_presets(
@@ -1949,70 +3546,52 @@ static void key_functions_active_update(
         mdr_packet_system_assignable_settings_preset_t* presets,
         void* user_data);
 
-static void device_init_key_functions_active_result(
+/*
+ * Builds the current_presets property from the active preset of each key.
+ */
+static GVariant* key_functions_current_presets_variant(
+        device_t* device,
         uint8_t num_presets,
-        mdr_packet_system_assignable_settings_preset_t* presets,
-        void* user_data)
+        mdr_packet_system_assignable_settings_preset_t* presets)
 {
-    device_t* device = user_data;
+    key_functions_presets_t* table = device->key_functions_presets;
 
-    GVariantIter* key_iter = g_variant_iter_new(
-            org_mdr_key_functions_get_available_presets(
-                device->key_functions_iface));
+    GVariantBuilder active_presets;
+    g_variant_builder_init(&active_presets, G_VARIANT_TYPE("a{ss}"));
 
-    GVariantBuilder* active_presets
-        = g_variant_builder_new(G_VARIANT_TYPE("a{ss}"));
-
-    const gchar* key_name;
-
-    for (int i = 0;
-            i < num_presets && g_variant_iter_loop(key_iter,
-                                                   "{s@(ssa{sa{ss}})}",
-                                                   &key_name,
-                                                   NULL);
-            i++)
+    for (int i = 0; i < num_presets && i < table->num_keys; i++)
     {
+        const gchar* key_name = table->keys[i].name;
         const gchar* preset_name = key_functions_preset_to_string(presets[i]);
 
-        if (preset_name == NULL) continue;
+        if (key_name == NULL || preset_name == NULL) continue;
 
-        g_variant_builder_add(active_presets, "{ss}", key_name, preset_name);
+        g_variant_builder_add(&active_presets, "{ss}", key_name, preset_name);
     }
 
-    g_variant_iter_free(key_iter);
+    return g_variant_builder_end(&active_presets);
+}
+
+static void device_init_key_functions_active_success(
+        uint8_t num_presets,
+        mdr_packet_system_assignable_settings_preset_t* presets,
+        void* user_data)
+{
+    device_t* device = user_data;
 
     org_mdr_key_functions_set_current_presets(
             device->key_functions_iface,
-            g_variant_builder_end(active_presets));
+            key_functions_current_presets_variant(device,
+                                                  num_presets,
+                                                  presets));
 
     g_signal_connect(device->key_functions_iface,
                      "handle-set-presets",
                      G_CALLBACK(key_functions_handle_set_presets),
                      device);
 
-    GError* error = NULL;
-
-    if (g_dbus_interface_skeleton_export(
-                G_DBUS_INTERFACE_SKELETON(device->key_functions_iface),
-                connection,
-                device->dbus_name,
-                &error))
-    {
-        mdr_device_setting_subscribe_active_button_presets(
-                device->mdr_device,
-                key_functions_active_update,
-                device);
-    }
-    else
-    {
-        device->auto_power_off_iface = NULL;
-
-        g_warning("Failed to register key functions interface (5): "
-                  "%s", error->message);
-    }
-
-    device_finish_registration(device);
-    device_unref(device);
+    device_add_iface(device,
+                     G_DBUS_INTERFACE_SKELETON(device->key_functions_iface));
 }
 
 static void key_functions_active_update(
@@ -2022,141 +3601,109 @@ static void key_functions_active_update(
 {
     device_t* device = user_data;
 
-    GVariantIter* key_iter = g_variant_iter_new(
-            org_mdr_key_functions_get_available_presets(
-                device->key_functions_iface));
-
-    GVariantBuilder* active_presets
-        = g_variant_builder_new(G_VARIANT_TYPE("a{ss}"));
-
-    const gchar* key_name;
-
-    for (int i = 0;
-            i < num_presets && g_variant_iter_loop(key_iter,
-                                                   "{s@(ssa{sa{ss}})}",
-                                                   &key_name,
-                                                   NULL);
-            i++)
-    {
-        const gchar* preset_name = key_functions_preset_to_string(presets[i]);
-
-        if (preset_name == NULL) continue;
-
-        g_variant_builder_add(active_presets, "{ss}", key_name, preset_name);
-    }
-
-    g_variant_iter_free(key_iter);
-
     org_mdr_key_functions_set_current_presets(
             device->key_functions_iface,
-            g_variant_builder_end(active_presets));
+            key_functions_current_presets_variant(device,
+                                                  num_presets,
+                                                  presets));
 }
 
-static void key_functions_handle_set_presets_success(void* user_data);
-
-static void key_functions_handle_set_presets_error(void* user_data);
-
-static gboolean key_functions_handle_set_presets(
-        OrgMdrNoiseCancelling* interface,
-        GDBusMethodInvocation* invocation,
-        GVariant* presets,
-        gpointer user_data)
+/*
+ * Builds the command that activates `presets`, which must name a preset
+ * for every key. Keys that are not exported keep their current preset.
+ *
+ * Returns a description of the problem if they do not.
+ */
+static const gchar* key_functions_presets_command(device_t* device,
+                                                  GVariant* presets,
+                                                  device_command_t* command)
 {
-    device_t* device = user_data;
-
-    if (g_variant_n_children(presets) > 0xff)
-    {
-        g_dbus_method_invocation_return_dbus_error(
-                invocation,
-                "error name",
-                "error message");
-
-        return TRUE;
-    }
-
-    uint8_t num_presets = g_variant_n_children(presets);
+    key_functions_presets_t* table = device->key_functions_presets;
+    const device_value_t* active = device_reported_value(
+            device,
+            DEVICE_COMMAND_GET_ACTIVE_BUTTON_PRESETS);
+    gsize num_named = 0;
 
     mdr_packet_system_assignable_settings_preset_t* enum_presets
-        = g_malloc_n(num_presets,
+        = g_malloc_n(table->num_keys,
                      sizeof(mdr_packet_system_assignable_settings_preset_t));
-    int i = 0;
-
-    GVariantIter* iter = g_variant_iter_new(
-            org_mdr_key_functions_get_available_presets(
-                device->key_functions_iface));
-    const gchar* key;
-    GVariant* key_presets;
 
-    while (g_variant_iter_loop(iter,
-                               "{s(@s@s@a{sa{ss}})}",
-                               &key,
-                               NULL,
-                               NULL,
-                               &key_presets))
+    for (int i = 0; i < table->num_keys; i++)
     {
-        const gchar* key_preset;
-        if (g_variant_lookup(presets, key, "s", &key_preset))
+        key_functions_key_t* key = &table->keys[i];
+        const gchar* preset_name;
+
+        if (key->name == NULL)
         {
-            if (g_variant_lookup(key_presets, key_preset, "@a{ss}", NULL))
-            {
-                enum_presets[i] = key_functions_string_to_preset(key_preset);
-                i++;
-            }
-            else
-            {
-                g_free(enum_presets);
-                g_variant_iter_free(iter);
-                g_dbus_method_invocation_return_dbus_error(
-                        invocation,
-                        "org.mdr.InvalidValue",
-                        "Invalid preset. ");
-                return TRUE;
-            }
+            enum_presets[i]
+                = active != NULL
+                        && i < active->active_button_presets.num_presets
+                    ? active->active_button_presets.presets[i]
+                    : key->default_preset;
+            continue;
         }
-        else
+
+        if (!g_variant_lookup(presets, key->name, "&s", &preset_name))
         {
             g_free(enum_presets);
-            g_variant_iter_free(iter);
-            g_dbus_method_invocation_return_dbus_error(
-                    invocation,
-                    "org.mdr.InvalidValue",
-                    "Missing key. ");
-            return TRUE;
+            return "Missing key. ";
+        }
+
+        mdr_packet_system_assignable_settings_preset_t preset;
+
+        if (!key_functions_string_to_preset(preset_name, &preset)
+                || !(key->allowed[preset / 32] & (1u << (preset % 32))))
+        {
+            g_free(enum_presets);
+            return "Invalid preset. ";
         }
+
+        enum_presets[i] = preset;
+        num_named++;
     }
 
-    if (mdr_device_setting_set_active_button_presets(
-            device->mdr_device,
-            num_presets,
-            enum_presets,
-            key_functions_handle_set_presets_success,
-            key_functions_handle_set_presets_error,
-            invocation) < 0)
+    if (g_variant_n_children(presets) != num_named)
     {
-        g_dbus_method_invocation_return_dbus_error(
-                invocation,
-                "org.mdr.DeviceError",
-                "Call failed. ");
+        g_free(enum_presets);
+        return "Unknown key. ";
     }
 
-    return TRUE;
+    // Ownership of enum_presets passes to the I/O thread.
+    *command = (device_command_t) {
+        .type = DEVICE_COMMAND_SET_ACTIVE_BUTTON_PRESETS,
+        .value.active_button_presets = {
+            .num_presets = table->num_keys,
+            .presets = enum_presets,
+        },
+    };
+
+    return NULL;
 }
 
-static void key_functions_handle_set_presets_success(void* user_data)
+static gboolean key_functions_handle_set_presets(
+        OrgMdrNoiseCancelling* interface,
+        GDBusMethodInvocation* invocation,
+        GVariant* presets,
+        gpointer user_data)
 {
-    GDBusMethodInvocation* invocation = user_data;
+    device_t* device = user_data;
+    device_command_t command;
 
-    g_dbus_method_invocation_return_value(invocation, NULL);
-}
+    const gchar* error = key_functions_presets_command(device,
+                                                       presets,
+                                                       &command);
+    if (error != NULL)
+    {
+        g_dbus_method_invocation_return_dbus_error(
+                invocation,
+                "org.mdr.InvalidValue",
+                error);
+        return TRUE;
+    }
 
-static void key_functions_handle_set_presets_error(void* user_data)
-{
-    GDBusMethodInvocation* invocation = user_data;
+    device_invoke(device, invocation, command);
 
-    g_dbus_method_invocation_return_dbus_error(
-            invocation,
-            "org.mdr.DeviceError",
-            "Call failed. ");
+    return TRUE;
 }
 
 static const char* key_functions_key_to_string(
@@ -2283,221 +3830,859 @@ static const char* key_functions_function_to_string(
     }
 }
 
-static mdr_packet_system_assignable_settings_preset_t
-        key_functions_string_to_preset(const char* str)
+/*
+ * Looks up the id of the key preset called `str`.
+ */
+static bool key_functions_string_to_preset(
+        const char* str,
+        mdr_packet_system_assignable_settings_preset_t* preset)
+{
+    gpointer id;
+
+    if (!g_hash_table_lookup_extended(key_functions_preset_ids,
+                                      str,
+                                      NULL,
+                                      &id))
+    {
+        return false;
+    }
+
+    *preset = GPOINTER_TO_INT(id);
+    return true;
+}
+
+static void device_init_playback_success(
+        uint8_t volume,
+        void* user_data);
+
+static void device_init_playback(device_t* device,
+                                 const device_value_t* values)
+{
+    const device_value_t* value = &values[DEVICE_INIT_GET_VOLUME];
+
+    device_init_playback_success(
+            value->playback.volume,
+            device);
+}
+
+static gboolean device_playback_set_volume(
+        OrgMdrNoiseCancelling* interface,
+        GDBusMethodInvocation* invocation,
+        const guint volume,
+        gpointer user_data);
+
+static void device_playback_volume_update(
+        uint8_t volume,
+        void* user_data);
+
+static void device_init_playback_success(
+        uint8_t volume,
+        void* user_data)
+{
+    device_t* device = user_data;
+
+    device->playback_iface = org_mdr_playback_skeleton_new();
+
+    g_signal_connect(device->playback_iface,
+                     "handle-set-volume",
+                     G_CALLBACK(device_playback_set_volume),
+                     device);
+
+    org_mdr_playback_set_volume(device->playback_iface, volume);
+
+    device_add_iface(device,
+                     G_DBUS_INTERFACE_SKELETON(device->playback_iface));
+
+    g_debug("Registered playback interface for '%s'", device->dbus_name);
+}
+
+static gboolean device_playback_set_volume(
+        OrgMdrNoiseCancelling* interface,
+        GDBusMethodInvocation* invocation,
+        const guint volume,
+        gpointer user_data)
+{
+    device_t* device = user_data;
+
+    device_invoke(device, invocation, (device_command_t) {
+        .type = DEVICE_COMMAND_SET_VOLUME,
+        .value.playback.volume = volume,
+    });
+
+    return TRUE;
+}
+
+static void device_playback_volume_update(
+        uint8_t volume,
+        void* user_data)
+{
+    device_t* device = user_data;
+
+    if (device->playback_iface)
+    {
+        org_mdr_playback_set_volume(device->playback_iface, volume);
+    }
+}
+
+/*
+ * Settings accepted by ApplySettings, named after the property they set.
+ * Their commands are submitted in this order.
+ */
+typedef enum
+{
+    DEVICE_SETTING_NOISE_CANCELLING,
+    DEVICE_SETTING_ASM_AMOUNT,
+    DEVICE_SETTING_ASM_MODE,
+    DEVICE_SETTING_EQ_PRESET,
+    DEVICE_SETTING_EQ_LEVELS,
+    DEVICE_SETTING_AUTO_POWER_OFF,
+    DEVICE_SETTING_KEY_FUNCTIONS,
+    DEVICE_SETTING_VOLUME,
+
+    DEVICE_NUM_SETTINGS,
+}
+device_setting_t;
+
+#define DEVICE_SETTING(setting) (1 << (setting))
+
+typedef struct
+{
+    const gchar* name;
+    const gchar* type;
+    // The phase that registers the interface of the property.
+    guint phase;
+}
+device_setting_info_t;
+
+static const device_setting_info_t device_settings[DEVICE_NUM_SETTINGS] = {
+    [DEVICE_SETTING_NOISE_CANCELLING]
+        = { "NoiseCancelling.enabled", "b", DEVICE_INIT_NOISE_CANCELLING },
+    [DEVICE_SETTING_ASM_AMOUNT]
+        = { "AmbientSoundMode.amount", "u", DEVICE_INIT_AMBIENT_SOUND_MODE },
+    [DEVICE_SETTING_ASM_MODE]
+        = { "AmbientSoundMode.mode", "s", DEVICE_INIT_AMBIENT_SOUND_MODE },
+    [DEVICE_SETTING_EQ_PRESET]
+        = { "Eq.preset", "s", DEVICE_INIT_EQ },
+    [DEVICE_SETTING_EQ_LEVELS]
+        = { "Eq.levels", "au", DEVICE_INIT_EQ },
+    [DEVICE_SETTING_AUTO_POWER_OFF]
+        = { "AutoPowerOff.timeout", "s", DEVICE_INIT_AUTO_POWER_OFF },
+    [DEVICE_SETTING_KEY_FUNCTIONS]
+        = { "KeyFunctions.current_presets", "a{ss}",
+            DEVICE_INIT_KEY_FUNCTIONS },
+    [DEVICE_SETTING_VOLUME]
+        = { "Playback.volume", "u", DEVICE_INIT_PLAYBACK },
+};
+
+/*
+ * The commands of one ApplySettings call. The call completes once every
+ * command has returned.
+ */
+typedef struct
+{
+    GDBusMethodInvocation* invocation;
+
+    struct
+    {
+        // The settings applied by the command.
+        guint32 settings;
+        device_command_t command;
+    }
+    commands[DEVICE_NUM_SETTINGS];
+    guint num_commands;
+
+    guint32 applied;
+    guint32 failed;
+    guint pending;
+}
+device_apply_t;
+
+static void device_apply_add(device_apply_t* apply,
+                             guint32 settings,
+                             device_command_t command)
+{
+    apply->commands[apply->num_commands].settings = settings;
+    apply->commands[apply->num_commands].command = command;
+    apply->num_commands++;
+
+    apply->applied |= settings;
+}
+
+/*
+ * Frees `apply` along with the arguments of commands never submitted.
+ */
+static void device_apply_discard(device_apply_t* apply)
+{
+    for (guint i = 0; i < apply->num_commands; i++)
+    {
+        device_value_clear(apply->commands[i].command.type,
+                           &apply->commands[i].command.value);
+    }
+
+    g_free(apply);
+}
+
+/*
+ * Returns the names of `settings` as a NULL terminated array. Only the
+ * array needs to be freed.
+ */
+static const gchar** device_setting_names(guint32 settings)
+{
+    const gchar** names = g_new0(const gchar*, DEVICE_NUM_SETTINGS + 1);
+    guint num_names = 0;
+
+    for (guint setting = 0; setting < DEVICE_NUM_SETTINGS; setting++)
+    {
+        if (settings & DEVICE_SETTING(setting))
+        {
+            names[num_names++] = device_settings[setting].name;
+        }
+    }
+
+    return names;
+}
+
+/*
+ * Sorts the entries of `settings` into `values` by setting and checks that
+ * they can be applied to the device at all.
+ *
+ * Returns a description of the first problem found.
+ */
+static gchar* device_apply_parse(device_t* device,
+                                 GVariant* settings,
+                                 GVariant** values)
+{
+    GVariantIter iter;
+    const gchar* name;
+    GVariant* value;
+
+    g_variant_iter_init(&iter, settings);
+
+    while (g_variant_iter_next(&iter, "{&sv}", &name, &value))
+    {
+        guint setting = 0;
+
+        while (setting < DEVICE_NUM_SETTINGS
+                && !g_str_equal(device_settings[setting].name, name))
+        {
+            setting++;
+        }
+
+        if (setting == DEVICE_NUM_SETTINGS)
+        {
+            g_variant_unref(value);
+            return g_strdup_printf("Unknown setting '%s'.", name);
+        }
+
+        const device_setting_info_t* info = &device_settings[setting];
+
+        if (!g_variant_is_of_type(value, G_VARIANT_TYPE(info->type)))
+        {
+            g_variant_unref(value);
+            return g_strdup_printf("%s: Expected a value of type '%s'.",
+                                   name,
+                                   info->type);
+        }
+
+        if (device_get_iface(device, info->phase) == NULL)
+        {
+            g_variant_unref(value);
+
+            if (device_lazy_find(device, info->phase) != NULL)
+            {
+                return g_strdup_printf("%s: Not fetched yet, access the "
+                                       "interface first.",
+                                       name);
+            }
+
+            return g_strdup_printf("%s: Not supported by the device.", name);
+        }
+
+        if (values[setting] != NULL)
+        {
+            g_variant_unref(values[setting]);
+        }
+
+        values[setting] = value;
+    }
+
+    // Both select the noise cancelling and ambient sound mode, so only the
+    // command sent last would have an effect.
+    if (values[DEVICE_SETTING_NOISE_CANCELLING] != NULL
+            && (values[DEVICE_SETTING_ASM_AMOUNT] != NULL
+                || values[DEVICE_SETTING_ASM_MODE] != NULL))
+    {
+        return g_strdup_printf("%s cannot be combined with "
+                               "AmbientSoundMode settings.",
+                               device_settings[
+                                   DEVICE_SETTING_NOISE_CANCELLING].name);
+    }
+
+    return NULL;
+}
+
+/*
+ * Builds the commands for `values` into `apply`, leaving out those whose
+ * property already has the requested value.
+ *
+ * Returns a description of the problem if a value is invalid, along with
+ * the setting in `setting`.
+ */
+static const gchar* device_apply_build(device_t* device,
+                                       GVariant** values,
+                                       device_apply_t* apply,
+                                       guint* setting)
+{
+    device_command_t command;
+    const gchar* error;
+
+    *setting = DEVICE_SETTING_NOISE_CANCELLING;
+    if (values[*setting] != NULL)
+    {
+        bool enabled = g_variant_get_boolean(values[*setting]);
+
+        // Disabling is always sent: it also switches ambient sound off,
+        // which is not reflected by any property.
+        if (!enabled || !org_mdr_noise_cancelling_get_enabled(
+                    device->noise_cancelling_iface))
+        {
+            device_apply_add(apply, DEVICE_SETTING(*setting),
+                             (device_command_t) {
+                .type = enabled ? DEVICE_COMMAND_ENABLE_NOISE_CANCELLING
+                                : DEVICE_COMMAND_DISABLE_NCASM,
+            });
+        }
+    }
+
+    if (values[DEVICE_SETTING_ASM_AMOUNT] != NULL
+            || values[DEVICE_SETTING_ASM_MODE] != NULL)
+    {
+        guint32 settings = 0;
+        uint8_t amount = device->asm_amount;
+        bool voice = device->asm_voice;
+
+        *setting = DEVICE_SETTING_ASM_AMOUNT;
+        if (values[*setting] != NULL)
+        {
+            guint32 value = g_variant_get_uint32(values[*setting]);
+
+            amount = value > 0xff ? 0xff : value;
+            settings |= DEVICE_SETTING(*setting);
+        }
+
+        *setting = DEVICE_SETTING_ASM_MODE;
+        if (values[*setting] != NULL)
+        {
+            const gchar* mode = g_variant_get_string(values[*setting], NULL);
+
+            if (!(voice = g_str_equal(mode, "voice"))
+                    && !g_str_equal(mode, "normal"))
+            {
+                return "Invalid ASM mode, valid modes are: "
+                       "'voice' and 'normal'.";
+            }
+
+            settings |= DEVICE_SETTING(*setting);
+        }
+
+        // Always sent: it also switches ambient sound on, which is not
+        // reflected by any property.
+        device_apply_add(apply, settings, (device_command_t) {
+            .type = DEVICE_COMMAND_ENABLE_AMBIENT_SOUND_MODE,
+            .value.ambient_sound_mode = {
+                .amount = amount,
+                .voice = voice,
+            },
+        });
+    }
+
+    bool preset_changed = false;
+
+    *setting = DEVICE_SETTING_EQ_PRESET;
+    if (values[*setting] != NULL)
+    {
+        const gchar* preset = g_variant_get_string(values[*setting], NULL);
+        mdr_packet_eqebb_eq_preset_id_t preset_id;
+
+        if (!device_eq_preset_id(device, preset, &preset_id))
+        {
+            return "Preset not found";
+        }
+
+        if (g_strcmp0(preset, org_mdr_eq_get_preset(device->eq_iface)) != 0)
+        {
+            device_apply_add(apply, DEVICE_SETTING(*setting),
+                             (device_command_t) {
+                .type = DEVICE_COMMAND_SET_EQ_PRESET,
+                .value.eq_preset_and_levels.preset_id = preset_id,
+            });
+            preset_changed = true;
+        }
+    }
+
+    *setting = DEVICE_SETTING_EQ_LEVELS;
+    if (values[*setting] != NULL)
+    {
+        if ((error = device_eq_levels_command(device,
+                                              values[*setting],
+                                              &command)) != NULL)
+        {
+            return error;
+        }
+
+        // A new preset brings its own levels, so the current ones do not
+        // tell whether these are already set.
+        if (preset_changed
+                || !g_variant_equal(values[*setting],
+                                    org_mdr_eq_get_levels(device->eq_iface)))
+        {
+            device_apply_add(apply, DEVICE_SETTING(*setting), command);
+        }
+        else
+        {
+            device_value_clear(command.type, &command.value);
+        }
+    }
+
+    *setting = DEVICE_SETTING_AUTO_POWER_OFF;
+    if (values[*setting] != NULL)
+    {
+        const gchar* timeout = g_variant_get_string(values[*setting], NULL);
+
+        if (!auto_power_off_timeout_command(timeout, &command))
+        {
+            return "Invalid timeout";
+        }
+
+        if (g_strcmp0(timeout,
+                      org_mdr_auto_power_off_get_timeout(
+                          device->auto_power_off_iface)) != 0)
+        {
+            device_apply_add(apply, DEVICE_SETTING(*setting), command);
+        }
+    }
+
+    *setting = DEVICE_SETTING_KEY_FUNCTIONS;
+    if (values[*setting] != NULL)
+    {
+        if ((error = key_functions_presets_command(device,
+                                                   values[*setting],
+                                                   &command)) != NULL)
+        {
+            return error;
+        }
+
+        if (!g_variant_equal(values[*setting],
+                             org_mdr_key_functions_get_current_presets(
+                                 device->key_functions_iface)))
+        {
+            device_apply_add(apply, DEVICE_SETTING(*setting), command);
+        }
+        else
+        {
+            device_value_clear(command.type, &command.value);
+        }
+    }
+
+    *setting = DEVICE_SETTING_VOLUME;
+    if (values[*setting] != NULL)
+    {
+        guint32 volume = g_variant_get_uint32(values[*setting]);
+
+        if (volume > 0xff)
+        {
+            return "Volume not within range.";
+        }
+
+        if (volume != org_mdr_playback_get_volume(device->playback_iface))
+        {
+            device_apply_add(apply, DEVICE_SETTING(*setting),
+                             (device_command_t) {
+                .type = DEVICE_COMMAND_SET_VOLUME,
+                .value.playback.volume = volume,
+            });
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Completes the call and frees `apply`.
+ */
+static void device_apply_complete(device_apply_t* apply)
 {
-    if (g_str_equal(str, "Ambient Sound Control"))
+    if (apply->failed != 0)
+    {
+        const gchar** names = device_setting_names(apply->failed);
+        gchar* joined = g_strjoinv(", ", (gchar**) names);
+        gchar* message = g_strdup_printf("Failed to apply %s.", joined);
+
+        g_dbus_method_invocation_return_dbus_error(apply->invocation,
+                                                   "org.mdr.DeviceError",
+                                                   message);
+        g_free(message);
+        g_free(joined);
+        g_free(names);
+    }
+    else
     {
-        return MDR_PACKET_SYSTEM_ASSIGNABLE_SETTINGS_PRESET_AMBIENT_SOUND_CONTROL;
+        const gchar** names = device_setting_names(apply->applied);
+
+        g_dbus_method_invocation_return_value(apply->invocation,
+                                              g_variant_new("(^as)", names));
+        g_free(names);
     }
-    else if (g_str_equal(str, "Volume Control"))
+
+    g_free(apply);
+}
+
+static void device_apply_result(const device_event_t* event, void* user_data)
+{
+    device_apply_t* apply = user_data;
+
+    if (event->type == DEVICE_EVENT_ERROR)
     {
-        return MDR_PACKET_SYSTEM_ASSIGNABLE_SETTINGS_PRESET_VOLUME_CONTROL;
+        for (guint i = 0; i < apply->num_commands; i++)
+        {
+            if (apply->commands[i].command.type == event->command)
+            {
+                apply->failed |= apply->commands[i].settings;
+            }
+        }
     }
-    else if (g_str_equal(str, "Playback Control"))
+
+    if (--apply->pending == 0)
     {
-        return MDR_PACKET_SYSTEM_ASSIGNABLE_SETTINGS_PRESET_PLAYBACK_CONTROL;
+        device_flush(event->owner);
+        device_apply_complete(apply);
     }
-    else if (g_str_equal(str, "Voice Recognition"))
+}
+
+/*
+ * Applies several settings with a single call.
+ *
+ * Every value is checked before anything is sent. Settings that already
+ * have the requested value are left out and the commands for the rest are
+ * queued together, so the device works through them back to back. The
+ * call returns the names of the settings it sent commands for once all of
+ * them have returned, or an error naming those that failed.
+ */
+static gboolean device_handle_apply_settings(OrgMdrDevice* interface,
+                                             GDBusMethodInvocation* invocation,
+                                             GVariant* settings,
+                                             gpointer user_data)
+{
+    device_t* device = user_data;
+    GVariant* values[DEVICE_NUM_SETTINGS] = { NULL };
+    device_apply_t* apply = g_new0(device_apply_t, 1);
+    guint setting;
+
+    apply->invocation = invocation;
+
+    gchar* error = device_apply_parse(device, settings, values);
+
+    if (error == NULL)
     {
-        return MDR_PACKET_SYSTEM_ASSIGNABLE_SETTINGS_PRESET_VOICE_RECOGNITION;
+        const gchar* value_error = device_apply_build(device,
+                                                      values,
+                                                      apply,
+                                                      &setting);
+        if (value_error != NULL)
+        {
+            error = g_strdup_printf("%s: %s",
+                                    device_settings[setting].name,
+                                    value_error);
+        }
     }
-    else if (g_str_equal(str, "Google Assistant"))
+
+    if (error != NULL)
     {
-        return MDR_PACKET_SYSTEM_ASSIGNABLE_SETTINGS_PRESET_GOOGLE_ASSISTANT;
+        g_dbus_method_invocation_return_dbus_error(invocation,
+                                                   "org.mdr.InvalidValue",
+                                                   error);
+        g_free(error);
+        device_apply_discard(apply);
     }
-    else if (g_str_equal(str, "Amazon Alexa"))
+    else if (device->io == NULL)
     {
-        return MDR_PACKET_SYSTEM_ASSIGNABLE_SETTINGS_PRESET_AMAZON_ALEXA;
+        g_dbus_method_invocation_return_dbus_error(invocation,
+                                                   "org.mdr.DeviceError",
+                                                   "Device disconnected.");
+        device_apply_discard(apply);
     }
-    else if (g_str_equal(str, "Tencent Xiaowei"))
+    else if (apply->num_commands == 0)
     {
-        return MDR_PACKET_SYSTEM_ASSIGNABLE_SETTINGS_PRESET_TENCENT_XIAOWEI;
+        device_apply_complete(apply);
     }
-    else if (g_str_equal(str, "No Function"))
+    else
     {
-        return MDR_PACKET_SYSTEM_ASSIGNABLE_SETTINGS_PRESET_NO_FUNCTION;
+        for (guint i = 0; i < apply->num_commands; i++)
+        {
+            device_command_t* command = &apply->commands[i].command;
+
+            // Like SetAmount and SetMode, later ambient sound mode commands
+            // build on the requested values.
+            if (command->type == DEVICE_COMMAND_ENABLE_AMBIENT_SOUND_MODE)
+            {
+                device->asm_amount = command->value.ambient_sound_mode.amount;
+                device->asm_voice = command->value.ambient_sound_mode.voice;
+            }
+            else if (command->type == DEVICE_COMMAND_SET_EQ_LEVELS)
+            {
+                org_mdr_eq_set_levels(device->eq_iface,
+                                      values[DEVICE_SETTING_EQ_LEVELS]);
+                device_report_forget(device,
+                                     DEVICE_COMMAND_GET_EQ_PRESET_AND_LEVELS,
+                                     &command->value);
+            }
+
+            command->result_cb = device_apply_result;
+            command->user_data = apply;
+        }
+
+        // Ownership of the command arguments passes to the I/O thread.
+        apply->pending = apply->num_commands;
+
+        for (guint i = 0; i < apply->num_commands; i++)
+        {
+            device_io_submit(device->io, &apply->commands[i].command);
+        }
     }
-    else
+
+    for (setting = 0; setting < DEVICE_NUM_SETTINGS; setting++)
     {
-        return MDR_PACKET_SYSTEM_ASSIGNABLE_SETTINGS_PRESET_NO_FUNCTION;
+        if (values[setting] != NULL)
+        {
+            g_variant_unref(values[setting]);
+        }
     }
+
+    return TRUE;
 }
 
-static void device_init_key_functions_error(void* user_data)
+static void device_add_init_error(void* user_data)
 {
-    device_t* device = user_data;
+    device_add_init_data* init_data = user_data;
+    device_t* device = init_data->device;
+    bool rebind = init_data->rebind;
 
-    g_warning("Device init key functions failed (3): %d", errno);
+    init_data->error_cb(init_data->user_data);
+    device_add_init_data_free(init_data);
 
-    if (device->key_functions_iface != NULL)
+    if (device->io != NULL)
     {
-        g_object_unref(device->key_functions_iface);
-        device->key_functions_iface = NULL;
+        device_io_disconnect(device->io);
+        device->io = NULL;
     }
 
-    device_finish_registration(device);
-    device_unref(device);
+    if (rebind)
+    {
+        // The interfaces were only kept for this connection.
+        g_hash_table_remove(device_table, device->dbus_name);
+    }
+
+    device_unref(device); // Initialization
 }
 
-static void device_init_playback_result(
-        uint8_t volume,
-        void* user_data);
+typedef struct
+{
+    device_t* device;
+    capability_cache_entry_t entry;
+
+    int pending;
+    bool failed;
+}
+device_validate_data;
 
-static void device_init_playback_error(void* user_data);
+static void device_validate_result(const device_event_t* event,
+                                   void* user_data);
 
-static void device_init_playback(device_t* device)
+/*
+ * Queries the capabilities that were taken from the cache again, now that
+ * the device is up, and takes ownership of `entry`.
+ */
+static void device_validate_capabilities(device_t* device,
+                                         capability_cache_entry_t* entry)
 {
-    if (mdr_device_playback_get_volume(
-            device->mdr_device,
-            device_init_playback_result,
-            device_init_playback_error,
-            device) < 0)
-    {
-        g_warning("Device init playback failed (1): %d", errno);
-    }
-    else
+    if (device->io == NULL)
     {
-        device_start_registration(device);
-        device_ref(device);
+        capability_cache_entry_clear(entry);
+        return;
     }
-}
 
-static gboolean device_playback_set_volume(
-        OrgMdrNoiseCancelling* interface,
-        GDBusMethodInvocation* invocation,
-        const guint volume,
-        gpointer user_data);
+    device_validate_data* data = g_new0(device_validate_data, 1);
 
-static void device_playback_volume_update(
-        uint8_t volume,
-        void* user_data);
+    data->device = device;
+    data->entry = *entry;
 
-static void device_init_playback_result(
-        uint8_t volume,
-        void* user_data)
-{
-    device_t* device = user_data;
+    const mdr_device_supported_functions_t* supported_functions
+        = &data->entry.model.model.supported_functions;
 
-    device->playback_iface = org_mdr_playback_skeleton_new();
+    device_command_type_t commands[3];
+    int num_commands = 0;
 
-    g_signal_connect(device->playback_iface,
-                     "handle-set-volume",
-                     G_CALLBACK(device_playback_set_volume),
-                     device);
+    commands[num_commands++] = DEVICE_COMMAND_GET_MODEL_NAME;
 
-    GError* error = NULL;
+    if (supported_functions->eq || supported_functions->eq_non_customizable)
+        commands[num_commands++] = DEVICE_COMMAND_GET_EQ_CAPABILITIES;
 
-    if (g_dbus_interface_skeleton_export(
-                G_DBUS_INTERFACE_SKELETON(device->playback_iface),
-                connection,
-                device->dbus_name,
-                &error))
+    if (supported_functions->assignable_settings)
+        commands[num_commands++] = DEVICE_COMMAND_GET_AVAILABLE_BUTTON_PRESETS;
+
+    device_ref(device);
+    data->pending = num_commands;
+
+    for (int i = 0; i < num_commands; i++)
     {
-        org_mdr_playback_set_volume(device->playback_iface, volume);
+        device_io_submit(device->io, &(device_command_t) {
+            .type = commands[i],
+            .result_cb = device_validate_result,
+            .user_data = data,
+        });
+    }
+}
 
-        g_debug("Registered playback interface for '%s'", device->dbus_name);
+/*
+ * Applies capabilities that turned out to differ from the cached ones.
+ */
+static void device_refresh_capabilities(device_t* device,
+                                        capability_cache_entry_t* entry)
+{
+    if (device->device_iface != NULL)
+    {
+        org_mdr_device_set_name(device->device_iface,
+                                entry->model.model.name);
+    }
 
-        mdr_device_playback_subscribe_volume(
-                device->mdr_device,
-                device_playback_volume_update,
+    if (device->eq_iface != NULL)
+    {
+        device_init_eq_get_capabilities_success(
+                entry->eq_capabilities.eq_capabilities.band_count,
+                entry->eq_capabilities.eq_capabilities.level_steps,
+                entry->eq_capabilities.eq_capabilities.num_presets,
+                entry->eq_capabilities.eq_capabilities.presets,
                 device);
+
+        org_mdr_eq_set_band_count(device->eq_iface, device->eq_band_count);
+        org_mdr_eq_set_level_steps(device->eq_iface, device->eq_level_steps);
+        org_mdr_eq_set_available_presets(device->eq_iface,
+                                         device->eq_presets->names);
     }
-    else
+
+    if (device->key_functions_iface != NULL)
     {
-        device->auto_power_off_iface = NULL;
+        key_functions_presets_t* presets = key_functions_presets_ref(
+                entry->available_button_presets
+                    .available_button_presets.num_keys,
+                entry->available_button_presets
+                    .available_button_presets.keys);
 
-        g_warning("Failed to register playback interface (5): "
-                  "%s", error->message);
-    }
+        org_mdr_key_functions_set_available_presets(
+                device->key_functions_iface,
+                presets->variant);
 
-    device_finish_registration(device);
-    device_unref(device);
+        key_functions_presets_unref(device->key_functions_presets);
+        device->key_functions_presets = presets;
+    }
 }
 
-static void device_playback_set_volume_success(void* user_data);
+static void device_validate_result(const device_event_t* event,
+                                   void* user_data)
+{
+    device_validate_data* data = user_data;
+    device_t* device = data->device;
 
-static void device_playback_set_volume_error(void* user_data);
+    if (event->type == DEVICE_EVENT_ERROR)
+    {
+        data->failed = true;
+    }
+    else
+    {
+        device_value_t* value = device_cached_value(&data->entry,
+                                                    event->command);
+        mdr_device_supported_functions_t supported_functions
+            = data->entry.model.model.supported_functions;
 
-static gboolean device_playback_set_volume(
-        OrgMdrNoiseCancelling* interface,
-        GDBusMethodInvocation* invocation,
-        const guint volume,
-        gpointer user_data)
-{
-    device_t* device = user_data;
+        device_value_clear(event->command, value);
+        device_value_copy(event->command, value, &event->value);
 
-    mdr_device_playback_set_volume(
-            device->mdr_device,
-            volume,
-            device_playback_set_volume_success,
-            device_playback_set_volume_error,
-            invocation);
+        data->entry.model.model.supported_functions = supported_functions;
+    }
 
-    return TRUE;
-}
+    if (--data->pending > 0)
+    {
+        return;
+    }
 
-static void device_playback_set_volume_success(void* user_data)
-{
-    GDBusMethodInvocation* invocation = user_data;
+    if (!data->failed && device->io != NULL)
+    {
+        if (capability_cache_store(device->dbus_name, &data->entry))
+        {
+            g_message("Capabilities of '%s' changed", device->dbus_name);
+
+            device_refresh_capabilities(device, &data->entry);
+        }
+        else
+        {
+            g_debug("Cached capabilities of '%s' are up to date",
+                    device->dbus_name);
+        }
+    }
+
+    capability_cache_entry_clear(&data->entry);
+    g_free(data);
 
-    g_dbus_method_invocation_return_value(invocation, NULL);
+    device_unref(device);
 }
 
-static void device_playback_set_volume_error(void* user_data)
+void device_remove(const gchar* name)
 {
-    GDBusMethodInvocation* invocation = user_data;
-
-    g_dbus_method_invocation_return_dbus_error(
-            invocation,
-            "org.mdr.DeviceError",
-            "Call failed.");
+    g_hash_table_remove(device_table, name);
 }
 
-static void device_playback_volume_update(
-        uint8_t volume,
-        void* user_data)
+static void device_removed(device_t* device)
 {
-    device_t* device = user_data;
+    if (device->grace_source != 0)
+    {
+        g_source_remove(device->grace_source);
+        device->grace_source = 0;
+    }
 
-    if (device->playback_iface)
+    // The I/O reference is released once the connection has been closed.
+    if (device->io != NULL)
     {
-        org_mdr_playback_set_volume(device->playback_iface, volume);
+        device_io_disconnect(device->io);
+        device->io = NULL;
     }
+
+    device_unref(device); // table
 }
 
-static void device_init_playback_error(void* user_data)
+static gboolean device_grace_expired(gpointer user_data)
 {
     device_t* device = user_data;
 
-    device->auto_power_off_iface = NULL;
-    g_warning("Device init playback failed (4): %d", errno);
-
-    device_finish_registration(device);
-    device_unref(device);
-}
-
-static void device_add_init_error(void* user_data)
-{
-    device_add_init_data* init_data = user_data;
+    g_message("Device '%s' did not reconnect", device->dbus_name);
 
-    init_data->error_cb(init_data->user_data);
-}
+    device->grace_source = 0;
+    g_hash_table_remove(device_table, device->dbus_name);
 
-void device_remove(const gchar* name)
-{
-    g_hash_table_remove(device_table, name);
+    return G_SOURCE_REMOVE;
 }
 
-static void device_removed(device_t* device)
+/*
+ * Closes the connection of an initialized device but keeps it in the table
+ * for the grace period, so device_add can bind it to a new connection.
+ */
+static void device_linger(device_t* device)
 {
-    mdr_device_close(device->mdr_device);
-    device->mdr_device = NULL;
+    device_io_disconnect(device->io);
+    device->io = NULL;
 
-    g_source_destroy(&device->source->source);
-    g_source_unref(&device->source->source);
-
-    device_unref(device);
+    device->grace_source = g_timeout_add_seconds(reconnect_grace,
+                                                 device_grace_expired,
+                                                 device);
 }
 
 static void device_ref(device_t* device)
@@ -2520,178 +4705,323 @@ static void device_unref(device_t* device)
 
     if (device->ref_count <= 0)
     {
-        org_mdr_device_emit_disconnected(device->device_iface);
+        device_lazy_free(device);
 
-        org_mdr_device_set_name(device->device_iface, "");
-        g_dbus_interface_skeleton_flush(
-                G_DBUS_INTERFACE_SKELETON(device->device_iface));
-
-        g_dbus_interface_skeleton_unexport_from_connection(
-                G_DBUS_INTERFACE_SKELETON(device->device_iface),
-                connection);
-        g_object_unref(device->device_iface);
-
-        if (device->power_off_iface != NULL)
+        if (device->coalesce_source != 0)
         {
-            g_dbus_interface_skeleton_unexport_from_connection(
-                    G_DBUS_INTERFACE_SKELETON(device->power_off_iface),
-                    connection);
-            g_object_unref(device->power_off_iface);
+            g_source_remove(device->coalesce_source);
         }
 
-        if (device->battery_iface != NULL)
+        if (device->coalesced_values != NULL)
         {
-            g_dbus_interface_skeleton_unexport_from_connection(
-                    G_DBUS_INTERFACE_SKELETON(device->battery_iface),
-                    connection);
-            g_object_unref(device->battery_iface);
-        }
+            for (guint phase = 0; phase < DEVICE_INIT_DEVICE; phase++)
+            {
+                device_value_clear(device_init_commands[phase],
+                                   &device->coalesced_values[phase]);
+            }
 
-        if (device->left_right_battery_iface != NULL)
-        {
-            g_dbus_interface_skeleton_unexport_from_connection(
-                    G_DBUS_INTERFACE_SKELETON(device->left_right_battery_iface),
-                    connection);
-            g_object_unref(device->left_right_battery_iface);
+            g_free(device->coalesced_values);
         }
 
-        if (device->cradle_battery_iface != NULL)
+        g_debug("Notifications for '%s': %" G_GUINT64_FORMAT " applied, "
+                "%" G_GUINT64_FORMAT " unchanged",
+                device->dbus_name,
+                device->updates_forwarded,
+                device->updates_suppressed);
+
+        if (device->reported_values != NULL)
         {
-            g_dbus_interface_skeleton_unexport_from_connection(
-                    G_DBUS_INTERFACE_SKELETON(device->cradle_battery_iface),
-                    connection);
-            g_object_unref(device->cradle_battery_iface);
+            for (guint phase = 0; phase < DEVICE_INIT_DEVICE; phase++)
+            {
+                device_value_clear(device_init_commands[phase],
+                                   &device->reported_values[phase]);
+            }
+
+            g_free(device->reported_values);
         }
 
-        if (device->left_right_iface != NULL)
+        if (device->state_page != NULL)
         {
-            g_dbus_interface_skeleton_unexport_from_connection(
-                    G_DBUS_INTERFACE_SKELETON(device->left_right_iface),
-                    connection);
-            g_object_unref(device->left_right_iface);
+            state_page_free(device->state_page);
         }
 
-        if (device->noise_cancelling_iface != NULL)
+        if (g_dbus_object_manager_server_is_exported(device_manager,
+                                                     device->object))
         {
-            g_dbus_interface_skeleton_unexport_from_connection(
-                    G_DBUS_INTERFACE_SKELETON(device->noise_cancelling_iface),
-                    connection);
-            g_object_unref(device->noise_cancelling_iface);
+            org_mdr_device_emit_disconnected(device->device_iface);
+
+            // Removes every interface in one InterfacesRemoved.
+            g_dbus_object_manager_server_unexport(device_manager,
+                                                  device->dbus_name);
+
+            for (GSList* item = device_peer_managers; item != NULL;
+                    item = item->next)
+            {
+                g_dbus_object_manager_server_unexport(item->data,
+                                                      device->dbus_name);
+            }
         }
 
-        if (device->ambient_sound_mode_iface != NULL)
+        g_object_unref(device->object);
+
+        if (device->state != NULL)
         {
-            g_dbus_interface_skeleton_unexport_from_connection(
-                    G_DBUS_INTERFACE_SKELETON(device->ambient_sound_mode_iface),
-                    connection);
-            g_object_unref(device->ambient_sound_mode_iface);
+            g_variant_unref(device->state);
         }
 
-        if (device->eq_iface != NULL)
+        for (guint phase = DEVICE_INIT_POWER_OFF;
+                phase < DEVICE_INIT_NUM_PHASES;
+                phase++)
         {
-            g_dbus_interface_skeleton_unexport_from_connection(
-                    G_DBUS_INTERFACE_SKELETON(device->eq_iface),
-                    connection);
-            g_object_unref(device->eq_iface);
+            GDBusInterfaceSkeleton* skeleton = device_get_iface(device, phase);
+
+            if (skeleton != NULL)
+            {
+                g_object_unref(skeleton);
+            }
         }
 
-        if (device->auto_power_off_iface != NULL)
+        if (device->device_iface != NULL)
         {
-            g_dbus_interface_skeleton_unexport_from_connection(
-                    G_DBUS_INTERFACE_SKELETON(device->auto_power_off_iface),
-                    connection);
-            g_object_unref(device->auto_power_off_iface);
+            g_object_unref(device->device_iface);
         }
 
-        if (device->key_functions_iface != NULL)
+        if (device->key_functions_presets != NULL)
         {
-            g_dbus_interface_skeleton_unexport_from_connection(
-                    G_DBUS_INTERFACE_SKELETON(device->key_functions_iface),
-                    connection);
-            g_object_unref(device->key_functions_iface);
+            key_functions_presets_unref(device->key_functions_presets);
         }
 
-        if (device->playback_iface != NULL)
+        if (device->eq_presets != NULL)
         {
-            g_dbus_interface_skeleton_unexport_from_connection(
-                    G_DBUS_INTERFACE_SKELETON(device->playback_iface),
-                    connection);
-            g_object_unref(device->playback_iface);
+            eq_presets_unref(device->eq_presets);
         }
     }
 }
 
-static gboolean device_source_prepare(GSource* source, gint* timeout)
+static void device_update(device_t* device,
+                          device_command_type_t command,
+                          const device_value_t* value)
 {
-    device_source_t* dev_source = (device_source_t*) source;
+    // Devices report unchanged state often; skip building values for it.
+    if (!device_report(device, command, value))
+    {
+        return;
+    }
 
-    if (dev_source->device->mdr_device == NULL)
+    device->updates_forwarded++;
+    device_updates_forwarded++;
+
+    switch (command)
     {
-        return FALSE;
+        case DEVICE_COMMAND_GET_BATTERY:
+            device_battery_update(value->battery.level,
+                                  value->battery.charging,
+                                  device);
+            break;
+
+        case DEVICE_COMMAND_GET_LEFT_RIGHT_BATTERY:
+            device_left_right_battery_update(
+                    value->left_right_battery.left_level,
+                    value->left_right_battery.left_charging,
+                    value->left_right_battery.right_level,
+                    value->left_right_battery.right_charging,
+                    device);
+            break;
+
+        case DEVICE_COMMAND_GET_CRADLE_BATTERY:
+            device_cradle_battery_update(value->battery.level,
+                                         value->battery.charging,
+                                         device);
+            break;
+
+        case DEVICE_COMMAND_GET_LEFT_RIGHT_CONNECTION_STATUS:
+            device_left_right_connection_status_update(
+                    value->left_right_connection_status.left_connected,
+                    value->left_right_connection_status.right_connected,
+                    device);
+            break;
+
+        case DEVICE_COMMAND_GET_NOISE_CANCELLING:
+            device_noise_cancelling_update(value->noise_cancelling.enabled,
+                                           device);
+            break;
+
+        case DEVICE_COMMAND_GET_AMBIENT_SOUND_MODE:
+            device_ambient_sound_mode_update(value->ambient_sound_mode.amount,
+                                             value->ambient_sound_mode.voice,
+                                             device);
+            break;
+
+        case DEVICE_COMMAND_GET_EQ_PRESET_AND_LEVELS:
+            device_eq_preset_and_levels_update(
+                    value->eq_preset_and_levels.preset_id,
+                    value->eq_preset_and_levels.num_levels,
+                    value->eq_preset_and_levels.levels,
+                    device);
+            break;
+
+        case DEVICE_COMMAND_GET_AUTO_POWER_OFF:
+            device_auto_power_off_update(value->auto_power_off.enabled,
+                                         value->auto_power_off.timeout,
+                                         device);
+            break;
+
+        case DEVICE_COMMAND_GET_ACTIVE_BUTTON_PRESETS:
+            if (device->key_functions_iface != NULL)
+            {
+                key_functions_active_update(
+                        value->active_button_presets.num_presets,
+                        value->active_button_presets.presets,
+                        device);
+            }
+            break;
+
+        case DEVICE_COMMAND_GET_VOLUME:
+            device_playback_volume_update(value->playback.volume, device);
+            break;
+
+        default:
+            break;
     }
+}
 
-    mdr_poll_info poll_info = mdr_device_poll_info(dev_source->device->mdr_device);
-    *timeout = poll_info.timeout;
-    dev_source->poll_fd.events
-        = (dev_source->poll_fd.events & ~G_IO_OUT)
-        | (poll_info.write ? G_IO_OUT : 0);
-    dev_source->poll_fd.revents = 0;
+/*
+ * Applies the notifications held back for the coalescing window.
+ */
+static void device_coalesce_flush(device_t* device)
+{
+    if (device->coalesce_source != 0)
+    {
+        g_source_remove(device->coalesce_source);
+        device->coalesce_source = 0;
+    }
 
-    if (poll_info.timeout == 0)
+    for (guint phase = 0; phase < DEVICE_INIT_DEVICE; phase++)
     {
-        return TRUE;
+        if (device->coalesced_queries & INIT_PHASE(phase))
+        {
+            device_update(device,
+                          device_init_commands[phase],
+                          &device->coalesced_values[phase]);
+            device_value_clear(device_init_commands[phase],
+                               &device->coalesced_values[phase]);
+        }
     }
 
-    return FALSE;
+    device->coalesced_queries = 0;
 }
 
-static gboolean device_source_check(GSource* source)
+static gboolean device_coalesce_expired(gpointer user_data)
 {
-    device_source_t* dev_source = (device_source_t*) source;
+    device_t* device = user_data;
+
+    device->coalesce_source = 0;
+    device_coalesce_flush(device);
 
-    return dev_source->poll_fd.revents != 0;
+    return G_SOURCE_REMOVE;
 }
 
-static gboolean device_source_dispatch(GSource* source,
-                                       GSourceFunc callback,
-                                       gpointer user_data)
+/*
+ * Applies a notification from the device.
+ *
+ * The skeletons send the property changes made in one main loop iteration
+ * as one PropertiesChanged per interface. With a coalescing window,
+ * notifications are held for that long first, so everything the device
+ * reports within it goes out together, and only the last value of each
+ * getter is applied.
+ */
+static void device_coalesce(device_t* device,
+                            device_command_type_t command,
+                            const device_value_t* value)
 {
-    device_source_t* dev_source = (device_source_t*) source;
+    if (coalesce_window == 0)
+    {
+        device_update(device, command, value);
+        return;
+    }
 
-    mdr_device_t* mdr_device = dev_source->device->mdr_device;
-    GPollFD* poll_fd = &dev_source->poll_fd;
+    guint query = device_init_query_phase(command);
 
-    if (mdr_device == NULL)
+    if (device->coalesced_values == NULL)
     {
-        return G_SOURCE_REMOVE;
+        device->coalesced_values = g_new0(device_value_t, DEVICE_INIT_DEVICE);
     }
 
-    // TOOD handle error
-    if ((poll_fd->revents & G_IO_HUP) != 0)
+    if (device->coalesced_queries & INIT_PHASE(query))
     {
-        g_warning("Lost connection to device '%s': %s",
-                dev_source->device->dbus_name,
-                poll_fd->revents & G_IO_ERR ? "ERR" : "HUP");
-        device_remove(dev_source->device->dbus_name);
-        return G_SOURCE_REMOVE;
+        device_value_clear(command, &device->coalesced_values[query]);
     }
 
-    mdr_device_process_by_availability(
-            mdr_device,
-            (poll_fd->revents & G_IO_IN) != 0,
-            (poll_fd->revents & G_IO_OUT) != 0);
+    device_value_copy(command, &device->coalesced_values[query], value);
+    device->coalesced_queries |= INIT_PHASE(query);
 
-    if (callback != NULL)
+    if (device->coalesce_source == 0)
     {
-        callback(user_data);
+        device->coalesce_source = g_timeout_add(coalesce_window,
+                                                device_coalesce_expired,
+                                                device);
     }
+}
 
-    return G_SOURCE_CONTINUE;
+/*
+ * Sends the pending property changes of `device` right away, so that they
+ * reach clients ahead of the reply to an interactive call.
+ */
+static void device_flush(device_t* device)
+{
+    device_coalesce_flush(device);
+
+    GList* ifaces = g_dbus_object_get_interfaces(
+            G_DBUS_OBJECT(device->object));
+
+    for (GList* item = ifaces; item != NULL; item = item->next)
+    {
+        g_dbus_interface_skeleton_flush(item->data);
+    }
+
+    g_list_free_full(ifaces, g_object_unref);
 }
 
-static void device_source_dispose(GSource* source)
+/*
+ * Handles events from the I/O thread that are not the result of a command.
+ */
+static void device_io_event(const device_event_t* event)
 {
-    device_source_t* dev_source = (device_source_t*) source;
+    device_t* device = event->owner;
+
+    switch (event->type)
+    {
+        case DEVICE_EVENT_UPDATE:
+            device_coalesce(device, event->command, &event->value);
+            break;
+
+        case DEVICE_EVENT_HANGUP:
+            g_warning("Lost connection to device '%s'", device->dbus_name);
+
+            if (device->io == NULL)
+            {
+                break;
+            }
+
+            if (reconnect_grace > 0
+                    && g_hash_table_lookup(device_table, device->dbus_name)
+                        == device)
+            {
+                device_linger(device);
+            }
+            else if (!g_hash_table_remove(device_table, device->dbus_name))
+            {
+                // Not yet in the device table.
+                device_io_disconnect(device->io);
+                device->io = NULL;
+            }
+            break;
+
+        case DEVICE_EVENT_CLOSED:
+            device_unref(device); // I/O
+            break;
 
-    device_unref(dev_source->device);
+        default:
+            break;
+    }
 }
@@ -0,0 +1,1842 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "device_io.h"
+
+#include "channel.h"
+#include "reactor.h"
+
+#include <sys/ioctl.h>
+
+#define DEVICE_IO_QUEUE_CAPACITY 1024
+
+// Upper bound on reads per dispatch so one chatty device cannot starve
+// the others.
+#define DEVICE_IO_MAX_READS_PER_DISPATCH 16
+
+// Commands handed to libmdr at a time per device. Everything else waits
+// in the scheduler so that it can still be reordered.
+#define DEVICE_IO_MAX_IN_FLIGHT 1
+
+typedef enum
+{
+    // Triggered by a user, e.g. setters.
+    DEVICE_IO_CLASS_INTERACTIVE,
+    // Reads of current device state.
+    DEVICE_IO_CLASS_STATE_SYNC,
+    // Capability discovery and other work nobody is waiting on.
+    DEVICE_IO_CLASS_BACKGROUND,
+
+    DEVICE_IO_NUM_CLASSES,
+}
+device_io_class_t;
+
+typedef struct
+{
+    // Wakeups for socket readiness.
+    guint64 dispatches;
+    // Reads, writes and FIONREAD ioctls on the socket.
+    guint64 syscalls;
+    // Results and notifications parsed by libmdr.
+    guint64 frames;
+}
+device_io_stats_t;
+
+typedef struct
+{
+    guint64 issued;
+    guint64 coalesced;
+    guint max_depth;
+    // In µs.
+    gint64 total_wait;
+    gint64 max_wait;
+}
+device_io_class_stats_t;
+
+struct device_io
+{
+    // Set on creation, never modified.
+    void* owner;
+
+    // Only accessed from the I/O thread.
+    gint sock;
+    mdr_device_t* mdr_device;
+    reactor_entry_t* reactor_entry;
+    uint32_t subscriptions;
+    device_io_stats_t stats;
+
+    GQueue queues[DEVICE_IO_NUM_CLASSES];
+    device_io_class_stats_t class_stats[DEVICE_IO_NUM_CLASSES];
+    guint in_flight;
+    bool pumping;
+    bool closing;
+
+    GList flush_link;
+    bool flush_pending;
+};
+
+typedef struct
+{
+    device_io_t* io;
+    void* owner;
+    device_command_type_t command;
+    device_value_t value;
+
+    device_io_result_cb result_cb;
+    void* user_data;
+
+    device_io_class_t class;
+    gint64 queued_at;
+    GList link;
+
+    // device_io_waiter_t of requests whose value this one replaced, newest
+    // first. They complete together with this request.
+    GSList* superseded;
+}
+device_io_request_t;
+
+typedef struct
+{
+    device_io_result_cb result_cb;
+    void* user_data;
+}
+device_io_waiter_t;
+
+static device_io_event_cb event_cb;
+
+static GMainContext* io_context;
+static GMainLoop* io_loop;
+static GThread* io_thread;
+
+static reactor_t* reactor;
+
+static channel_t* commands;
+static channel_t* events;
+
+// Devices that were sent commands in the current batch.
+static GQueue flush_queue = G_QUEUE_INIT;
+
+static void device_io_handle_command(void* message, void* user_data);
+
+static void device_io_handle_commands_drained(void* user_data);
+
+static void device_io_handle_event(void* message, void* user_data);
+
+static gpointer device_io_thread(gpointer user_data);
+
+void device_io_init(device_io_event_cb cb, guint timer_slack)
+{
+    event_cb = cb;
+
+    io_context = g_main_context_new();
+    io_loop = g_main_loop_new(io_context, FALSE);
+
+    reactor = reactor_new(io_context, timer_slack);
+
+    commands = channel_new(DEVICE_IO_QUEUE_CAPACITY,
+                           sizeof(device_command_t),
+                           g_main_context_default(),
+                           io_context,
+                           device_io_handle_command,
+                           device_io_handle_commands_drained,
+                           NULL);
+
+    events = channel_new(DEVICE_IO_QUEUE_CAPACITY,
+                         sizeof(device_event_t),
+                         io_context,
+                         g_main_context_default(),
+                         device_io_handle_event,
+                         NULL,
+                         NULL);
+
+    if (reactor == NULL || commands == NULL || events == NULL)
+    {
+        g_error("Failed to set up device I/O");
+    }
+
+    io_thread = g_thread_new("mdrd-io", device_io_thread, NULL);
+}
+
+void device_io_deinit(void)
+{
+    device_command_t quit = {
+        .type = DEVICE_COMMAND_QUIT,
+    };
+
+    channel_send(commands, &quit);
+
+    g_thread_join(io_thread);
+
+    channel_free(commands);
+    channel_free(events);
+
+    reactor_free(reactor);
+
+    g_main_loop_unref(io_loop);
+    g_main_context_unref(io_context);
+}
+
+static gpointer device_io_thread(gpointer user_data)
+{
+    g_main_context_push_thread_default(io_context);
+
+    g_main_loop_run(io_loop);
+
+    g_main_context_pop_thread_default(io_context);
+
+    return NULL;
+}
+
+/*
+ * D-Bus thread
+ */
+
+device_io_t* device_io_connect(gint sock,
+                               void* owner,
+                               device_io_result_cb result_cb,
+                               void* user_data)
+{
+    device_io_t* io = g_new0(device_io_t, 1);
+
+    io->owner = owner;
+    io->flush_link.data = io;
+
+    device_command_t command = {
+        .type = DEVICE_COMMAND_CONNECT,
+        .value.connect.sock = sock,
+        .result_cb = result_cb,
+        .user_data = user_data,
+    };
+
+    device_io_submit(io, &command);
+
+    return io;
+}
+
+void device_io_disconnect(device_io_t* io)
+{
+    device_command_t command = {
+        .type = DEVICE_COMMAND_DISCONNECT,
+    };
+
+    device_io_submit(io, &command);
+}
+
+void device_io_submit(device_io_t* io, const device_command_t* command)
+{
+    device_command_t message = *command;
+
+    message.io = io;
+
+    channel_send(commands, &message);
+}
+
+static void device_io_handle_event(void* message, void* user_data)
+{
+    device_event_t* event = message;
+
+    if (event->result_cb != NULL)
+    {
+        event->result_cb(event, event->user_data);
+    }
+    else
+    {
+        event_cb(event);
+    }
+
+    device_value_clear(event->command, &event->value);
+}
+
+void device_value_clear(device_command_type_t command, device_value_t* value)
+{
+    switch (command)
+    {
+        case DEVICE_COMMAND_GET_MODEL_NAME:
+            g_free(value->model.name);
+            value->model.name = NULL;
+            break;
+
+        case DEVICE_COMMAND_GET_EQ_CAPABILITIES:
+            g_free(value->eq_capabilities.presets);
+            value->eq_capabilities.presets = NULL;
+            break;
+
+        case DEVICE_COMMAND_GET_EQ_PRESET_AND_LEVELS:
+        case DEVICE_COMMAND_SET_EQ_LEVELS:
+            g_free(value->eq_preset_and_levels.levels);
+            value->eq_preset_and_levels.levels = NULL;
+            break;
+
+        case DEVICE_COMMAND_GET_AVAILABLE_BUTTON_PRESETS:
+            for (int i = 0; i < value->available_button_presets.num_keys; i++)
+            {
+                mdr_packet_system_assignable_settings_capability_key_t* key
+                    = &value->available_button_presets.keys[i];
+
+                for (int j = 0; j < key->num_capability_presets; j++)
+                {
+                    g_free(key->capability_presets[j].capability_actions);
+                }
+
+                g_free(key->capability_presets);
+            }
+
+            g_free(value->available_button_presets.keys);
+            value->available_button_presets.keys = NULL;
+            break;
+
+        case DEVICE_COMMAND_GET_ACTIVE_BUTTON_PRESETS:
+        case DEVICE_COMMAND_SET_ACTIVE_BUTTON_PRESETS:
+            g_free(value->active_button_presets.presets);
+            value->active_button_presets.presets = NULL;
+            break;
+
+        case DEVICE_COMMAND_GET_IO_STATS:
+            if (value->io_stats.stats != NULL)
+            {
+                g_variant_unref(value->io_stats.stats);
+                value->io_stats.stats = NULL;
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+bool device_value_equal(device_command_type_t command,
+                        const device_value_t* a,
+                        const device_value_t* b)
+{
+    switch (command)
+    {
+        case DEVICE_COMMAND_GET_BATTERY:
+        case DEVICE_COMMAND_GET_CRADLE_BATTERY:
+            return a->battery.level == b->battery.level
+                && a->battery.charging == b->battery.charging;
+
+        case DEVICE_COMMAND_GET_LEFT_RIGHT_BATTERY:
+            return a->left_right_battery.left_level
+                    == b->left_right_battery.left_level
+                && a->left_right_battery.left_charging
+                    == b->left_right_battery.left_charging
+                && a->left_right_battery.right_level
+                    == b->left_right_battery.right_level
+                && a->left_right_battery.right_charging
+                    == b->left_right_battery.right_charging;
+
+        case DEVICE_COMMAND_GET_LEFT_RIGHT_CONNECTION_STATUS:
+            return a->left_right_connection_status.left_connected
+                    == b->left_right_connection_status.left_connected
+                && a->left_right_connection_status.right_connected
+                    == b->left_right_connection_status.right_connected;
+
+        case DEVICE_COMMAND_GET_NOISE_CANCELLING:
+            return a->noise_cancelling.enabled == b->noise_cancelling.enabled;
+
+        case DEVICE_COMMAND_GET_AMBIENT_SOUND_MODE:
+            return a->ambient_sound_mode.amount == b->ambient_sound_mode.amount
+                && a->ambient_sound_mode.voice == b->ambient_sound_mode.voice;
+
+        case DEVICE_COMMAND_GET_EQ_PRESET_AND_LEVELS:
+            return a->eq_preset_and_levels.preset_id
+                    == b->eq_preset_and_levels.preset_id
+                && a->eq_preset_and_levels.num_levels
+                    == b->eq_preset_and_levels.num_levels
+                && memcmp(a->eq_preset_and_levels.levels,
+                          b->eq_preset_and_levels.levels,
+                          a->eq_preset_and_levels.num_levels) == 0;
+
+        case DEVICE_COMMAND_GET_AUTO_POWER_OFF:
+            return a->auto_power_off.enabled == b->auto_power_off.enabled
+                && a->auto_power_off.timeout == b->auto_power_off.timeout;
+
+        case DEVICE_COMMAND_GET_ACTIVE_BUTTON_PRESETS:
+            return a->active_button_presets.num_presets
+                    == b->active_button_presets.num_presets
+                && memcmp(a->active_button_presets.presets,
+                          b->active_button_presets.presets,
+                          a->active_button_presets.num_presets
+                            * sizeof(*a->active_button_presets.presets))
+                    == 0;
+
+        case DEVICE_COMMAND_GET_VOLUME:
+            return a->playback.volume == b->playback.volume;
+
+        default:
+            return false;
+    }
+}
+
+void device_value_copy(device_command_type_t command,
+                       device_value_t* dst,
+                       const device_value_t* src)
+{
+    *dst = *src;
+
+    switch (command)
+    {
+        case DEVICE_COMMAND_GET_MODEL_NAME:
+            dst->model.name = g_strdup(src->model.name);
+            break;
+
+        case DEVICE_COMMAND_GET_EQ_CAPABILITIES:
+            dst->eq_capabilities.presets = g_memdup2(
+                    src->eq_capabilities.presets,
+                    src->eq_capabilities.num_presets
+                        * sizeof(*src->eq_capabilities.presets));
+            break;
+
+        case DEVICE_COMMAND_GET_EQ_PRESET_AND_LEVELS:
+        case DEVICE_COMMAND_SET_EQ_LEVELS:
+            dst->eq_preset_and_levels.levels = g_memdup2(
+                    src->eq_preset_and_levels.levels,
+                    src->eq_preset_and_levels.num_levels
+                        * sizeof(*src->eq_preset_and_levels.levels));
+            break;
+
+        case DEVICE_COMMAND_GET_AVAILABLE_BUTTON_PRESETS:
+            dst->available_button_presets.keys = g_memdup2(
+                    src->available_button_presets.keys,
+                    src->available_button_presets.num_keys
+                        * sizeof(*src->available_button_presets.keys));
+
+            for (int i = 0; i < src->available_button_presets.num_keys; i++)
+            {
+                mdr_packet_system_assignable_settings_capability_key_t* key
+                    = &dst->available_button_presets.keys[i];
+
+                key->capability_presets = g_memdup2(
+                        key->capability_presets,
+                        key->num_capability_presets
+                            * sizeof(*key->capability_presets));
+
+                for (int j = 0; j < key->num_capability_presets; j++)
+                {
+                    mdr_packet_system_assignable_settings_capability_preset_t*
+                        preset = &key->capability_presets[j];
+
+                    preset->capability_actions = g_memdup2(
+                            preset->capability_actions,
+                            preset->num_capability_actions
+                                * sizeof(*preset->capability_actions));
+                }
+            }
+            break;
+
+        case DEVICE_COMMAND_GET_ACTIVE_BUTTON_PRESETS:
+        case DEVICE_COMMAND_SET_ACTIVE_BUTTON_PRESETS:
+            dst->active_button_presets.presets = g_memdup2(
+                    src->active_button_presets.presets,
+                    src->active_button_presets.num_presets
+                        * sizeof(*src->active_button_presets.presets));
+            break;
+
+        case DEVICE_COMMAND_GET_IO_STATS:
+            g_variant_ref(dst->io_stats.stats);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*
+ * I/O thread
+ */
+
+static void device_io_send_event(device_event_type_t type,
+                                 device_command_type_t command,
+                                 void* owner,
+                                 const device_value_t* value,
+                                 device_io_result_cb result_cb,
+                                 void* user_data)
+{
+    device_event_t event;
+
+    memset(&event, 0, sizeof(event));
+
+    event.type = type;
+    event.command = command;
+    event.owner = owner;
+    event.result_cb = result_cb;
+    event.user_data = user_data;
+
+    if (value != NULL)
+    {
+        event.value = *value;
+    }
+
+    channel_send(events, &event);
+}
+
+static void device_io_pump(device_io_t* io);
+
+/*
+ * Sends `type` to everyone waiting on `request` and frees it.
+ */
+static void device_io_finish(device_io_request_t* request,
+                             device_event_type_t type,
+                             const device_value_t* value)
+{
+    request->superseded = g_slist_reverse(request->superseded);
+
+    for (GSList* item = request->superseded; item != NULL; item = item->next)
+    {
+        device_io_waiter_t* waiter = item->data;
+
+        device_io_send_event(type,
+                             request->command,
+                             request->owner,
+                             NULL,
+                             waiter->result_cb,
+                             waiter->user_data);
+    }
+
+    g_slist_free_full(request->superseded, g_free);
+
+    device_io_send_event(type,
+                         request->command,
+                         request->owner,
+                         value,
+                         request->result_cb,
+                         request->user_data);
+
+    free(request);
+}
+
+static void device_io_complete(device_io_request_t* request,
+                               device_event_type_t type,
+                               const device_value_t* value)
+{
+    device_io_t* io = request->io;
+
+    // Errors are not counted: libmdr reports timeouts the same way.
+    if (type == DEVICE_EVENT_RESULT)
+    {
+        io->stats.frames++;
+    }
+
+    device_io_finish(request, type, value);
+
+    io->in_flight--;
+
+    if (!io->closing)
+    {
+        device_io_pump(io);
+    }
+}
+
+static void device_io_update(device_io_t* io,
+                             device_command_type_t command,
+                             const device_value_t* value)
+{
+    io->stats.frames++;
+
+    device_io_send_event(DEVICE_EVENT_UPDATE,
+                         command,
+                         io->owner,
+                         value,
+                         NULL,
+                         NULL);
+}
+
+static void device_io_request_success(void* user_data)
+{
+    device_io_complete(user_data, DEVICE_EVENT_RESULT, NULL);
+}
+
+static void device_io_request_error(void* user_data)
+{
+    device_io_complete(user_data, DEVICE_EVENT_ERROR, NULL);
+}
+
+static void device_io_subscribe(device_io_t* io,
+                                device_command_type_t command);
+
+static void device_io_init_result(void* user_data)
+{
+    device_io_request_t* request = user_data;
+
+    device_value_t value = {
+        .model = {
+            .supported_functions = mdr_device_get_supported_functions(
+                    request->io->mdr_device),
+        },
+    };
+
+    device_io_complete(request, DEVICE_EVENT_RESULT, &value);
+}
+
+static void device_io_model_name_result(uint8_t len,
+                                        const uint8_t* name,
+                                        void* user_data)
+{
+    device_io_request_t* request = user_data;
+
+    device_value_t value = {
+        .model = {
+            .name = g_strndup((const gchar*) name, len),
+            .supported_functions = mdr_device_get_supported_functions(
+                    request->io->mdr_device),
+        },
+    };
+
+    device_io_complete(request, DEVICE_EVENT_RESULT, &value);
+}
+
+static device_value_t device_io_battery_value(uint8_t level, bool charging)
+{
+    device_value_t value = {
+        .battery = {
+            .level = level,
+            .charging = charging,
+        },
+    };
+
+    return value;
+}
+
+static void device_io_battery_result(uint8_t level,
+                                     bool charging,
+                                     void* user_data)
+{
+    device_io_request_t* request = user_data;
+    device_value_t value = device_io_battery_value(level, charging);
+
+    device_io_subscribe(request->io, request->command);
+    device_io_complete(request, DEVICE_EVENT_RESULT, &value);
+}
+
+static void device_io_battery_update(uint8_t level,
+                                     bool charging,
+                                     void* user_data)
+{
+    device_value_t value = device_io_battery_value(level, charging);
+
+    device_io_update(user_data, DEVICE_COMMAND_GET_BATTERY, &value);
+}
+
+static void device_io_cradle_battery_update(uint8_t level,
+                                            bool charging,
+                                            void* user_data)
+{
+    device_value_t value = device_io_battery_value(level, charging);
+
+    device_io_update(user_data, DEVICE_COMMAND_GET_CRADLE_BATTERY, &value);
+}
+
+static device_value_t device_io_left_right_battery_value(
+        uint8_t left_level,
+        bool left_charging,
+        uint8_t right_level,
+        bool right_charging)
+{
+    device_value_t value = {
+        .left_right_battery = {
+            .left_level = left_level,
+            .left_charging = left_charging,
+            .right_level = right_level,
+            .right_charging = right_charging,
+        },
+    };
+
+    return value;
+}
+
+static void device_io_left_right_battery_result(uint8_t left_level,
+                                                bool left_charging,
+                                                uint8_t right_level,
+                                                bool right_charging,
+                                                void* user_data)
+{
+    device_io_request_t* request = user_data;
+    device_value_t value = device_io_left_right_battery_value(
+            left_level, left_charging, right_level, right_charging);
+
+    device_io_subscribe(request->io, request->command);
+    device_io_complete(request, DEVICE_EVENT_RESULT, &value);
+}
+
+static void device_io_left_right_battery_update(uint8_t left_level,
+                                                bool left_charging,
+                                                uint8_t right_level,
+                                                bool right_charging,
+                                                void* user_data)
+{
+    device_value_t value = device_io_left_right_battery_value(
+            left_level, left_charging, right_level, right_charging);
+
+    device_io_update(user_data,
+                     DEVICE_COMMAND_GET_LEFT_RIGHT_BATTERY,
+                     &value);
+}
+
+static device_value_t device_io_left_right_connection_status_value(
+        bool left_connected,
+        bool right_connected)
+{
+    device_value_t value = {
+        .left_right_connection_status = {
+            .left_connected = left_connected,
+            .right_connected = right_connected,
+        },
+    };
+
+    return value;
+}
+
+static void device_io_left_right_connection_status_result(
+        bool left_connected,
+        bool right_connected,
+        void* user_data)
+{
+    device_io_request_t* request = user_data;
+    device_value_t value = device_io_left_right_connection_status_value(
+            left_connected, right_connected);
+
+    device_io_subscribe(request->io, request->command);
+    device_io_complete(request, DEVICE_EVENT_RESULT, &value);
+}
+
+static void device_io_left_right_connection_status_update(
+        bool left_connected,
+        bool right_connected,
+        void* user_data)
+{
+    device_value_t value = device_io_left_right_connection_status_value(
+            left_connected, right_connected);
+
+    device_io_update(user_data,
+                     DEVICE_COMMAND_GET_LEFT_RIGHT_CONNECTION_STATUS,
+                     &value);
+}
+
+static void device_io_noise_cancelling_result(bool enabled, void* user_data)
+{
+    device_io_request_t* request = user_data;
+    device_value_t value = { .noise_cancelling = { .enabled = enabled } };
+
+    device_io_subscribe(request->io, request->command);
+    device_io_complete(request, DEVICE_EVENT_RESULT, &value);
+}
+
+static void device_io_noise_cancelling_update(bool enabled, void* user_data)
+{
+    device_value_t value = { .noise_cancelling = { .enabled = enabled } };
+
+    device_io_update(user_data, DEVICE_COMMAND_GET_NOISE_CANCELLING, &value);
+}
+
+static device_value_t device_io_ambient_sound_mode_value(uint8_t amount,
+                                                         bool voice)
+{
+    device_value_t value = {
+        .ambient_sound_mode = {
+            .amount = amount,
+            .voice = voice,
+        },
+    };
+
+    return value;
+}
+
+static void device_io_ambient_sound_mode_result(uint8_t amount,
+                                                bool voice,
+                                                void* user_data)
+{
+    device_io_request_t* request = user_data;
+    device_value_t value = device_io_ambient_sound_mode_value(amount, voice);
+
+    device_io_subscribe(request->io, request->command);
+    device_io_complete(request, DEVICE_EVENT_RESULT, &value);
+}
+
+static void device_io_ambient_sound_mode_update(uint8_t amount,
+                                                bool voice,
+                                                void* user_data)
+{
+    device_value_t value = device_io_ambient_sound_mode_value(amount, voice);
+
+    device_io_update(user_data, DEVICE_COMMAND_GET_AMBIENT_SOUND_MODE, &value);
+}
+
+static void device_io_eq_capabilities_result(
+        uint8_t band_count,
+        uint8_t level_steps,
+        uint8_t num_presets,
+        mdr_packet_eqebb_eq_preset_id_t* presets,
+        void* user_data)
+{
+    device_io_request_t* request = user_data;
+
+    mdr_packet_eqebb_eq_preset_id_t* presets_copy
+        = g_new(mdr_packet_eqebb_eq_preset_id_t, num_presets);
+    memcpy(presets_copy,
+           presets,
+           num_presets * sizeof(mdr_packet_eqebb_eq_preset_id_t));
+
+    device_value_t value = {
+        .eq_capabilities = {
+            .band_count = band_count,
+            .level_steps = level_steps,
+            .num_presets = num_presets,
+            .presets = presets_copy,
+        },
+    };
+
+    device_io_complete(request, DEVICE_EVENT_RESULT, &value);
+}
+
+static device_value_t device_io_eq_preset_and_levels_value(
+        mdr_packet_eqebb_eq_preset_id_t preset_id,
+        uint8_t num_levels,
+        uint8_t* levels)
+{
+    uint8_t* levels_copy = g_new(uint8_t, num_levels);
+    memcpy(levels_copy, levels, num_levels);
+
+    device_value_t value = {
+        .eq_preset_and_levels = {
+            .preset_id = preset_id,
+            .num_levels = num_levels,
+            .levels = levels_copy,
+        },
+    };
+
+    return value;
+}
+
+static void device_io_eq_preset_and_levels_result(
+        mdr_packet_eqebb_eq_preset_id_t preset_id,
+        uint8_t num_levels,
+        uint8_t* levels,
+        void* user_data)
+{
+    device_io_request_t* request = user_data;
+    device_value_t value = device_io_eq_preset_and_levels_value(
+            preset_id, num_levels, levels);
+
+    device_io_subscribe(request->io, request->command);
+    device_io_complete(request, DEVICE_EVENT_RESULT, &value);
+}
+
+static void device_io_eq_preset_and_levels_update(
+        mdr_packet_eqebb_eq_preset_id_t preset_id,
+        uint8_t num_levels,
+        uint8_t* levels,
+        void* user_data)
+{
+    device_value_t value = device_io_eq_preset_and_levels_value(
+            preset_id, num_levels, levels);
+
+    device_io_update(user_data,
+                     DEVICE_COMMAND_GET_EQ_PRESET_AND_LEVELS,
+                     &value);
+}
+
+static device_value_t device_io_auto_power_off_value(
+        bool enabled,
+        mdr_packet_system_auto_power_off_element_id_t timeout)
+{
+    device_value_t value = {
+        .auto_power_off = {
+            .enabled = enabled,
+            .timeout = timeout,
+        },
+    };
+
+    return value;
+}
+
+static void device_io_auto_power_off_result(
+        bool enabled,
+        mdr_packet_system_auto_power_off_element_id_t timeout,
+        void* user_data)
+{
+    device_io_request_t* request = user_data;
+    device_value_t value = device_io_auto_power_off_value(enabled, timeout);
+
+    device_io_subscribe(request->io, request->command);
+    device_io_complete(request, DEVICE_EVENT_RESULT, &value);
+}
+
+static void device_io_auto_power_off_update(
+        bool enabled,
+        mdr_packet_system_auto_power_off_element_id_t timeout,
+        void* user_data)
+{
+    device_value_t value = device_io_auto_power_off_value(enabled, timeout);
+
+    device_io_update(user_data, DEVICE_COMMAND_GET_AUTO_POWER_OFF, &value);
+}
+
+static void device_io_available_button_presets_result(
+        uint8_t num_keys,
+        mdr_packet_system_assignable_settings_capability_key_t* keys,
+        void* user_data)
+{
+    device_io_request_t* request = user_data;
+
+    mdr_packet_system_assignable_settings_capability_key_t* keys_copy
+        = g_new(mdr_packet_system_assignable_settings_capability_key_t,
+                num_keys);
+
+    for (int i = 0; i < num_keys; i++)
+    {
+        keys_copy[i] = keys[i];
+        keys_copy[i].capability_presets
+            = g_new(mdr_packet_system_assignable_settings_capability_preset_t,
+                    keys[i].num_capability_presets);
+
+        for (int j = 0; j < keys[i].num_capability_presets; j++)
+        {
+            mdr_packet_system_assignable_settings_capability_preset_t* preset
+                = &keys_copy[i].capability_presets[j];
+
+            *preset = keys[i].capability_presets[j];
+            preset->capability_actions
+                = g_new(mdr_packet_system_assignable_settings_capability_action_t,
+                        preset->num_capability_actions);
+            memcpy(preset->capability_actions,
+                   keys[i].capability_presets[j].capability_actions,
+                   preset->num_capability_actions
+                       * sizeof(mdr_packet_system_assignable_settings_capability_action_t));
+        }
+    }
+
+    device_value_t value = {
+        .available_button_presets = {
+            .num_keys = num_keys,
+            .keys = keys_copy,
+        },
+    };
+
+    device_io_complete(request, DEVICE_EVENT_RESULT, &value);
+}
+
+static device_value_t device_io_active_button_presets_value(
+        uint8_t num_presets,
+        mdr_packet_system_assignable_settings_preset_t* presets)
+{
+    mdr_packet_system_assignable_settings_preset_t* presets_copy
+        = g_new(mdr_packet_system_assignable_settings_preset_t, num_presets);
+    memcpy(presets_copy,
+           presets,
+           num_presets * sizeof(mdr_packet_system_assignable_settings_preset_t));
+
+    device_value_t value = {
+        .active_button_presets = {
+            .num_presets = num_presets,
+            .presets = presets_copy,
+        },
+    };
+
+    return value;
+}
+
+static void device_io_active_button_presets_result(
+        uint8_t num_presets,
+        mdr_packet_system_assignable_settings_preset_t* presets,
+        void* user_data)
+{
+    device_io_request_t* request = user_data;
+    device_value_t value = device_io_active_button_presets_value(
+            num_presets, presets);
+
+    device_io_subscribe(request->io, request->command);
+    device_io_complete(request, DEVICE_EVENT_RESULT, &value);
+}
+
+static void device_io_active_button_presets_update(
+        uint8_t num_presets,
+        mdr_packet_system_assignable_settings_preset_t* presets,
+        void* user_data)
+{
+    device_value_t value = device_io_active_button_presets_value(
+            num_presets, presets);
+
+    device_io_update(user_data,
+                     DEVICE_COMMAND_GET_ACTIVE_BUTTON_PRESETS,
+                     &value);
+}
+
+static void device_io_volume_result(uint8_t volume, void* user_data)
+{
+    device_io_request_t* request = user_data;
+    device_value_t value = { .playback = { .volume = volume } };
+
+    device_io_subscribe(request->io, request->command);
+    device_io_complete(request, DEVICE_EVENT_RESULT, &value);
+}
+
+static void device_io_volume_update(uint8_t volume, void* user_data)
+{
+    device_value_t value = { .playback = { .volume = volume } };
+
+    device_io_update(user_data, DEVICE_COMMAND_GET_VOLUME, &value);
+}
+
+/*
+ * Subscribes to notifications for the value returned by `command`, once
+ * per connection.
+ */
+static void device_io_subscribe(device_io_t* io,
+                                device_command_type_t command)
+{
+    if (io->subscriptions & (1u << command))
+    {
+        return;
+    }
+
+    io->subscriptions |= 1u << command;
+
+    mdr_device_t* mdr_device = io->mdr_device;
+
+    switch (command)
+    {
+        case DEVICE_COMMAND_GET_BATTERY:
+            mdr_device_subscribe_battery_level(
+                    mdr_device,
+                    device_io_battery_update,
+                    io);
+            break;
+
+        case DEVICE_COMMAND_GET_LEFT_RIGHT_BATTERY:
+            mdr_device_subscribe_left_right_battery_level(
+                    mdr_device,
+                    device_io_left_right_battery_update,
+                    io);
+            break;
+
+        case DEVICE_COMMAND_GET_CRADLE_BATTERY:
+            mdr_device_subscribe_cradle_battery_level(
+                    mdr_device,
+                    device_io_cradle_battery_update,
+                    io);
+            break;
+
+        case DEVICE_COMMAND_GET_LEFT_RIGHT_CONNECTION_STATUS:
+            mdr_device_subscribe_left_right_connection_status(
+                    mdr_device,
+                    device_io_left_right_connection_status_update,
+                    io);
+            break;
+
+        case DEVICE_COMMAND_GET_NOISE_CANCELLING:
+            mdr_device_subscribe_noise_cancelling_enabled(
+                    mdr_device,
+                    device_io_noise_cancelling_update,
+                    io);
+            break;
+
+        case DEVICE_COMMAND_GET_AMBIENT_SOUND_MODE:
+            mdr_device_subscribe_ambient_sound_mode_settings(
+                    mdr_device,
+                    device_io_ambient_sound_mode_update,
+                    io);
+            break;
+
+        case DEVICE_COMMAND_GET_EQ_PRESET_AND_LEVELS:
+            mdr_device_subscribe_eq_preset_and_levels(
+                    mdr_device,
+                    device_io_eq_preset_and_levels_update,
+                    io);
+            break;
+
+        case DEVICE_COMMAND_GET_AUTO_POWER_OFF:
+            mdr_device_setting_subscribe_auto_power_off(
+                    mdr_device,
+                    device_io_auto_power_off_update,
+                    io);
+            break;
+
+        case DEVICE_COMMAND_GET_ACTIVE_BUTTON_PRESETS:
+            mdr_device_setting_subscribe_active_button_presets(
+                    mdr_device,
+                    device_io_active_button_presets_update,
+                    io);
+            break;
+
+        case DEVICE_COMMAND_GET_VOLUME:
+            mdr_device_playback_subscribe_volume(
+                    mdr_device,
+                    device_io_volume_update,
+                    io);
+            break;
+
+        default:
+            break;
+    }
+}
+
+static int device_io_issue(mdr_device_t* mdr_device,
+                           device_io_request_t* request)
+{
+    device_value_t* value = &request->value;
+
+    switch (request->command)
+    {
+        case DEVICE_COMMAND_INIT:
+            return mdr_device_init(
+                    mdr_device,
+                    device_io_init_result,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_GET_MODEL_NAME:
+            return mdr_device_get_model_name(
+                    mdr_device,
+                    device_io_model_name_result,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_POWER_OFF:
+            return mdr_device_power_off(
+                    mdr_device,
+                    device_io_request_success,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_GET_BATTERY:
+            return mdr_device_get_battery_level(
+                    mdr_device,
+                    device_io_battery_result,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_GET_LEFT_RIGHT_BATTERY:
+            return mdr_device_get_left_right_battery_level(
+                    mdr_device,
+                    device_io_left_right_battery_result,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_GET_CRADLE_BATTERY:
+            return mdr_device_get_cradle_battery_level(
+                    mdr_device,
+                    device_io_battery_result,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_GET_LEFT_RIGHT_CONNECTION_STATUS:
+            return mdr_device_get_left_right_connection_status(
+                    mdr_device,
+                    device_io_left_right_connection_status_result,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_GET_NOISE_CANCELLING:
+            return mdr_device_get_noise_cancelling_enabled(
+                    mdr_device,
+                    device_io_noise_cancelling_result,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_ENABLE_NOISE_CANCELLING:
+            return mdr_device_enable_noise_cancelling(
+                    mdr_device,
+                    device_io_request_success,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_DISABLE_NCASM:
+            return mdr_device_disable_ncasm(
+                    mdr_device,
+                    device_io_request_success,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_GET_AMBIENT_SOUND_MODE:
+            return mdr_device_get_ambient_sound_mode_settings(
+                    mdr_device,
+                    device_io_ambient_sound_mode_result,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_ENABLE_AMBIENT_SOUND_MODE:
+            return mdr_device_enable_ambient_sound_mode(
+                    mdr_device,
+                    value->ambient_sound_mode.amount,
+                    value->ambient_sound_mode.voice,
+                    device_io_request_success,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_GET_EQ_CAPABILITIES:
+            return mdr_device_get_eq_capabilities(
+                    mdr_device,
+                    device_io_eq_capabilities_result,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_GET_EQ_PRESET_AND_LEVELS:
+            return mdr_device_get_eq_preset_and_levels(
+                    mdr_device,
+                    device_io_eq_preset_and_levels_result,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_SET_EQ_PRESET:
+            return mdr_device_set_eq_preset(
+                    mdr_device,
+                    value->eq_preset_and_levels.preset_id,
+                    device_io_request_success,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_SET_EQ_LEVELS:
+            return mdr_device_set_eq_levels(
+                    mdr_device,
+                    value->eq_preset_and_levels.num_levels,
+                    value->eq_preset_and_levels.levels,
+                    device_io_request_success,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_GET_AUTO_POWER_OFF:
+            return mdr_device_setting_get_auto_power_off(
+                    mdr_device,
+                    device_io_auto_power_off_result,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_ENABLE_AUTO_POWER_OFF:
+            return mdr_device_setting_enable_auto_power_off(
+                    mdr_device,
+                    value->auto_power_off.timeout,
+                    device_io_request_success,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_DISABLE_AUTO_POWER_OFF:
+            return mdr_device_setting_disable_auto_power_off(
+                    mdr_device,
+                    device_io_request_success,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_GET_AVAILABLE_BUTTON_PRESETS:
+            return mdr_device_setting_get_available_button_presets(
+                    mdr_device,
+                    device_io_available_button_presets_result,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_GET_ACTIVE_BUTTON_PRESETS:
+            return mdr_device_setting_get_active_button_presets(
+                    mdr_device,
+                    device_io_active_button_presets_result,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_SET_ACTIVE_BUTTON_PRESETS:
+            return mdr_device_setting_set_active_button_presets(
+                    mdr_device,
+                    value->active_button_presets.num_presets,
+                    value->active_button_presets.presets,
+                    device_io_request_success,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_GET_VOLUME:
+            return mdr_device_playback_get_volume(
+                    mdr_device,
+                    device_io_volume_result,
+                    device_io_request_error,
+                    request);
+
+        case DEVICE_COMMAND_SET_VOLUME:
+            return mdr_device_playback_set_volume(
+                    mdr_device,
+                    value->playback.volume,
+                    device_io_request_success,
+                    device_io_request_error,
+                    request);
+
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+}
+
+static void device_io_fail_queued(device_io_t* io);
+
+static void device_io_flush(device_io_t* io);
+
+static mdr_poll_info device_io_poll(void* user_data)
+{
+    device_io_t* io = user_data;
+
+    return mdr_device_poll_info(io->mdr_device);
+}
+
+static void device_io_ready(GIOCondition condition, void* user_data)
+{
+    device_io_t* io = user_data;
+
+    if ((condition & G_IO_HUP) != 0)
+    {
+        // Stop polling; the connection is closed once the D-Bus side
+        // disconnects it.
+        reactor_remove(reactor, io->reactor_entry);
+        io->reactor_entry = NULL;
+
+        device_io_fail_queued(io);
+
+        device_io_send_event(DEVICE_EVENT_HANGUP,
+                             DEVICE_COMMAND_DISCONNECT,
+                             io->owner,
+                             NULL,
+                             NULL,
+                             NULL);
+        return;
+    }
+
+    bool readable = (condition & G_IO_IN) != 0;
+    bool writable = (condition & G_IO_OUT) != 0;
+
+    // Timeouts dispatch with no condition and do no I/O.
+    if (readable || writable)
+    {
+        io->stats.dispatches++;
+    }
+
+    // libmdr reads at most once per call, so keep going while the kernel
+    // still holds data instead of waiting for another wakeup per read.
+    for (int i = 0; i < DEVICE_IO_MAX_READS_PER_DISPATCH; i++)
+    {
+        io->stats.syscalls += readable + writable;
+
+        if (mdr_device_process_by_availability(io->mdr_device,
+                                               readable,
+                                               writable) < 0)
+        {
+            break;
+        }
+
+        int pending = 0;
+
+        if (!readable)
+        {
+            break;
+        }
+
+        io->stats.syscalls++;
+
+        if (ioctl(io->sock, FIONREAD, &pending) < 0 || pending <= 0)
+        {
+            break;
+        }
+
+        writable = false;
+    }
+
+    // Send whatever the completions above let the scheduler issue.
+    if (io->flush_pending)
+    {
+        device_io_flush(io);
+    }
+}
+
+static const char* device_io_class_names[DEVICE_IO_NUM_CLASSES] = {
+    [DEVICE_IO_CLASS_INTERACTIVE] = "interactive",
+    [DEVICE_IO_CLASS_STATE_SYNC] = "state-sync",
+    [DEVICE_IO_CLASS_BACKGROUND] = "background",
+};
+
+/*
+ * Builds the result of DEVICE_COMMAND_GET_IO_STATS.
+ */
+static GVariant* device_io_stats_variant(device_io_t* io)
+{
+    GVariantBuilder builder;
+    GVariantBuilder entry;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sa{st}}"));
+
+    for (int class = 0; class < DEVICE_IO_NUM_CLASSES; class++)
+    {
+        device_io_class_stats_t* class_stats = &io->class_stats[class];
+
+        g_variant_builder_init(&entry, G_VARIANT_TYPE("a{st}"));
+        g_variant_builder_add(&entry, "{st}", "issued",
+                              class_stats->issued);
+        g_variant_builder_add(&entry, "{st}", "coalesced",
+                              class_stats->coalesced);
+        g_variant_builder_add(&entry, "{st}", "depth",
+                              (guint64) io->queues[class].length);
+        g_variant_builder_add(&entry, "{st}", "max_depth",
+                              (guint64) class_stats->max_depth);
+        g_variant_builder_add(&entry, "{st}", "total_wait_us",
+                              (guint64) class_stats->total_wait);
+        g_variant_builder_add(&entry, "{st}", "max_wait_us",
+                              (guint64) class_stats->max_wait);
+
+        g_variant_builder_add(&builder, "{sa{st}}",
+                              device_io_class_names[class],
+                              &entry);
+    }
+
+    g_variant_builder_init(&entry, G_VARIANT_TYPE("a{st}"));
+    g_variant_builder_add(&entry, "{st}", "dispatches",
+                          io->stats.dispatches);
+    g_variant_builder_add(&entry, "{st}", "syscalls", io->stats.syscalls);
+    g_variant_builder_add(&entry, "{st}", "frames", io->stats.frames);
+
+    g_variant_builder_add(&builder, "{sa{st}}", "connection", &entry);
+
+    return g_variant_ref_sink(g_variant_builder_end(&builder));
+}
+
+static void device_io_log_stats(device_io_t* io)
+{
+    device_io_stats_t* stats = &io->stats;
+
+    g_debug("Device I/O on fd %d: %" G_GUINT64_FORMAT " dispatches, "
+            "%" G_GUINT64_FORMAT " syscalls, %" G_GUINT64_FORMAT " frames "
+            "(%.2f frames/dispatch, %.2f syscalls/frame)",
+            io->sock,
+            stats->dispatches,
+            stats->syscalls,
+            stats->frames,
+            stats->dispatches > 0
+                ? (double) stats->frames / stats->dispatches : 0.0,
+            stats->frames > 0
+                ? (double) stats->syscalls / stats->frames : 0.0);
+
+    for (int class = 0; class < DEVICE_IO_NUM_CLASSES; class++)
+    {
+        device_io_class_stats_t* class_stats = &io->class_stats[class];
+
+        g_debug("Device I/O on fd %d, %s: %" G_GUINT64_FORMAT " commands, "
+                "%" G_GUINT64_FORMAT " coalesced, "
+                "max queue depth %u, wait avg %" G_GINT64_FORMAT " µs, "
+                "max %" G_GINT64_FORMAT " µs",
+                io->sock,
+                device_io_class_names[class],
+                class_stats->issued,
+                class_stats->coalesced,
+                class_stats->max_depth,
+                class_stats->issued > 0
+                    ? class_stats->total_wait / (gint64) class_stats->issued
+                    : 0,
+                class_stats->max_wait);
+    }
+}
+
+static void device_io_handle_connect(device_io_t* io,
+                                     device_command_t* command)
+{
+    io->sock = command->value.connect.sock;
+    io->mdr_device = mdr_device_new_from_sock(io->sock);
+
+    if (io->mdr_device != NULL)
+    {
+        io->reactor_entry = reactor_add(reactor,
+                                        io->sock,
+                                        device_io_poll,
+                                        device_io_ready,
+                                        io);
+
+        if (io->reactor_entry == NULL)
+        {
+            mdr_device_close(io->mdr_device);
+            io->mdr_device = NULL;
+        }
+    }
+
+    device_io_send_event(io->mdr_device != NULL
+                            ? DEVICE_EVENT_RESULT
+                            : DEVICE_EVENT_ERROR,
+                         DEVICE_COMMAND_CONNECT,
+                         io->owner,
+                         NULL,
+                         command->result_cb,
+                         command->user_data);
+
+    if (io->mdr_device == NULL)
+    {
+        g_free(io);
+    }
+}
+
+static void device_io_fail_queued(device_io_t* io)
+{
+    for (int class = 0; class < DEVICE_IO_NUM_CLASSES; class++)
+    {
+        GList* link;
+
+        while ((link = g_queue_pop_head_link(&io->queues[class])) != NULL)
+        {
+            device_io_request_t* request = link->data;
+
+            device_value_clear(request->command, &request->value);
+            device_io_finish(request, DEVICE_EVENT_ERROR, NULL);
+        }
+    }
+}
+
+static void device_io_handle_disconnect(device_io_t* io)
+{
+    io->closing = true;
+
+    if (io->flush_pending)
+    {
+        g_queue_unlink(&flush_queue, &io->flush_link);
+    }
+
+    if (io->reactor_entry != NULL)
+    {
+        reactor_remove(reactor, io->reactor_entry);
+    }
+
+    device_io_fail_queued(io);
+
+    device_io_log_stats(io);
+
+    mdr_device_close(io->mdr_device);
+
+    device_io_send_event(DEVICE_EVENT_CLOSED,
+                         DEVICE_COMMAND_DISCONNECT,
+                         io->owner,
+                         NULL,
+                         NULL,
+                         NULL);
+
+    g_free(io);
+}
+
+static device_io_class_t device_io_command_class(device_command_type_t type)
+{
+    switch (type)
+    {
+        case DEVICE_COMMAND_POWER_OFF:
+        case DEVICE_COMMAND_ENABLE_NOISE_CANCELLING:
+        case DEVICE_COMMAND_DISABLE_NCASM:
+        case DEVICE_COMMAND_ENABLE_AMBIENT_SOUND_MODE:
+        case DEVICE_COMMAND_SET_EQ_PRESET:
+        case DEVICE_COMMAND_SET_EQ_LEVELS:
+        case DEVICE_COMMAND_ENABLE_AUTO_POWER_OFF:
+        case DEVICE_COMMAND_DISABLE_AUTO_POWER_OFF:
+        case DEVICE_COMMAND_SET_ACTIVE_BUTTON_PRESETS:
+        case DEVICE_COMMAND_SET_VOLUME:
+            return DEVICE_IO_CLASS_INTERACTIVE;
+
+        case DEVICE_COMMAND_GET_EQ_CAPABILITIES:
+        case DEVICE_COMMAND_GET_AVAILABLE_BUTTON_PRESETS:
+            return DEVICE_IO_CLASS_BACKGROUND;
+
+        default:
+            return DEVICE_IO_CLASS_STATE_SYNC;
+    }
+}
+
+/*
+ * Setters for properties that are typically dragged through many values,
+ * where only the last one matters.
+ */
+static bool device_io_command_coalescible(device_command_type_t type)
+{
+    switch (type)
+    {
+        case DEVICE_COMMAND_ENABLE_AMBIENT_SOUND_MODE:
+        case DEVICE_COMMAND_SET_EQ_LEVELS:
+        case DEVICE_COMMAND_SET_VOLUME:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/*
+ * Returns the group of device state `type` changes, or -1 if it changes
+ * none that another setter also changes. Setters of one group must not be
+ * reordered.
+ */
+static int device_io_command_group(device_command_type_t type)
+{
+    switch (type)
+    {
+        case DEVICE_COMMAND_ENABLE_NOISE_CANCELLING:
+        case DEVICE_COMMAND_DISABLE_NCASM:
+        case DEVICE_COMMAND_ENABLE_AMBIENT_SOUND_MODE:
+            return 0;
+
+        case DEVICE_COMMAND_SET_EQ_PRESET:
+        case DEVICE_COMMAND_SET_EQ_LEVELS:
+            return 1;
+
+        default:
+            return -1;
+    }
+}
+
+/*
+ * Replaces the value of a queued (not yet issued) request of the same type
+ * with the one in `command`, unless a later queued request changes the
+ * same state; the new value would then overtake it.
+ *
+ * Returns false if there is no such request.
+ */
+static bool device_io_coalesce(device_io_t* io, device_command_t* command)
+{
+    if (!device_io_command_coalescible(command->type))
+    {
+        return false;
+    }
+
+    device_io_class_t class = device_io_command_class(command->type);
+
+    for (GList* link = io->queues[class].tail; link != NULL; link = link->prev)
+    {
+        device_io_request_t* request = link->data;
+
+        if (request->command != command->type)
+        {
+            int group = device_io_command_group(command->type);
+
+            if (group >= 0
+                    && device_io_command_group(request->command) == group)
+            {
+                return false;
+            }
+
+            continue;
+        }
+
+        device_io_waiter_t* waiter = g_new(device_io_waiter_t, 1);
+
+        waiter->result_cb = request->result_cb;
+        waiter->user_data = request->user_data;
+        request->superseded = g_slist_prepend(request->superseded, waiter);
+
+        device_value_clear(request->command, &request->value);
+
+        request->value = command->value;
+        request->result_cb = command->result_cb;
+        request->user_data = command->user_data;
+
+        io->class_stats[class].coalesced++;
+
+        return true;
+    }
+
+    return false;
+}
+
+static void device_io_schedule_flush(device_io_t* io)
+{
+    if (!io->flush_pending)
+    {
+        io->flush_pending = true;
+        g_queue_push_tail_link(&flush_queue, &io->flush_link);
+    }
+}
+
+/*
+ * Hands queued requests to libmdr, highest class first, while fewer than
+ * DEVICE_IO_MAX_IN_FLIGHT are outstanding.
+ */
+static void device_io_pump(device_io_t* io)
+{
+    // Requests failing synchronously complete (and pump) from within the
+    // loop below.
+    if (io->pumping)
+    {
+        return;
+    }
+
+    io->pumping = true;
+
+    while (io->in_flight < DEVICE_IO_MAX_IN_FLIGHT)
+    {
+        device_io_request_t* request = NULL;
+
+        for (int class = 0; class < DEVICE_IO_NUM_CLASSES; class++)
+        {
+            GList* link = g_queue_pop_head_link(&io->queues[class]);
+
+            if (link != NULL)
+            {
+                request = link->data;
+                break;
+            }
+        }
+
+        if (request == NULL)
+        {
+            break;
+        }
+
+        device_io_class_stats_t* stats = &io->class_stats[request->class];
+        gint64 wait = g_get_monotonic_time() - request->queued_at;
+
+        stats->issued++;
+        stats->total_wait += wait;
+        stats->max_wait = MAX(stats->max_wait, wait);
+
+        io->in_flight++;
+
+        // The request may be gone once issued.
+        device_command_type_t command = request->command;
+        device_value_t value = request->value;
+
+        if (device_io_issue(io->mdr_device, request) < 0)
+        {
+            g_warning("Device command %d failed: %d", command, errno);
+
+            device_io_request_error(request);
+        }
+
+        device_value_clear(command, &value);
+
+        device_io_schedule_flush(io);
+    }
+
+    io->pumping = false;
+}
+
+static void device_io_handle_command(void* message, void* user_data)
+{
+    device_command_t* command = message;
+    device_io_t* io = command->io;
+
+    switch (command->type)
+    {
+        case DEVICE_COMMAND_CONNECT:
+            device_io_handle_connect(io, command);
+            return;
+
+        case DEVICE_COMMAND_DISCONNECT:
+            device_io_handle_disconnect(io);
+            return;
+
+        case DEVICE_COMMAND_QUIT:
+            g_main_loop_quit(io_loop);
+            return;
+
+        case DEVICE_COMMAND_GET_IO_STATS:
+        {
+            device_value_t value = {
+                .io_stats.stats = device_io_stats_variant(io),
+            };
+
+            device_io_send_event(DEVICE_EVENT_RESULT,
+                                 command->type,
+                                 io->owner,
+                                 &value,
+                                 command->result_cb,
+                                 command->user_data);
+            return;
+        }
+
+        default:
+            break;
+    }
+
+    if (io->reactor_entry == NULL)
+    {
+        // Hung up, waiting to be disconnected.
+        device_io_send_event(DEVICE_EVENT_ERROR,
+                             command->type,
+                             io->owner,
+                             NULL,
+                             command->result_cb,
+                             command->user_data);
+
+        device_value_clear(command->type, &command->value);
+        return;
+    }
+
+    if (device_io_coalesce(io, command))
+    {
+        return;
+    }
+
+    device_io_request_t* request = malloc(sizeof(device_io_request_t));
+    if (request == NULL)
+    {
+        g_error("Out of memory");
+    }
+
+    request->io = io;
+    request->owner = io->owner;
+    request->command = command->type;
+    request->value = command->value;
+    request->result_cb = command->result_cb;
+    request->user_data = command->user_data;
+    request->class = device_io_command_class(command->type);
+    request->queued_at = g_get_monotonic_time();
+    request->link.data = request;
+    request->superseded = NULL;
+
+    GQueue* queue = &io->queues[request->class];
+
+    g_queue_push_tail_link(queue, &request->link);
+
+    io->class_stats[request->class].max_depth
+        = MAX(io->class_stats[request->class].max_depth, queue->length);
+
+    device_io_pump(io);
+}
+
+/*
+ * Writes out whatever libmdr has queued right away instead of waiting for
+ * the socket to be reported writable. Write interest is then only armed
+ * for the (rare) devices that could not take all of it.
+ */
+static void device_io_flush(device_io_t* io)
+{
+    if (io->flush_pending)
+    {
+        g_queue_unlink(&flush_queue, &io->flush_link);
+        io->flush_pending = false;
+    }
+
+    if (io->reactor_entry == NULL)
+    {
+        return;
+    }
+
+    if (mdr_device_poll_info(io->mdr_device).write)
+    {
+        io->stats.syscalls++;
+        mdr_device_process_by_availability(io->mdr_device, false, true);
+    }
+
+    reactor_invalidate(reactor, io->reactor_entry);
+}
+
+/*
+ * Flushes every device that was sent commands in the last batch, once.
+ */
+static void device_io_handle_commands_drained(void* user_data)
+{
+    GList* link;
+
+    while ((link = flush_queue.head) != NULL)
+    {
+        device_io_flush(link->data);
+    }
+}
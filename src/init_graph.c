@@ -0,0 +1,224 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "init_graph.h"
+
+struct init_graph
+{
+    const init_phase_t* phases;
+    guint num_phases;
+
+    guint32 started;
+    guint32 succeeded;
+    guint32 finished;
+    guint32 disabled;
+
+    bool scheduling;
+    bool rescan;
+
+    gint64 created_at;
+    gint64 started_at[INIT_GRAPH_MAX_PHASES];
+    gint64 finished_at[INIT_GRAPH_MAX_PHASES];
+
+    init_graph_done_cb done_cb;
+    void* user_data;
+};
+
+init_graph_t* init_graph_new(const init_phase_t* phases,
+                             guint num_phases,
+                             init_graph_done_cb done_cb,
+                             void* user_data)
+{
+    g_return_val_if_fail(num_phases <= INIT_GRAPH_MAX_PHASES, NULL);
+
+    init_graph_t* graph = g_new0(init_graph_t, 1);
+
+    graph->phases = phases;
+    graph->num_phases = num_phases;
+
+    graph->created_at = g_get_monotonic_time();
+
+    graph->done_cb = done_cb;
+    graph->user_data = user_data;
+
+    return graph;
+}
+
+void init_graph_free(init_graph_t* graph)
+{
+    g_free(graph);
+}
+
+static guint32 init_graph_all(const init_graph_t* graph)
+{
+    return graph->num_phases == 32
+        ? G_MAXUINT32
+        : INIT_PHASE(graph->num_phases) - 1;
+}
+
+/*
+ * Starts or skips every phase whose dependencies have been resolved.
+ *
+ * Phases may finish from within their start callback, which re-enters here;
+ * that is turned into another pass of the outer loop instead of recursing.
+ */
+static void init_graph_schedule(init_graph_t* graph)
+{
+    if (graph->scheduling)
+    {
+        graph->rescan = true;
+        return;
+    }
+
+    graph->scheduling = true;
+
+    do
+    {
+        graph->rescan = false;
+
+        for (guint phase = 0; phase < graph->num_phases; phase++)
+        {
+            guint32 bit = INIT_PHASE(phase);
+            guint32 after = graph->phases[phase].after;
+
+            if ((graph->started | graph->finished) & bit)
+            {
+                continue;
+            }
+
+            if (after & graph->finished & ~graph->succeeded)
+            {
+                graph->finished |= bit;
+                graph->rescan = true;
+                continue;
+            }
+
+            if ((after & graph->succeeded) != after)
+            {
+                continue;
+            }
+
+            graph->started |= bit;
+            graph->started_at[phase] = g_get_monotonic_time();
+
+            graph->phases[phase].start(graph, phase, graph->user_data);
+        }
+    }
+    while (graph->rescan);
+
+    graph->scheduling = false;
+
+    if (graph->finished == init_graph_all(graph))
+    {
+        graph->done_cb(graph, graph->user_data);
+    }
+}
+
+void init_graph_run(init_graph_t* graph)
+{
+    init_graph_schedule(graph);
+}
+
+bool init_graph_disable(init_graph_t* graph, guint phase)
+{
+    guint32 bit = INIT_PHASE(phase);
+
+    if ((graph->started | graph->finished) & bit)
+    {
+        return false;
+    }
+
+    graph->disabled |= bit;
+    graph->finished |= bit;
+
+    return true;
+}
+
+void init_graph_finish(init_graph_t* graph, guint phase, bool success)
+{
+    guint32 bit = INIT_PHASE(phase);
+
+    g_return_if_fail((graph->started & ~graph->finished) & bit);
+
+    graph->finished_at[phase] = g_get_monotonic_time();
+    graph->finished |= bit;
+
+    if (success)
+    {
+        graph->succeeded |= bit;
+    }
+    else
+    {
+        g_warning("Init phase '%s' failed", graph->phases[phase].name);
+    }
+
+    init_graph_schedule(graph);
+}
+
+bool init_graph_succeeded(const init_graph_t* graph, guint phase)
+{
+    return graph->succeeded & INIT_PHASE(phase);
+}
+
+bool init_graph_running(const init_graph_t* graph, guint phase)
+{
+    return (graph->started & ~graph->finished) & INIT_PHASE(phase);
+}
+
+void init_graph_log_timings(const init_graph_t* graph, const gchar* name)
+{
+    gint64 last = graph->created_at;
+
+    for (guint phase = 0; phase < graph->num_phases; phase++)
+    {
+        guint32 bit = INIT_PHASE(phase);
+        const gchar* phase_name = graph->phases[phase].name;
+
+        if (!(graph->started & bit))
+        {
+            g_debug("%s: %s %s",
+                    name,
+                    phase_name,
+                    graph->disabled & bit ? "disabled" : "skipped");
+            continue;
+        }
+
+        gint64 started_at = graph->started_at[phase];
+        gint64 finished_at = graph->finished_at[phase];
+
+        g_debug("%s: %s %s, started at %.1f ms, took %.1f ms",
+                name,
+                phase_name,
+                graph->succeeded & bit ? "done" : "failed",
+                (started_at - graph->created_at) / 1000.0,
+                (finished_at - started_at) / 1000.0);
+
+        if (finished_at > last)
+        {
+            last = finished_at;
+        }
+    }
+
+    g_debug("%s: initialized in %.1f ms",
+            name,
+            (last - graph->created_at) / 1000.0);
+}
@@ -22,15 +22,101 @@
 
 #include "profile.h"
 #include "device.h"
+#include "notify.h"
+#include "peer_server.h"
 
 GDBusConnection* connection;
 GMainLoop* loop;
 
+static int exit_status = 0;
+
+static gboolean lazy_properties = FALSE;
+static gint reconnect_grace = 10;
+static gint init_deadline = 5;
+static gint coalesce_window = 0;
+static gint timer_slack = 10;
+static gchar* peer_address = NULL;
+
+static const GOptionEntry options[] = {
+    { "lazy", 'l', 0, G_OPTION_ARG_NONE, &lazy_properties,
+      "Query device state on first access instead of on connect", NULL },
+    { "reconnect-grace", 'g', 0, G_OPTION_ARG_INT, &reconnect_grace,
+      "Keep a lost device for SECONDS in case it reconnects (default 10)",
+      "SECONDS" },
+    { "init-deadline", 'd', 0, G_OPTION_ARG_INT, &init_deadline,
+      "Announce a device after SECONDS even if some interfaces are not "
+      "ready (default 5)",
+      "SECONDS" },
+    { "coalesce-window", 'w', 0, G_OPTION_ARG_INT, &coalesce_window,
+      "Hold device notifications for MS milliseconds and send their "
+      "property changes together (default 0)",
+      "MS" },
+    { "timer-slack", 's', 0, G_OPTION_ARG_INT, &timer_slack,
+      "Let device command timeouts fire up to MS milliseconds late to "
+      "save wakeups (default 10)",
+      "MS" },
+    { "peer-address", 'p', 0, G_OPTION_ARG_STRING, &peer_address,
+      "Also serve devices to local clients connecting directly to ADDRESS, "
+      "e.g. unix:path=/run/mdrd/peer",
+      "ADDRESS" },
+    { NULL }
+};
+
+/*
+ * Startup is asynchronous: the bus connection, name acquisition and profile
+ * registration overlap with each other and with device setup. The daemon
+ * is ready once it has a name and BlueZ has accepted the profile.
+ */
+typedef enum
+{
+    STARTUP_BUS,
+    STARTUP_NAME,
+    STARTUP_PROFILE,
+    STARTUP_NUM_STEPS,
+}
+startup_step_t;
+
+static gint64 startup_time;
+static gint64 startup_done_at[STARTUP_NUM_STEPS];
+static guint32 startup_done;
+
+static void startup_step_done(startup_step_t step)
+{
+    if (startup_done & (1u << step))
+    {
+        return;
+    }
+
+    startup_done |= 1u << step;
+    startup_done_at[step] = g_get_monotonic_time();
+
+    if (startup_done != (1u << STARTUP_NUM_STEPS) - 1)
+    {
+        return;
+    }
+
+    g_message("Ready in %.1f ms (bus %.1f ms, name %.1f ms, profile %.1f ms)",
+              (g_get_monotonic_time() - startup_time) / 1000.0,
+              (startup_done_at[STARTUP_BUS] - startup_time) / 1000.0,
+              (startup_done_at[STARTUP_NAME] - startup_time) / 1000.0,
+              (startup_done_at[STARTUP_PROFILE] - startup_time) / 1000.0);
+
+    notify_send("READY=1");
+}
+
+static void startup_failed(void)
+{
+    exit_status = 1;
+    g_main_loop_quit(loop);
+}
+
 static void
 on_name_acquired(GDBusConnection *connection,
                  const gchar     *name,
                  gpointer         user_data)
-{}
+{
+    startup_step_done(STARTUP_NAME);
+}
 
 static void
 on_name_lost(GDBusConnection *connection,
@@ -39,24 +125,40 @@ on_name_lost(GDBusConnection *connection,
 {
     g_message("Name not reserved, using %s",
               g_dbus_connection_get_unique_name(connection));
+
+    startup_step_done(STARTUP_NAME);
 }
 
-gint main_loop_poll(GPollFD *ufds,
-                    guint nfsd,
-                    gint timeout);
+static void on_profile_registered(void* user_data)
+{
+    startup_step_done(STARTUP_PROFILE);
+}
 
-int main(int argc, char *argv[])
+static void on_profile_register_error(void* user_data)
+{
+    startup_failed();
+}
+
+static void on_bus_acquired(GObject* source,
+                            GAsyncResult* result,
+                            gpointer user_data)
 {
     GError* error = NULL;
 
-    connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+    connection = g_bus_get_finish(result, &error);
     if (connection == NULL)
     {
-        g_prefix_error(&error, "Failed to connect to DBus.\n");
-        g_error("%s\n", error->message);
-        return -1;
+        g_warning("Failed to connect to DBus: %s", error->message);
+        g_error_free(error);
+
+        startup_failed();
+        return;
     }
 
+    startup_step_done(STARTUP_BUS);
+
+    devices_set_connection(connection);
+
     g_bus_own_name_on_connection(
         connection,
         "org.mdr",
@@ -66,20 +168,65 @@ int main(int argc, char *argv[])
         NULL,
         NULL);
 
-    devices_init();
+    profile_register(on_profile_registered,
+                     on_profile_register_error,
+                     NULL);
+}
 
-    profile_init();
-    profile_register();
+gint main_loop_poll(GPollFD *ufds,
+                    guint nfsd,
+                    gint timeout);
+
+int main(int argc, char *argv[])
+{
+    GError* error = NULL;
+
+    startup_time = g_get_monotonic_time();
+
+    GOptionContext* context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, options, NULL);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("%s\n", error->message);
+        return -1;
+    }
+
+    g_option_context_free(context);
 
     loop = g_main_loop_new(NULL, FALSE);
-    g_main_loop_run(loop);
+
+    g_bus_get(G_BUS_TYPE_SYSTEM, NULL, on_bus_acquired, NULL);
+
+    devices_init(lazy_properties,
+                 MAX(reconnect_grace, 0),
+                 MAX(init_deadline, 1),
+                 MAX(coalesce_window, 0),
+                 MAX(timer_slack, 1));
+    profile_init();
+
+    if (peer_address != NULL && !peer_server_start(peer_address))
+    {
+        startup_failed();
+    }
+
+    if (exit_status == 0)
+    {
+        g_main_loop_run(loop);
+    }
+
+    notify_send("STOPPING=1");
 
     g_main_loop_unref(loop);
 
-    g_dbus_connection_close_sync(connection, NULL, NULL);
+    if (connection != NULL)
+    {
+        g_dbus_connection_close_sync(connection, NULL, NULL);
+    }
+
+    peer_server_stop();
 
     devices_deinit();
 
-    return 0;
+    return exit_status;
 }
-
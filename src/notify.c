@@ -0,0 +1,81 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "notify.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+bool notify_send(const gchar* state)
+{
+    const gchar* path = g_getenv("NOTIFY_SOCKET");
+    if (path == NULL)
+    {
+        return false;
+    }
+
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    size_t path_length = strlen(path);
+
+    if ((path[0] != '/' && path[0] != '@')
+            || path_length >= sizeof(address.sun_path))
+    {
+        g_warning("Invalid NOTIFY_SOCKET '%s'", path);
+        return false;
+    }
+
+    memcpy(address.sun_path, path, path_length);
+
+    // A leading '@' denotes an abstract socket.
+    if (address.sun_path[0] == '@')
+    {
+        address.sun_path[0] = '\0';
+    }
+
+    gint fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        g_warning("Failed to create notification socket: %d", errno);
+        return false;
+    }
+
+    ssize_t sent = sendto(fd,
+                          state,
+                          strlen(state),
+                          MSG_NOSIGNAL,
+                          (struct sockaddr*) &address,
+                          offsetof(struct sockaddr_un, sun_path)
+                              + path_length);
+    close(fd);
+
+    if (sent < 0)
+    {
+        g_warning("Failed to notify service manager: %d", errno);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,130 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "peer_server.h"
+
+#include "device.h"
+
+#include <unistd.h>
+
+static GDBusServer* peer_server;
+
+static gboolean peer_server_allow_mechanism(GDBusAuthObserver* observer,
+                                            const gchar* mechanism,
+                                            gpointer user_data)
+{
+    // The only mechanism whose identity is vouched for by the kernel.
+    return g_str_equal(mechanism, "EXTERNAL");
+}
+
+static gboolean peer_server_authorize(GDBusAuthObserver* observer,
+                                      GIOStream* stream,
+                                      GCredentials* credentials,
+                                      gpointer user_data)
+{
+    if (credentials == NULL)
+    {
+        g_message("Rejected peer without credentials");
+        return FALSE;
+    }
+
+    uid_t uid = g_credentials_get_unix_user(credentials, NULL);
+
+    if (uid != 0 && uid != geteuid())
+    {
+        g_message("Rejected peer with uid %u", (guint) uid);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean peer_server_new_connection(GDBusServer* server,
+                                           GDBusConnection* peer,
+                                           gpointer user_data)
+{
+    g_debug("Peer connected");
+
+    devices_add_peer(peer);
+
+    return TRUE;
+}
+
+bool peer_server_start(const gchar* address)
+{
+    GError* error = NULL;
+    GDBusAuthObserver* observer = g_dbus_auth_observer_new();
+    gchar* guid = g_dbus_generate_guid();
+
+    g_signal_connect(observer,
+                     "allow-mechanism",
+                     G_CALLBACK(peer_server_allow_mechanism),
+                     NULL);
+
+    g_signal_connect(observer,
+                     "authorize-authenticated-peer",
+                     G_CALLBACK(peer_server_authorize),
+                     NULL);
+
+    peer_server = g_dbus_server_new_sync(address,
+                                         G_DBUS_SERVER_FLAGS_NONE,
+                                         guid,
+                                         observer,
+                                         NULL,
+                                         &error);
+
+    g_object_unref(observer);
+    g_free(guid);
+
+    if (peer_server == NULL)
+    {
+        g_warning("Failed to listen for peers on %s: %s",
+                  address,
+                  error->message);
+        g_error_free(error);
+        return false;
+    }
+
+    g_signal_connect(peer_server,
+                     "new-connection",
+                     G_CALLBACK(peer_server_new_connection),
+                     NULL);
+
+    g_dbus_server_start(peer_server);
+
+    g_message("Listening for peers on %s",
+              g_dbus_server_get_client_address(peer_server));
+
+    return true;
+}
+
+void peer_server_stop(void)
+{
+    if (peer_server == NULL)
+    {
+        return;
+    }
+
+    g_dbus_server_stop(peer_server);
+    g_object_unref(peer_server);
+    peer_server = NULL;
+}
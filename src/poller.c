@@ -0,0 +1,431 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "poller.h"
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#ifdef MDRD_IO_URING
+#include <liburing.h>
+#include <sys/eventfd.h>
+
+#define POLLER_URING_ENTRIES 256
+#endif
+
+#define POLLER_MAX_EVENTS 64
+
+struct poller_watch
+{
+    gint fd;
+    GIOCondition condition;
+    void* data;
+
+    // Only used by the io_uring backend.
+    bool armed;
+    bool removed;
+};
+
+struct poller
+{
+    gint epoll_fd;
+
+#ifdef MDRD_IO_URING
+    bool uring;
+    struct io_uring ring;
+    gint event_fd;
+#endif
+};
+
+static uint32_t poller_condition_to_epoll(GIOCondition condition)
+{
+    return ((condition & G_IO_IN) ? EPOLLIN : 0)
+         | ((condition & G_IO_OUT) ? EPOLLOUT : 0);
+}
+
+static GIOCondition poller_epoll_to_condition(uint32_t events)
+{
+    return ((events & EPOLLIN) ? G_IO_IN : 0)
+         | ((events & EPOLLOUT) ? G_IO_OUT : 0)
+         | ((events & EPOLLERR) ? G_IO_ERR : 0)
+         | ((events & EPOLLHUP) ? G_IO_HUP : 0);
+}
+
+#ifdef MDRD_IO_URING
+
+static bool poller_uring_init(poller_t* poller)
+{
+    int result = io_uring_queue_init(POLLER_URING_ENTRIES, &poller->ring, 0);
+    if (result < 0)
+    {
+        g_message("io_uring unavailable (%d), using epoll", -result);
+        return false;
+    }
+
+    poller->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (poller->event_fd < 0)
+    {
+        g_warning("Failed to create io_uring eventfd: %d", errno);
+        io_uring_queue_exit(&poller->ring);
+        return false;
+    }
+
+    result = io_uring_register_eventfd(&poller->ring, poller->event_fd);
+    if (result < 0)
+    {
+        g_warning("Failed to register io_uring eventfd: %d", -result);
+        close(poller->event_fd);
+        io_uring_queue_exit(&poller->ring);
+        return false;
+    }
+
+    return true;
+}
+
+static struct io_uring_sqe* poller_uring_get_sqe(poller_t* poller)
+{
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&poller->ring);
+
+    if (sqe == NULL)
+    {
+        // Submission queue full, flush it and try again.
+        io_uring_submit(&poller->ring);
+        sqe = io_uring_get_sqe(&poller->ring);
+    }
+
+    if (sqe == NULL)
+    {
+        g_error("io_uring submission queue exhausted");
+    }
+
+    return sqe;
+}
+
+static void poller_uring_arm(poller_t* poller, poller_watch_t* watch)
+{
+    struct io_uring_sqe* sqe = poller_uring_get_sqe(poller);
+
+    io_uring_prep_poll_add(sqe, watch->fd, watch->condition);
+    io_uring_sqe_set_data(sqe, watch);
+
+    watch->armed = true;
+}
+
+static void poller_uring_modify(poller_t* poller,
+                                poller_watch_t* watch,
+                                GIOCondition condition)
+{
+    if (!watch->armed)
+    {
+        watch->condition = condition;
+        poller_uring_arm(poller, watch);
+        return;
+    }
+
+    if (watch->condition == condition)
+    {
+        return;
+    }
+
+    watch->condition = condition;
+
+    struct io_uring_sqe* sqe = poller_uring_get_sqe(poller);
+
+    io_uring_prep_poll_update(sqe,
+                              (uintptr_t) watch,
+                              (uintptr_t) watch,
+                              condition,
+                              IORING_POLL_UPDATE_EVENTS);
+    io_uring_sqe_set_data(sqe, NULL);
+}
+
+static void poller_uring_remove(poller_t* poller, poller_watch_t* watch)
+{
+    if (!watch->armed)
+    {
+        g_free(watch);
+        return;
+    }
+
+    // Freed once the cancelled request completes.
+    watch->removed = true;
+
+    struct io_uring_sqe* sqe = poller_uring_get_sqe(poller);
+
+    io_uring_prep_poll_remove(sqe, (uintptr_t) watch);
+    io_uring_sqe_set_data(sqe, NULL);
+}
+
+static int poller_uring_wait(poller_t* poller,
+                             poller_event_t* events,
+                             int max_events)
+{
+    uint64_t count;
+
+    if (read(poller->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        g_warning("Failed to read io_uring eventfd: %d", errno);
+    }
+
+    int num_events = 0;
+    struct io_uring_cqe* cqe;
+
+    while (num_events < max_events
+            && io_uring_peek_cqe(&poller->ring, &cqe) == 0)
+    {
+        poller_watch_t* watch = io_uring_cqe_get_data(cqe);
+        int result = cqe->res;
+
+        io_uring_cqe_seen(&poller->ring, cqe);
+
+        // Completions of updates and removals carry no watch.
+        if (watch == NULL)
+        {
+            continue;
+        }
+
+        watch->armed = false;
+
+        if (watch->removed)
+        {
+            g_free(watch);
+            continue;
+        }
+
+        events[num_events].data = watch->data;
+        events[num_events].condition = result < 0
+            ? G_IO_ERR
+            : poller_epoll_to_condition(result);
+        num_events++;
+    }
+
+    return num_events;
+}
+
+#endif
+
+poller_t* poller_new(void)
+{
+    poller_t* poller = g_new0(poller_t, 1);
+
+    poller->epoll_fd = -1;
+
+#ifdef MDRD_IO_URING
+    poller->uring = poller_uring_init(poller);
+
+    if (poller->uring)
+    {
+        return poller;
+    }
+#endif
+
+    poller->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->epoll_fd < 0)
+    {
+        g_warning("Failed to create epoll fd: %d", errno);
+        g_free(poller);
+        return NULL;
+    }
+
+    return poller;
+}
+
+void poller_free(poller_t* poller)
+{
+#ifdef MDRD_IO_URING
+    if (poller->uring)
+    {
+        io_uring_queue_exit(&poller->ring);
+        close(poller->event_fd);
+    }
+#endif
+
+    if (poller->epoll_fd >= 0)
+    {
+        close(poller->epoll_fd);
+    }
+
+    g_free(poller);
+}
+
+gint poller_get_fd(poller_t* poller)
+{
+#ifdef MDRD_IO_URING
+    if (poller->uring)
+    {
+        return poller->event_fd;
+    }
+#endif
+
+    return poller->epoll_fd;
+}
+
+const char* poller_get_backend_name(poller_t* poller)
+{
+#ifdef MDRD_IO_URING
+    if (poller->uring)
+    {
+        return "io_uring";
+    }
+#endif
+
+    return "epoll";
+}
+
+poller_watch_t* poller_add(poller_t* poller,
+                           gint fd,
+                           GIOCondition condition,
+                           void* data)
+{
+    poller_watch_t* watch = g_new0(poller_watch_t, 1);
+
+    watch->fd = fd;
+    watch->condition = condition;
+    watch->data = data;
+
+#ifdef MDRD_IO_URING
+    if (poller->uring)
+    {
+        poller_uring_arm(poller, watch);
+        return watch;
+    }
+#endif
+
+    struct epoll_event event = {
+        .events = poller_condition_to_epoll(condition),
+        .data.ptr = watch,
+    };
+
+    if (epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        g_warning("Failed to add fd %d to epoll: %d", fd, errno);
+        g_free(watch);
+        return NULL;
+    }
+
+    return watch;
+}
+
+void poller_modify(poller_t* poller,
+                   poller_watch_t* watch,
+                   GIOCondition condition)
+{
+#ifdef MDRD_IO_URING
+    if (poller->uring)
+    {
+        poller_uring_modify(poller, watch, condition);
+        return;
+    }
+#endif
+
+    if (watch->condition == condition)
+    {
+        return;
+    }
+
+    struct epoll_event event = {
+        .events = poller_condition_to_epoll(condition),
+        .data.ptr = watch,
+    };
+
+    if (epoll_ctl(poller->epoll_fd, EPOLL_CTL_MOD, watch->fd, &event) < 0)
+    {
+        g_warning("Failed to update fd %d in epoll: %d", watch->fd, errno);
+        return;
+    }
+
+    watch->condition = condition;
+}
+
+void poller_remove(poller_t* poller, poller_watch_t* watch)
+{
+#ifdef MDRD_IO_URING
+    if (poller->uring)
+    {
+        poller_uring_remove(poller, watch);
+        return;
+    }
+#endif
+
+    epoll_ctl(poller->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+
+    g_free(watch);
+}
+
+void poller_commit(poller_t* poller)
+{
+#ifdef MDRD_IO_URING
+    if (poller->uring && io_uring_sq_ready(&poller->ring) > 0)
+    {
+        io_uring_submit(&poller->ring);
+    }
+#endif
+}
+
+bool poller_has_pending(poller_t* poller)
+{
+#ifdef MDRD_IO_URING
+    if (poller->uring)
+    {
+        return io_uring_cq_ready(&poller->ring) > 0;
+    }
+#endif
+
+    return false;
+}
+
+int poller_wait(poller_t* poller, poller_event_t* events, int max_events)
+{
+#ifdef MDRD_IO_URING
+    if (poller->uring)
+    {
+        return poller_uring_wait(poller, events, max_events);
+    }
+#endif
+
+    struct epoll_event epoll_events[POLLER_MAX_EVENTS];
+
+    int num_events = epoll_wait(poller->epoll_fd,
+                                epoll_events,
+                                MIN(max_events, POLLER_MAX_EVENTS),
+                                0);
+
+    if (num_events < 0)
+    {
+        if (errno != EINTR)
+        {
+            g_warning("epoll_wait failed: %d", errno);
+        }
+
+        return 0;
+    }
+
+    for (int i = 0; i < num_events; i++)
+    {
+        poller_watch_t* watch = epoll_events[i].data.ptr;
+
+        events[i].data = watch->data;
+        events[i].condition = poller_epoll_to_condition(epoll_events[i].events);
+    }
+
+    return num_events;
+}
@@ -56,8 +56,6 @@ static OrgBluezProfile1* profile_interface;
 
 void profile_init()
 {
-    GError* error = NULL;
-
     profile_interface = org_bluez_profile1_skeleton_new();
 
     g_signal_connect(profile_interface,
@@ -74,16 +72,6 @@ void profile_init()
                      "handle-release",
                      G_CALLBACK(on_profile_release),
                      NULL);
-
-    if (!g_dbus_interface_skeleton_export(
-            G_DBUS_INTERFACE_SKELETON(profile_interface),
-            connection,
-            "/org/mdr",
-            &error))
-    {
-        g_warning("Failed to register profile: %s\n", error->message);
-        exit(1);
-    }
 }
 
 void profile_deinit()
@@ -179,10 +167,43 @@ static gboolean on_profile_release(OrgBluezProfile1* profile_interface,
     return TRUE;
 }
 
-void profile_register()
+typedef struct
+{
+    profile_registered_cb success_cb;
+    profile_register_error_cb error_cb;
+    void* user_data;
+}
+profile_register_data;
+
+static void profile_register_result(GObject* source,
+                                    GAsyncResult* result,
+                                    gpointer user_data);
+
+void profile_register(profile_registered_cb success_cb,
+                      profile_register_error_cb error_cb,
+                      void* user_data)
 {
     GError* error = NULL;
 
+    if (!g_dbus_interface_skeleton_export(
+            G_DBUS_INTERFACE_SKELETON(profile_interface),
+            connection,
+            "/org/mdr",
+            &error))
+    {
+        g_warning("Failed to register profile: %s", error->message);
+        g_error_free(error);
+
+        error_cb(user_data);
+        return;
+    }
+
+    profile_register_data* data = g_new(profile_register_data, 1);
+
+    data->success_cb = success_cb;
+    data->error_cb = error_cb;
+    data->user_data = user_data;
+
     GVariantBuilder* options = g_variant_builder_new(G_VARIANT_TYPE("a{sv}"));
     g_variant_builder_add(options, "{sv}",
                           "Name",
@@ -194,7 +215,7 @@ void profile_register()
                           "AutoConnect",
                           g_variant_new_boolean(TRUE));
 
-    GVariant* result = g_dbus_connection_call_sync(
+    g_dbus_connection_call(
             connection,
             "org.bluez",
             "/org/bluez",
@@ -209,16 +230,38 @@ void profile_register()
             G_DBUS_CALL_FLAGS_NONE,
             -1,
             NULL,
+            profile_register_result,
+            data);
+
+    g_variant_builder_unref(options);
+}
+
+static void profile_register_result(GObject* source,
+                                    GAsyncResult* result,
+                                    gpointer user_data)
+{
+    profile_register_data* data = user_data;
+    GError* error = NULL;
+
+    GVariant* reply = g_dbus_connection_call_finish(
+            G_DBUS_CONNECTION(source),
+            result,
             &error);
 
-    if (result == NULL)
+    if (reply == NULL)
     {
-        g_prefix_error(&error, "Failed to register MDR profile\n");
-        g_error("%s\n", error->message);
-        g_abort();
+        g_warning("Failed to register MDR profile: %s", error->message);
+        g_error_free(error);
+
+        data->error_cb(data->user_data);
     }
+    else
+    {
+        g_variant_unref(reply);
 
-    g_variant_builder_unref(options);
-    g_variant_unref(result);
+        data->success_cb(data->user_data);
+    }
+
+    g_free(data);
 }
 
@@ -0,0 +1,336 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "reactor.h"
+
+#include "poller.h"
+#include "timer_wheel.h"
+
+#define REACTOR_MAX_EVENTS 64
+
+struct reactor_entry
+{
+    reactor_poll_cb poll_cb;
+    reactor_ready_cb ready_cb;
+    void* user_data;
+
+    poller_watch_t* watch;
+
+    timer_wheel_timer_t timer;
+
+    bool removed;
+
+    GList dirty_link;
+    bool dirty;
+};
+
+struct reactor
+{
+    GSource source;
+
+    poller_t* poller;
+    gpointer poller_tag;
+
+    // Entries whose cached poll info must be refreshed.
+    GQueue dirty;
+
+    // Deadlines of every entry with a pending timeout.
+    timer_wheel_t* timers;
+
+    // Entries removed during dispatch, freed once it returns.
+    GSList* graveyard;
+    bool dispatching;
+};
+
+static gboolean reactor_prepare(GSource*, gint* timeout);
+static gboolean reactor_check(GSource*);
+static gboolean reactor_dispatch(GSource*, GSourceFunc, gpointer);
+static void reactor_finalize(GSource*);
+
+static GSourceFuncs reactor_funcs = {
+    .prepare = reactor_prepare,
+    .check = reactor_check,
+    .dispatch = reactor_dispatch,
+    .finalize = reactor_finalize,
+};
+
+reactor_t* reactor_new(GMainContext* context, guint timer_slack)
+{
+    poller_t* poller = poller_new();
+    if (poller == NULL)
+    {
+        return NULL;
+    }
+
+    g_debug("Device reactor using %s", poller_get_backend_name(poller));
+
+    reactor_t* reactor
+        = (reactor_t*) g_source_new(&reactor_funcs, sizeof(reactor_t));
+
+    reactor->poller = poller;
+    reactor->poller_tag = g_source_add_unix_fd(&reactor->source,
+                                               poller_get_fd(poller),
+                                               G_IO_IN);
+    g_queue_init(&reactor->dirty);
+    reactor->timers = timer_wheel_new((gint64) MAX(timer_slack, 1) * 1000,
+                                      g_get_monotonic_time());
+    reactor->graveyard = NULL;
+    reactor->dispatching = false;
+
+    g_source_set_name(&reactor->source, "mdrd device reactor");
+    g_source_attach(&reactor->source, context);
+
+    return reactor;
+}
+
+void reactor_free(reactor_t* reactor)
+{
+    g_source_destroy(&reactor->source);
+    g_source_unref(&reactor->source);
+}
+
+static void reactor_finalize(GSource* source)
+{
+    reactor_t* reactor = (reactor_t*) source;
+
+    poller_free(reactor->poller);
+
+    timer_wheel_free(reactor->timers);
+}
+
+static GIOCondition reactor_condition(bool write)
+{
+    return G_IO_IN | (write ? G_IO_OUT : 0);
+}
+
+reactor_entry_t* reactor_add(reactor_t* reactor,
+                             gint fd,
+                             reactor_poll_cb poll_cb,
+                             reactor_ready_cb ready_cb,
+                             void* user_data)
+{
+    reactor_entry_t* entry = g_new0(reactor_entry_t, 1);
+
+    entry->poll_cb = poll_cb;
+    entry->ready_cb = ready_cb;
+    entry->user_data = user_data;
+    entry->dirty_link.data = entry;
+    timer_wheel_timer_init(&entry->timer);
+
+    entry->watch = poller_add(reactor->poller,
+                              fd,
+                              reactor_condition(false),
+                              entry);
+    if (entry->watch == NULL)
+    {
+        g_free(entry);
+        return NULL;
+    }
+
+    reactor_invalidate(reactor, entry);
+
+    return entry;
+}
+
+void reactor_remove(reactor_t* reactor, reactor_entry_t* entry)
+{
+    if (entry->removed)
+    {
+        return;
+    }
+
+    poller_remove(reactor->poller, entry->watch);
+    entry->watch = NULL;
+
+    entry->removed = true;
+
+    if (entry->dirty)
+    {
+        g_queue_unlink(&reactor->dirty, &entry->dirty_link);
+        entry->dirty = false;
+    }
+
+    timer_wheel_cancel(reactor->timers, &entry->timer);
+
+    if (reactor->dispatching)
+    {
+        // Events for this entry may still be pending in the current batch.
+        reactor->graveyard = g_slist_prepend(reactor->graveyard, entry);
+    }
+    else
+    {
+        g_free(entry);
+    }
+}
+
+void reactor_invalidate(reactor_t* reactor, reactor_entry_t* entry)
+{
+    if (entry->removed || entry->dirty)
+    {
+        return;
+    }
+
+    entry->dirty = true;
+    g_queue_push_tail_link(&reactor->dirty, &entry->dirty_link);
+}
+
+static void reactor_refresh(reactor_t* reactor,
+                            reactor_entry_t* entry,
+                            gint64 now)
+{
+    mdr_poll_info poll_info = entry->poll_cb(entry->user_data);
+
+    // Also re-arms the watch after it has been dispatched.
+    poller_modify(reactor->poller,
+                  entry->watch,
+                  reactor_condition(poll_info.write));
+
+    if (poll_info.timeout < 0)
+    {
+        timer_wheel_cancel(reactor->timers, &entry->timer);
+    }
+    else
+    {
+        timer_wheel_schedule(reactor->timers,
+                             &entry->timer,
+                             now + (gint64) poll_info.timeout * 1000);
+    }
+}
+
+static gboolean reactor_prepare(GSource* source, gint* timeout)
+{
+    reactor_t* reactor = (reactor_t*) source;
+    gint64 now = g_source_get_time(source);
+
+    GList* link;
+    while ((link = g_queue_pop_head_link(&reactor->dirty)) != NULL)
+    {
+        reactor_entry_t* entry = link->data;
+        entry->dirty = false;
+
+        reactor_refresh(reactor, entry, now);
+    }
+
+    poller_commit(reactor->poller);
+
+    if (poller_has_pending(reactor->poller))
+    {
+        *timeout = 0;
+        return TRUE;
+    }
+
+    gint64 deadline = timer_wheel_next_deadline(reactor->timers);
+
+    if (deadline < 0)
+    {
+        *timeout = -1;
+        return FALSE;
+    }
+
+    if (deadline <= now)
+    {
+        *timeout = 0;
+        return TRUE;
+    }
+
+    // Round up so we do not wake up just before the deadline.
+    *timeout = (deadline - now + 999) / 1000;
+
+    return FALSE;
+}
+
+static gboolean reactor_check(GSource* source)
+{
+    reactor_t* reactor = (reactor_t*) source;
+
+    if ((g_source_query_unix_fd(source, reactor->poller_tag) & G_IO_IN)
+            || poller_has_pending(reactor->poller))
+    {
+        return TRUE;
+    }
+
+    gint64 deadline = timer_wheel_next_deadline(reactor->timers);
+
+    return deadline >= 0 && deadline <= g_source_get_time(source);
+}
+
+static void reactor_expire(timer_wheel_timer_t* timer, void* user_data)
+{
+    reactor_t* reactor = user_data;
+    reactor_entry_t* entry
+        = (reactor_entry_t*) ((char*) timer - offsetof(reactor_entry_t, timer));
+
+    // Entries handled above will have their timeout recomputed anyway.
+    if (entry->dirty)
+    {
+        return;
+    }
+
+    reactor_invalidate(reactor, entry);
+
+    entry->ready_cb(0, entry->user_data);
+}
+
+static gboolean reactor_dispatch(GSource* source,
+                                 GSourceFunc callback,
+                                 gpointer user_data)
+{
+    reactor_t* reactor = (reactor_t*) source;
+    poller_event_t events[REACTOR_MAX_EVENTS];
+
+    reactor->dispatching = true;
+
+    int num_events = poller_wait(reactor->poller,
+                                 events,
+                                 REACTOR_MAX_EVENTS);
+
+    for (int i = 0; i < num_events; i++)
+    {
+        reactor_entry_t* entry = events[i].data;
+
+        if (entry->removed)
+        {
+            continue;
+        }
+
+        reactor_invalidate(reactor, entry);
+
+        entry->ready_cb(events[i].condition, entry->user_data);
+    }
+
+    timer_wheel_advance(reactor->timers,
+                        g_source_get_time(source),
+                        reactor_expire,
+                        reactor);
+
+    reactor->dispatching = false;
+
+    g_slist_free_full(reactor->graveyard, g_free);
+    reactor->graveyard = NULL;
+
+    if (callback != NULL)
+    {
+        callback(user_data);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
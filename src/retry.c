@@ -0,0 +1,63 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "retry.h"
+
+void retry_state_init(retry_state_t* state, guint budget)
+{
+    state->budget = budget;
+
+    state->retries = 0;
+    state->recovered = 0;
+    state->exhausted = 0;
+}
+
+bool retry_next(const retry_policy_t* policy,
+                retry_state_t* state,
+                guint attempts,
+                guint* delay)
+{
+    if (attempts > policy->max_retries || state->budget == 0)
+    {
+        state->exhausted++;
+        return false;
+    }
+
+    guint64 backoff = (guint64) policy->initial_delay
+                      << MIN(attempts - 1, 31);
+    guint capped = MIN(backoff, policy->max_delay);
+
+    *delay = capped - g_random_int_range(0, capped / 2 + 1);
+
+    state->budget--;
+    state->retries++;
+
+    return true;
+}
+
+void retry_succeeded(retry_state_t* state, guint attempts)
+{
+    if (attempts > 0)
+    {
+        state->recovered++;
+    }
+}
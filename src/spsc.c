@@ -0,0 +1,113 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "spsc.h"
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPSC_CACHE_LINE 64
+
+struct spsc_queue
+{
+    size_t mask;
+    size_t element_size;
+
+    // Only written by the consumer.
+    alignas(SPSC_CACHE_LINE) atomic_size_t head;
+
+    // Only written by the producer.
+    alignas(SPSC_CACHE_LINE) atomic_size_t tail;
+
+    alignas(SPSC_CACHE_LINE) unsigned char buffer[];
+};
+
+spsc_queue_t* spsc_queue_new(size_t capacity, size_t element_size)
+{
+    size_t size = 1;
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+
+    spsc_queue_t* queue = aligned_alloc(
+            SPSC_CACHE_LINE,
+            (sizeof(spsc_queue_t) + size * element_size + SPSC_CACHE_LINE - 1)
+                / SPSC_CACHE_LINE * SPSC_CACHE_LINE);
+    if (queue == NULL)
+    {
+        return NULL;
+    }
+
+    queue->mask = size - 1;
+    queue->element_size = element_size;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+
+    return queue;
+}
+
+void spsc_queue_free(spsc_queue_t* queue)
+{
+    free(queue);
+}
+
+bool spsc_queue_push(spsc_queue_t* queue, const void* element)
+{
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    if (tail - head > queue->mask)
+    {
+        return false;
+    }
+
+    memcpy(&queue->buffer[(tail & queue->mask) * queue->element_size],
+           element,
+           queue->element_size);
+
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+
+    return true;
+}
+
+bool spsc_queue_pop(spsc_queue_t* queue, void* element)
+{
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+    if (head == tail)
+    {
+        return false;
+    }
+
+    memcpy(element,
+           &queue->buffer[(head & queue->mask) * queue->element_size],
+           queue->element_size);
+
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+    return true;
+}
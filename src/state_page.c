@@ -0,0 +1,217 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// For memfd_create and file sealing.
+#define _GNU_SOURCE
+
+#include "state_page.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+_Static_assert(sizeof(state_page_layout_t) == 48,
+               "The state page layout is shared with clients");
+
+struct state_page
+{
+    gint fd;
+    state_page_layout_t* layout;
+};
+
+state_page_t* state_page_new(void)
+{
+    gint fd = memfd_create("mdrd-state", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+    {
+        g_warning("Failed to create state page: %d", errno);
+        return NULL;
+    }
+
+    if (ftruncate(fd, sizeof(state_page_layout_t)) < 0)
+    {
+        g_warning("Failed to size state page: %d", errno);
+        close(fd);
+        return NULL;
+    }
+
+    state_page_layout_t* layout = mmap(NULL,
+                                       sizeof(state_page_layout_t),
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_SHARED,
+                                       fd,
+                                       0);
+    if (layout == MAP_FAILED)
+    {
+        g_warning("Failed to map state page: %d", errno);
+        close(fd);
+        return NULL;
+    }
+
+    // Clients can neither resize the page under other clients' mappings
+    // nor, where the kernel supports it, map it writable.
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0)
+    {
+        g_warning("Failed to seal state page: %d", errno);
+        munmap(layout, sizeof(state_page_layout_t));
+        close(fd);
+        return NULL;
+    }
+
+#ifdef F_SEAL_FUTURE_WRITE
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE) < 0)
+    {
+        g_debug("State page stays writable for clients: %d", errno);
+    }
+#endif
+
+    layout->magic = STATE_PAGE_MAGIC;
+    layout->version = STATE_PAGE_VERSION;
+    layout->size = sizeof(state_page_layout_t);
+    atomic_init(&layout->sequence, 0);
+    layout->valid = 0;
+
+    state_page_t* page = g_new0(state_page_t, 1);
+
+    page->fd = fd;
+    page->layout = layout;
+
+    return page;
+}
+
+static void state_page_begin(state_page_t* page)
+{
+    uint32_t sequence = atomic_load_explicit(&page->layout->sequence,
+                                             memory_order_relaxed);
+
+    atomic_store_explicit(&page->layout->sequence,
+                          sequence + 1,
+                          memory_order_relaxed);
+
+    // Orders the odd sequence before the writes that follow.
+    atomic_thread_fence(memory_order_release);
+}
+
+static void state_page_end(state_page_t* page)
+{
+    uint32_t sequence = atomic_load_explicit(&page->layout->sequence,
+                                             memory_order_relaxed);
+
+    atomic_store_explicit(&page->layout->sequence,
+                          sequence + 1,
+                          memory_order_release);
+}
+
+void state_page_free(state_page_t* page)
+{
+    state_page_begin(page);
+    page->layout->valid = 0;
+    state_page_end(page);
+
+    munmap(page->layout, sizeof(state_page_layout_t));
+    close(page->fd);
+
+    g_free(page);
+}
+
+gint state_page_get_fd(state_page_t* page)
+{
+    return page->fd;
+}
+
+void state_page_write(state_page_t* page,
+                      device_command_type_t command,
+                      const device_value_t* value)
+{
+    state_page_layout_t* layout = page->layout;
+    uint8_t band_count;
+
+    state_page_begin(page);
+
+    switch (command)
+    {
+        case DEVICE_COMMAND_GET_BATTERY:
+            layout->battery_level = value->battery.level;
+            layout->battery_charging = value->battery.charging;
+            layout->valid |= STATE_PAGE_VALID_BATTERY;
+            break;
+
+        case DEVICE_COMMAND_GET_LEFT_RIGHT_BATTERY:
+            layout->left_battery_level = value->left_right_battery.left_level;
+            layout->left_battery_charging
+                = value->left_right_battery.left_charging;
+            layout->right_battery_level
+                = value->left_right_battery.right_level;
+            layout->right_battery_charging
+                = value->left_right_battery.right_charging;
+            layout->valid |= STATE_PAGE_VALID_LEFT_RIGHT_BATTERY;
+            break;
+
+        case DEVICE_COMMAND_GET_CRADLE_BATTERY:
+            layout->cradle_battery_level = value->battery.level;
+            layout->cradle_battery_charging = value->battery.charging;
+            layout->valid |= STATE_PAGE_VALID_CRADLE_BATTERY;
+            break;
+
+        case DEVICE_COMMAND_GET_LEFT_RIGHT_CONNECTION_STATUS:
+            layout->left_connected
+                = value->left_right_connection_status.left_connected;
+            layout->right_connected
+                = value->left_right_connection_status.right_connected;
+            layout->valid |= STATE_PAGE_VALID_LEFT_RIGHT;
+            break;
+
+        case DEVICE_COMMAND_GET_NOISE_CANCELLING:
+            layout->noise_cancelling = value->noise_cancelling.enabled;
+            layout->valid |= STATE_PAGE_VALID_NOISE_CANCELLING;
+            break;
+
+        case DEVICE_COMMAND_GET_AMBIENT_SOUND_MODE:
+            layout->ambient_sound_amount = value->ambient_sound_mode.amount;
+            layout->ambient_sound_voice = value->ambient_sound_mode.voice;
+            layout->valid |= STATE_PAGE_VALID_AMBIENT_SOUND_MODE;
+            break;
+
+        case DEVICE_COMMAND_GET_EQ_PRESET_AND_LEVELS:
+            band_count = MIN(value->eq_preset_and_levels.num_levels,
+                             STATE_PAGE_MAX_EQ_BANDS);
+
+            memcpy(layout->eq_levels,
+                   value->eq_preset_and_levels.levels,
+                   band_count);
+            layout->eq_band_count = band_count;
+            layout->valid |= STATE_PAGE_VALID_EQ;
+            break;
+
+        case DEVICE_COMMAND_GET_VOLUME:
+            layout->volume = value->playback.volume;
+            layout->valid |= STATE_PAGE_VALID_PLAYBACK;
+            break;
+
+        default:
+            break;
+    }
+
+    state_page_end(page);
+}
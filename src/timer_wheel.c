@@ -0,0 +1,284 @@
+/*
+ * mdrd - MDR daemon
+ *
+ *  Copyright (C) 2021 Andreas Olofsson
+ *
+ *
+ * This file is part of mdrd.
+ *
+ * mdrd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mdr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mdrd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// Timers further away than this are clamped to the last slot.
+#define TIMER_WHEEL_MAX_DELTA \
+    (((guint64) 1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS)) - 1)
+
+// `level` of a timer that has expired but not yet been fired.
+#define TIMER_WHEEL_EXPIRED TIMER_WHEEL_LEVELS
+
+struct timer_wheel
+{
+    gint64 tick;
+
+    // The next tick to be processed.
+    guint64 current;
+
+    guint level_count[TIMER_WHEEL_LEVELS];
+    GQueue slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+    // Timers popped from a slot, waiting for their expire callback.
+    GQueue expired;
+};
+
+timer_wheel_t* timer_wheel_new(gint64 tick, gint64 now)
+{
+    timer_wheel_t* wheel = g_new0(timer_wheel_t, 1);
+
+    wheel->tick = tick > 0 ? tick : 1;
+    wheel->current = now / wheel->tick;
+
+    return wheel;
+}
+
+void timer_wheel_free(timer_wheel_t* wheel)
+{
+    g_free(wheel);
+}
+
+void timer_wheel_timer_init(timer_wheel_timer_t* timer)
+{
+    timer->expires = 0;
+    timer->link.data = timer;
+    timer->link.prev = NULL;
+    timer->link.next = NULL;
+    timer->slot = NULL;
+    timer->level = 0;
+}
+
+bool timer_wheel_timer_pending(const timer_wheel_timer_t* timer)
+{
+    return timer->slot != NULL;
+}
+
+static void timer_wheel_insert(timer_wheel_t* wheel,
+                               timer_wheel_timer_t* timer)
+{
+    guint64 expires = timer->expires;
+
+    if (expires < wheel->current)
+    {
+        // Already due, fire on the next tick.
+        expires = wheel->current;
+    }
+    else if (expires - wheel->current > TIMER_WHEEL_MAX_DELTA)
+    {
+        expires = wheel->current + TIMER_WHEEL_MAX_DELTA;
+    }
+
+    guint64 delta = expires - wheel->current;
+    guint level = 0;
+
+    while (level < TIMER_WHEEL_LEVELS - 1
+            && delta >> ((level + 1) * TIMER_WHEEL_SLOT_BITS) != 0)
+    {
+        level++;
+    }
+
+    guint index = (expires >> (level * TIMER_WHEEL_SLOT_BITS))
+                & TIMER_WHEEL_SLOT_MASK;
+
+    timer->level = level;
+    timer->slot = &wheel->slots[level][index];
+    g_queue_push_tail_link(timer->slot, &timer->link);
+
+    wheel->level_count[level]++;
+}
+
+void timer_wheel_cancel(timer_wheel_t* wheel, timer_wheel_timer_t* timer)
+{
+    if (timer->slot == NULL)
+    {
+        return;
+    }
+
+    g_queue_unlink(timer->slot, &timer->link);
+    timer->slot = NULL;
+
+    if (timer->level != TIMER_WHEEL_EXPIRED)
+    {
+        wheel->level_count[timer->level]--;
+    }
+}
+
+void timer_wheel_schedule(timer_wheel_t* wheel,
+                          timer_wheel_timer_t* timer,
+                          gint64 deadline)
+{
+    timer_wheel_cancel(wheel, timer);
+
+    // Round up so the timer never fires early.
+    timer->expires = (deadline + wheel->tick - 1) / wheel->tick;
+
+    timer_wheel_insert(wheel, timer);
+}
+
+static bool timer_wheel_empty(timer_wheel_t* wheel)
+{
+    for (guint level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        if (wheel->level_count[level] > 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+gint64 timer_wheel_next_deadline(timer_wheel_t* wheel)
+{
+    if (timer_wheel_empty(wheel))
+    {
+        return -1;
+    }
+
+    guint64 next = G_MAXUINT64;
+
+    if (wheel->level_count[0] > 0)
+    {
+        for (guint64 tick = wheel->current;
+                tick < wheel->current + TIMER_WHEEL_SLOTS;
+                tick++)
+        {
+            if (!g_queue_is_empty(
+                        &wheel->slots[0][tick & TIMER_WHEEL_SLOT_MASK]))
+            {
+                next = tick;
+                break;
+            }
+        }
+    }
+
+    for (guint level = 1; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        if (wheel->level_count[level] == 0)
+        {
+            continue;
+        }
+
+        // Timers on higher levels are handed down when their slot
+        // cascades, which happens at the start of the slot's block.
+        guint shift = level * TIMER_WHEEL_SLOT_BITS;
+        guint64 block = wheel->current >> shift;
+        guint64 first = (block << shift) == wheel->current ? block : block + 1;
+
+        for (guint64 b = first; b <= block + TIMER_WHEEL_SLOTS; b++)
+        {
+            if (!g_queue_is_empty(
+                        &wheel->slots[level][b & TIMER_WHEEL_SLOT_MASK]))
+            {
+                if (b << shift < next)
+                {
+                    next = b << shift;
+                }
+                break;
+            }
+        }
+    }
+
+    return (gint64) next * wheel->tick;
+}
+
+static void timer_wheel_cascade(timer_wheel_t* wheel, guint level)
+{
+    guint index = (wheel->current >> (level * TIMER_WHEEL_SLOT_BITS))
+                & TIMER_WHEEL_SLOT_MASK;
+    GQueue* slot = &wheel->slots[level][index];
+
+    GList* link;
+    while ((link = g_queue_pop_head_link(slot)) != NULL)
+    {
+        timer_wheel_timer_t* timer = link->data;
+
+        wheel->level_count[level]--;
+        timer_wheel_insert(wheel, timer);
+    }
+}
+
+void timer_wheel_advance(timer_wheel_t* wheel,
+                         gint64 now,
+                         timer_wheel_expire_cb expire_cb,
+                         void* user_data)
+{
+    guint64 target = now / wheel->tick;
+
+    while (wheel->current <= target)
+    {
+        if (timer_wheel_empty(wheel))
+        {
+            wheel->current = target + 1;
+            break;
+        }
+
+        guint index = wheel->current & TIMER_WHEEL_SLOT_MASK;
+
+        if (index == 0)
+        {
+            for (guint level = 1; level < TIMER_WHEEL_LEVELS; level++)
+            {
+                timer_wheel_cascade(wheel, level);
+
+                if (((wheel->current >> (level * TIMER_WHEEL_SLOT_BITS))
+                            & TIMER_WHEEL_SLOT_MASK) != 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        GQueue* slot = &wheel->slots[0][index];
+
+        GList* link;
+        while ((link = g_queue_pop_head_link(slot)) != NULL)
+        {
+            timer_wheel_timer_t* timer = link->data;
+
+            wheel->level_count[0]--;
+
+            timer->level = TIMER_WHEEL_EXPIRED;
+            timer->slot = &wheel->expired;
+            g_queue_push_tail_link(&wheel->expired, &timer->link);
+        }
+
+        // Advance before firing so timers scheduled from the callbacks
+        // land in slots that are still ahead of us.
+        wheel->current++;
+
+        while ((link = g_queue_pop_head_link(&wheel->expired)) != NULL)
+        {
+            timer_wheel_timer_t* timer = link->data;
+
+            timer->slot = NULL;
+
+            expire_cb(timer, user_data);
+        }
+    }
+}